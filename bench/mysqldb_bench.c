@@ -0,0 +1,617 @@
+/*
+ * MySQL BIND SDB Driver benchmark
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Drives mysqldb_lookup() and mysqldb_allnodes() directly, without named,
+ * against a synthetic dataset in a local MySQL or MariaDB server.  Each
+ * run spreads a number of lookups over a number of threads, with a given
+ * share of them for names that exist, and reports the lookups per second,
+ * the 50th and 99th percentile latency, the allocations made per lookup
+ * and the process's resident size.  See "BENCHMARK" in the README.
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mysql.h>
+
+#include <isc/log.h>
+#include <isc/mem.h>
+#include <isc/result.h>
+#include <isc/thread.h>
+#include <isc/util.h>
+
+#include <dns/sdb.h>
+
+#include "include/mysqldb.h"
+#include "sdb_stub.h"
+
+#define DEFAULT_ZONES 100
+#define DEFAULT_RECORDS 50
+#define DEFAULT_LOOKUPS 100000
+#define DEFAULT_THREADS "1,2,4,8"
+#define DEFAULT_HITS "100,50"
+#define MAX_THREADS 256
+#define MAX_RUNS 32
+#define MAX_OPTIONS 16
+#define INSERT_ROWS 500
+#define TENANT_ID "bench"
+
+/*
+ * Latency histogram: the bucket of a time in nanoseconds is its highest
+ * set bit and the three bits below it, so buckets are within 1/8 of the
+ * times they hold.
+ */
+#define HIST_SUB 3
+#define HIST_BUCKETS (64 << HIST_SUB)
+
+struct zone
+{
+    char name[64];
+    char domain_id[32];
+    void *dbdata;
+};
+
+struct worker
+{
+    isc_thread_t tid;
+    unsigned int seed;
+    unsigned long lookups;
+    unsigned int hits;          /* percent of lookups for existing names */
+    unsigned long found;
+    unsigned long notfound;
+    unsigned long failed;
+    unsigned long records;
+    isc_uint64_t hist[HIST_BUCKETS];
+};
+
+static struct zone *zones;
+static unsigned int nzones = DEFAULT_ZONES;
+static unsigned int nrecords = DEFAULT_RECORDS;
+
+/*
+ * Allocations, counted by the allocator given to the driver's memory
+ * context, and, with glibc, by malloc() for the whole process (the client
+ * library included).
+ */
+static isc_uint64_t mem_allocs = 0;
+static isc_uint64_t malloc_allocs = 0;
+
+static void *bench_memalloc(void *arg, size_t size)
+{
+    UNUSED(arg);
+    __sync_fetch_and_add(&mem_allocs, 1);
+    return (malloc(size));
+}
+
+static void bench_memfree(void *arg, void *ptr)
+{
+    UNUSED(arg);
+    free(ptr);
+}
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    __sync_fetch_and_add(&malloc_allocs, 1);
+    return (__libc_malloc(size));
+}
+
+void *calloc(size_t n, size_t size)
+{
+    __sync_fetch_and_add(&malloc_allocs, 1);
+    return (__libc_calloc(n, size));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __sync_fetch_and_add(&malloc_allocs, 1);
+    return (__libc_realloc(ptr, size));
+}
+#endif
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-h host] [-L] [-z zones] [-r records] [-t threads] [-m hits]\n"
+           "       [-n lookups] [-o option]... [-a] [-R lookups] [-s] dbname dbtable user password\n", prog);
+    printf("  -h host      database host (default localhost)\n");
+    printf("  -L           load the dataset into dbtable first, replacing any earlier one\n");
+    printf("  -z zones     zones in the dataset (default %d)\n", DEFAULT_ZONES);
+    printf("  -r records   host records per zone (default %d)\n", DEFAULT_RECORDS);
+    printf("  -t threads   comma-separated thread counts to run (default %s)\n", DEFAULT_THREADS);
+    printf("  -m hits      comma-separated percentages of lookups for names that exist\n"
+           "               (default %s)\n", DEFAULT_HITS);
+    printf("  -n lookups   lookups per run (default %d)\n", DEFAULT_LOOKUPS);
+    printf("  -o option    driver option for every zone, e.g. -o cache=64m (repeatable)\n");
+    printf("  -a           also transfer every zone with allnodes\n");
+    printf("  -R lookups   one run, printing the resident size every this many lookups\n");
+    printf("  -s           log the driver's statistics after each run\n");
+    exit(1);
+}
+
+static unsigned long count_arg(const char *prog, const char *arg)
+{
+    char *end;
+    unsigned long val = strtoul(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || val == 0)
+        usage(prog);
+    return (val);
+}
+
+static unsigned int list_arg(const char *prog, const char *arg, unsigned int *vals,
+                             unsigned int max, unsigned int limit)
+{
+    unsigned int n = 0;
+    unsigned long val;
+    char *end;
+
+    for (;;)
+    {
+        val = strtoul(arg, &end, 10);
+        if (end == arg || val > limit || n == max || (*end != ',' && *end != '\0'))
+            usage(prog);
+        vals[n++] = (unsigned int) val;
+        if (*end == '\0')
+            return (n);
+        arg = end + 1;
+    }
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/*
+ * The resident set size in kilobytes, read without allocating.
+ */
+static unsigned long rss_kb(void)
+{
+    char buf[128];
+    unsigned long size, resident = 0;
+    ssize_t n;
+    int fd;
+
+    fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0)
+        return (0);
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return (0);
+    buf[n] = '\0';
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2)
+        return (0);
+    return (resident * (sysconf(_SC_PAGESIZE) / 1024));
+}
+
+static unsigned int hist_bucket(isc_uint64_t ns)
+{
+    unsigned int msb = 63;
+
+    if (ns < (1 << HIST_SUB))
+        return ((unsigned int) ns);
+    while ((ns & ((isc_uint64_t)1 << msb)) == 0)
+        msb--;
+    return (((msb - HIST_SUB + 1) << HIST_SUB) | (unsigned int)((ns >> (msb - HIST_SUB)) & ((1 << HIST_SUB) - 1)));
+}
+
+static isc_uint64_t hist_value(unsigned int bucket)
+{
+    unsigned int shift = bucket >> HIST_SUB;
+
+    if (shift == 0)
+        return (bucket);
+    return (((isc_uint64_t)((1 << HIST_SUB) | (bucket & ((1 << HIST_SUB) - 1)))) << (shift - 1));
+}
+
+static double hist_percentile(const isc_uint64_t *hist, isc_uint64_t total, double pct)
+{
+    isc_uint64_t seen = 0, want = (isc_uint64_t)(total * pct / 100.0);
+    unsigned int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += hist[b];
+        if (seen > want)
+            return (hist_value(b) / 1000.0);
+    }
+    return (0.0);
+}
+
+/*
+ * Replace the dataset: for each zone, an SOA and two NS records at the
+ * apex and "records" A records named h0 up.  Every row has tenant_id
+ * TENANT_ID, so rows of other tenants are left alone.
+ */
+static int load_dataset(const char *host, const char *user, const char *password,
+                        const char *dbname, const char *table)
+{
+    MYSQL conn;
+    char *query;
+    size_t size, len;
+    unsigned int z, r, rows;
+    struct timespec start;
+
+    mysql_init(&conn);
+    if (mysql_real_connect(&conn, host, user, password, dbname, 0, NULL, 0) == NULL)
+    {
+        fprintf(stderr, "unable to connect to %s: %s\n", host, mysql_error(&conn));
+        return (-1);
+    }
+
+    size = 256 + INSERT_ROWS * 256;
+    query = malloc(size);
+    if (query == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        mysql_close(&conn);
+        return (-1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    snprintf(query, size, "DELETE FROM %s WHERE tenant_id = '%s'", table, TENANT_ID);
+    if (mysql_query(&conn, query) != 0)
+        goto failure;
+
+#define ROW(name, ttl, type, data)                                              \
+    do                                                                          \
+    {                                                                           \
+        len += snprintf(query + len, size - len,                                \
+                        "%s('%s', '%s', '%s', %u, '%s', '%s')",                 \
+                        rows == 0 ? "" : ", ", TENANT_ID, zones[z].domain_id,   \
+                        name, ttl, type, data);                                 \
+        if (++rows == INSERT_ROWS)                                              \
+        {                                                                       \
+            if (mysql_query(&conn, query) != 0)                                 \
+                goto failure;                                                   \
+            len = snprintf(query, size, insert, table);                         \
+            rows = 0;                                                           \
+        }                                                                       \
+    } while (0)
+
+    {
+        static const char insert[] =
+            "INSERT INTO %s (tenant_id, domain_id, name, ttl, type, data) VALUES ";
+        char name[128], data[256];
+
+        len = snprintf(query, size, insert, table);
+        rows = 0;
+        for (z = 0; z < nzones; z++)
+        {
+            snprintf(data, sizeof(data), "ns0.%s. hostmaster.%s. 1 3600 600 86400 300",
+                     zones[z].name, zones[z].name);
+            ROW(zones[z].name, 3600, "SOA", data);
+            snprintf(data, sizeof(data), "ns0.%s.", zones[z].name);
+            ROW(zones[z].name, 3600, "NS", data);
+            snprintf(data, sizeof(data), "ns1.%s.", zones[z].name);
+            ROW(zones[z].name, 3600, "NS", data);
+            for (r = 0; r < nrecords; r++)
+            {
+                snprintf(name, sizeof(name), "h%u.%s", r, zones[z].name);
+                snprintf(data, sizeof(data), "10.%u.%u.%u",
+                         (z >> 8) & 0xff, z & 0xff, r & 0xff);
+                ROW(name, 300, "A", data);
+            }
+        }
+        if (rows > 0 && mysql_query(&conn, query) != 0)
+            goto failure;
+    }
+#undef ROW
+
+    printf("Loaded %u zones of %u records into %s in %.2f seconds\n",
+           nzones, nrecords + 3, table, elapsed(&start));
+    free(query);
+    mysql_close(&conn);
+    return (0);
+
+failure:
+    fprintf(stderr, "loading the dataset failed: %s\n", mysql_error(&conn));
+    free(query);
+    mysql_close(&conn);
+    return (-1);
+}
+
+static isc_threadresult_t worker_run(isc_threadarg_t arg)
+{
+    struct worker *w = arg;
+    struct timespec t0, t1;
+    struct sdbcount count;
+    char name[128];
+    unsigned long i;
+    unsigned int z, r;
+    isc_uint64_t ns;
+    isc_result_t result;
+
+    for (i = 0; i < w->lookups; i++)
+    {
+        z = rand_r(&w->seed) % nzones;
+        r = rand_r(&w->seed);
+        if (r % 100 < w->hits)
+            snprintf(name, sizeof(name), "h%u.%s", (r / 100) % nrecords, zones[z].name);
+        else
+            snprintf(name, sizeof(name), "nx%u.%s", r / 100, zones[z].name);
+
+        count.records = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        result = sdb_methods->lookup(zones[z].name, name, zones[z].dbdata,
+                                     (dns_sdblookup_t *) &count);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+        w->hist[hist_bucket(ns)]++;
+        w->records += count.records;
+        if (result == ISC_R_SUCCESS)
+            w->found++;
+        else if (result == ISC_R_NOTFOUND)
+            w->notfound++;
+        else
+            w->failed++;
+    }
+
+    mysql_thread_end();
+    return ((isc_threadresult_t) 0);
+}
+
+/*
+ * Spread "lookups" over "threads" threads and print one line of results.
+ */
+static void run(unsigned int threads, unsigned int hits, unsigned long lookups,
+                isc_boolean_t dumpstats)
+{
+    static struct worker workers[MAX_THREADS];
+    static isc_uint64_t hist[HIST_BUCKETS];
+    struct timespec start;
+    isc_uint64_t mem0, malloc0;
+    unsigned long found = 0, notfound = 0, failed = 0, records = 0;
+    unsigned int i, b;
+    double seconds;
+
+    memset(workers, 0, sizeof(workers));
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < threads; i++)
+    {
+        workers[i].seed = 12345 + i * 7919 + hits;
+        workers[i].hits = hits;
+        workers[i].lookups = lookups / threads + (i < lookups % threads ? 1 : 0);
+    }
+
+    mem0 = mem_allocs;
+    malloc0 = malloc_allocs;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < threads; i++)
+        RUNTIME_CHECK(isc_thread_create(worker_run, &workers[i], &workers[i].tid) == ISC_R_SUCCESS);
+    for (i = 0; i < threads; i++)
+        isc_thread_join(workers[i].tid, NULL);
+    seconds = elapsed(&start);
+
+    for (i = 0; i < threads; i++)
+    {
+        found += workers[i].found;
+        notfound += workers[i].notfound;
+        failed += workers[i].failed;
+        records += workers[i].records;
+        for (b = 0; b < HIST_BUCKETS; b++)
+            hist[b] += workers[i].hist[b];
+    }
+
+    printf("%7u %5u%% %10lu %10.0f %9.1f %9.1f %10.3f %10.3f %9lu %9lu %7lu %7.2f %9lu\n",
+           threads, hits, lookups, seconds > 0 ? lookups / seconds : 0.0,
+           hist_percentile(hist, lookups, 50.0), hist_percentile(hist, lookups, 99.0),
+           (double)(mem_allocs - mem0) / lookups,
+           (double)(malloc_allocs - malloc0) / lookups,
+           found, notfound, failed, (double)records / lookups, rss_kb());
+    fflush(stdout);
+
+    if (dumpstats)
+        mysqldb_dumpstats();
+}
+
+static void print_header(void)
+{
+    printf("%7s %6s %10s %10s %9s %9s %10s %10s %9s %9s %7s %7s %9s\n",
+           "threads", "hits", "lookups", "qps", "p50(us)", "p99(us)",
+           "mem/op", "malloc/op", "found", "notfound", "failed", "rec/op", "rss(kB)");
+}
+
+/*
+ * Transfer every zone once and report records per second.
+ */
+static void transfer_all(void)
+{
+    struct timespec start;
+    struct sdbcount count;
+    unsigned int z, failed = 0;
+    double seconds;
+
+    count.records = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (z = 0; z < nzones; z++)
+    {
+        if (sdb_methods->allnodes(zones[z].name, zones[z].dbdata,
+                                  (dns_sdballnodes_t *) &count) != ISC_R_SUCCESS)
+            failed++;
+    }
+    seconds = elapsed(&start);
+    printf("allnodes: %u zones, %lu records in %.3f seconds (%.0f records/second, "
+           "%.1f zones/second), %u failed\n",
+           nzones, count.records, seconds,
+           seconds > 0 ? count.records / seconds : 0.0,
+           seconds > 0 ? nzones / seconds : 0.0, failed);
+}
+
+int main(int argc, char **argv)
+{
+    char *host = "localhost";
+    char *prog, *dbname, *table, *user, *password;
+    char *options[MAX_OPTIONS];
+    char *zargv[7 + MAX_OPTIONS];
+    unsigned int threads[MAX_RUNS], hits[MAX_RUNS];
+    unsigned int nthreads, nhits, noptions = 0;
+    unsigned long lookups = DEFAULT_LOOKUPS, rssevery = 0, done;
+    isc_boolean_t load = ISC_FALSE, allnodes = ISC_FALSE, dumpstats = ISC_FALSE;
+    isc_mem_t *mctx = NULL;
+    isc_result_t result;
+    unsigned int i, t, h;
+    int ch;
+
+    nthreads = list_arg(argv[0], DEFAULT_THREADS, threads, MAX_RUNS, MAX_THREADS);
+    nhits = list_arg(argv[0], DEFAULT_HITS, hits, MAX_RUNS, 100);
+    while ((ch = getopt(argc, argv, "h:Lz:r:t:m:n:o:aR:s")) != -1)
+    {
+        switch (ch)
+        {
+        case 'h':
+            host = optarg;
+            break;
+        case 'L':
+            load = ISC_TRUE;
+            break;
+        case 'z':
+            nzones = (unsigned int) count_arg(argv[0], optarg);
+            break;
+        case 'r':
+            nrecords = (unsigned int) count_arg(argv[0], optarg);
+            break;
+        case 't':
+            nthreads = list_arg(argv[0], optarg, threads, MAX_RUNS, MAX_THREADS);
+            for (i = 0; i < nthreads; i++)
+                if (threads[i] == 0)
+                    usage(argv[0]);
+            break;
+        case 'm':
+            nhits = list_arg(argv[0], optarg, hits, MAX_RUNS, 100);
+            break;
+        case 'n':
+            lookups = count_arg(argv[0], optarg);
+            break;
+        case 'o':
+            if (noptions == MAX_OPTIONS || strchr(optarg, '=') == NULL)
+                usage(argv[0]);
+            options[noptions++] = optarg;
+            break;
+        case 'a':
+            allnodes = ISC_TRUE;
+            break;
+        case 'R':
+            rssevery = count_arg(argv[0], optarg);
+            break;
+        case 's':
+            dumpstats = ISC_TRUE;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    prog = argv[0];
+    argc -= optind;
+    argv += optind;
+    if (argc != 4)
+        usage(prog);
+    dbname   = argv[0];
+    table    = argv[1];
+    user     = argv[2];
+    password = argv[3];
+
+    zones = calloc(nzones, sizeof(struct zone));
+    if (zones == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < nzones; i++)
+    {
+        snprintf(zones[i].name, sizeof(zones[i].name), "z%u.bench.test", i);
+        snprintf(zones[i].domain_id, sizeof(zones[i].domain_id), "bench-%u", i);
+    }
+
+    if (mysql_library_init(0, NULL, NULL) != 0)
+    {
+        fprintf(stderr, "unable to initialize the MySQL client library\n");
+        exit(1);
+    }
+    if (load && load_dataset(host, user, password, dbname, table) != 0)
+        exit(1);
+
+    /* without ISC_MEMFLAG_INTERNAL every isc_mem_get() reaches bench_memalloc() */
+    result = isc_mem_createx2(0, 0, bench_memalloc, bench_memfree, NULL, &mctx, 0);
+    RUNTIME_CHECK(result == ISC_R_SUCCESS);
+    RUNTIME_CHECK(sdb_stub_init(mctx, dumpstats ? ISC_LOG_INFO : ISC_LOG_WARNING) == ISC_R_SUCCESS);
+    RUNTIME_CHECK(mysqldb_init() == ISC_R_SUCCESS);
+
+    zargv[0] = dbname;
+    zargv[1] = table;
+    zargv[2] = host;
+    zargv[3] = user;
+    zargv[4] = password;
+    zargv[6] = TENANT_ID;
+    for (i = 0; i < noptions; i++)
+        zargv[7 + i] = options[i];
+    for (i = 0; i < nzones; i++)
+    {
+        zargv[5] = zones[i].domain_id;
+        result = sdb_methods->create(zones[i].name, 7 + noptions, zargv,
+                                     sdb_driverdata, &zones[i].dbdata);
+        if (result != ISC_R_SUCCESS)
+        {
+            fprintf(stderr, "zone %s: %s\n", zones[i].name, isc_result_totext(result));
+            exit(1);
+        }
+    }
+    printf("%u zones of %u records, options:", nzones, nrecords + 3);
+    for (i = 0; i < noptions; i++)
+        printf(" %s", options[i]);
+    printf("%s\n", noptions == 0 ? " none" : "");
+
+    if (allnodes)
+        transfer_all();
+
+    print_header();
+    if (rssevery > 0)
+    {
+        /* one long run at the first thread count and hit rate */
+        for (done = 0; done < lookups; done += rssevery)
+            run(threads[0], hits[0], lookups - done < rssevery ? lookups - done : rssevery,
+                dumpstats);
+    }
+    else
+    {
+        for (h = 0; h < nhits; h++)
+            for (t = 0; t < nthreads; t++)
+                run(threads[t], hits[h], lookups, dumpstats);
+    }
+
+    for (i = 0; i < nzones; i++)
+        sdb_methods->destroy(zones[i].name, sdb_driverdata, &zones[i].dbdata);
+    mysqldb_clear();
+    sdb_stub_destroy();
+    isc_mem_destroy(&mctx);
+    mysql_library_end();
+    free(zones);
+    return (0);
+}
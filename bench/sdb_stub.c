@@ -0,0 +1,160 @@
+/*
+ * MySQL BIND SDB Driver benchmark: stand-ins for named
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The parts of named and of BIND's SDB layer that mysqldb.c calls, so
+ * the driver can be linked on its own against libisc and libdns.
+ * dns_sdb_register() just remembers the driver's methods, and the put
+ * functions count the records handed to them instead of building
+ * rdatasets.  The lookup and allnodes handles passed to the driver are
+ * really "struct sdbcount"s.
+ */
+
+#include <config.h>
+
+#include <isc/log.h>
+#include <isc/mem.h>
+#include <isc/result.h>
+#include <isc/util.h>
+
+#include <dns/sdb.h>
+
+#include <named/globals.h>
+#include <named/log.h>
+
+#include "sdb_stub.h"
+
+/* declared by named/globals.h, which named's main.c would define */
+isc_mem_t *ns_g_mctx = NULL;
+isc_log_t *ns_g_lctx = NULL;
+isc_logcategory_t *ns_g_categories = NULL;
+isc_logmodule_t *ns_g_modules = NULL;
+
+const dns_sdbmethods_t *sdb_methods = NULL;
+void *sdb_driverdata = NULL;
+
+/* the driver logs to ISC's general category and named's main module */
+static isc_logcategory_t categories[] = {
+    { "client",     0 },
+    { NULL,         0 }
+};
+
+static isc_logmodule_t modules[] = {
+    { "main",       0 },
+    { NULL,         0 }
+};
+
+isc_result_t dns_sdb_register(const char *drivername, const dns_sdbmethods_t *methods,
+                              void *driverdata, unsigned int flags, isc_mem_t *mctx,
+                              dns_sdbimplementation_t **sdbimp)
+{
+    UNUSED(drivername);
+    UNUSED(flags);
+    UNUSED(mctx);
+
+    sdb_methods = methods;
+    sdb_driverdata = driverdata;
+    *sdbimp = (dns_sdbimplementation_t *) &sdb_methods;
+    return (ISC_R_SUCCESS);
+}
+
+void dns_sdb_unregister(dns_sdbimplementation_t **sdbimp)
+{
+    sdb_methods = NULL;
+    *sdbimp = NULL;
+}
+
+isc_result_t dns_sdb_putrr(dns_sdblookup_t *lookup, const char *type, dns_ttl_t ttl,
+                           const char *data)
+{
+    UNUSED(type);
+    UNUSED(ttl);
+    UNUSED(data);
+
+    ((struct sdbcount *) lookup)->records++;
+    return (ISC_R_SUCCESS);
+}
+
+isc_result_t dns_sdb_putrdata(dns_sdblookup_t *lookup, dns_rdatatype_t type, dns_ttl_t ttl,
+                              const unsigned char *rdata, unsigned int rdlen)
+{
+    UNUSED(type);
+    UNUSED(ttl);
+    UNUSED(rdata);
+    UNUSED(rdlen);
+
+    ((struct sdbcount *) lookup)->records++;
+    return (ISC_R_SUCCESS);
+}
+
+isc_result_t dns_sdb_putnamedrr(dns_sdballnodes_t *allnodes, const char *name,
+                                const char *type, dns_ttl_t ttl, const char *data)
+{
+    UNUSED(name);
+    UNUSED(type);
+    UNUSED(ttl);
+    UNUSED(data);
+
+    ((struct sdbcount *) allnodes)->records++;
+    return (ISC_R_SUCCESS);
+}
+
+isc_result_t dns_sdb_putnamedrdata(dns_sdballnodes_t *allnodes, const char *name,
+                                   dns_rdatatype_t type, dns_ttl_t ttl,
+                                   const void *rdata, unsigned int rdlen)
+{
+    UNUSED(name);
+    UNUSED(type);
+    UNUSED(ttl);
+    UNUSED(rdata);
+    UNUSED(rdlen);
+
+    ((struct sdbcount *) allnodes)->records++;
+    return (ISC_R_SUCCESS);
+}
+
+/*
+ * Set up ns_g_mctx and ns_g_lctx as named would, logging to stderr at
+ * "severity" and above.
+ */
+isc_result_t sdb_stub_init(isc_mem_t *mctx, int severity)
+{
+    isc_logconfig_t *lcfg = NULL;
+    isc_logdestination_t destination;
+    isc_result_t result;
+
+    ns_g_mctx = mctx;
+    result = isc_log_create(mctx, &ns_g_lctx, &lcfg);
+    if (result != ISC_R_SUCCESS)
+        return (result);
+    isc_log_registercategories(ns_g_lctx, categories);
+    isc_log_registermodules(ns_g_lctx, modules);
+    ns_g_categories = categories;
+    ns_g_modules = modules;
+
+    destination.file.stream = stderr;
+    destination.file.name = NULL;
+    destination.file.versions = ISC_LOG_ROLLNEVER;
+    destination.file.maximum_size = 0;
+    result = isc_log_createchannel(lcfg, "bench", ISC_LOG_TOFILEDESC, severity,
+                                   &destination, ISC_LOG_PRINTLEVEL);
+    if (result == ISC_R_SUCCESS)
+        result = isc_log_usechannel(lcfg, "bench", NULL, NULL);
+    return (result);
+}
+
+void sdb_stub_destroy(void)
+{
+    isc_log_destroy(&ns_g_lctx);
+}
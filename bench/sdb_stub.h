@@ -0,0 +1,35 @@
+/*
+ * MySQL BIND SDB Driver benchmark: stand-ins for named
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <isc/mem.h>
+#include <isc/types.h>
+
+#include <dns/sdb.h>
+
+/*
+ * What the driver handed to one lookup or allnodes call.  A pointer to
+ * one is passed to it as the dns_sdblookup_t or dns_sdballnodes_t.
+ */
+struct sdbcount
+{
+    unsigned long records;
+};
+
+/* set by mysqldb_init() */
+extern const dns_sdbmethods_t *sdb_methods;
+extern void *sdb_driverdata;
+
+isc_result_t sdb_stub_init(isc_mem_t *mctx, int severity);
+
+void sdb_stub_destroy(void);
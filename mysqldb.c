@@ -23,17 +23,40 @@
  */
 
 #include <config.h>   
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include <mysql.h>
+#include <errmsg.h>
 
+/*
+ * MariaDB's client library has a non-blocking API.  With it, a lookup
+ * that overruns its timeout is abandoned mid-query rather than waited out.
+ */
+#ifdef MYSQL_WAIT_READ
+#define MYSQLDB_NONBLOCKING 1
+#include <poll.h>
+#include <sys/socket.h>
+#endif
+
+#include <isc/condition.h>
 #include <isc/mem.h>
+#include <isc/mutex.h>
 #include <isc/print.h>
+#include <isc/random.h>
 #include <isc/result.h>
+#include <isc/rwlock.h>
+#include <isc/stats.h>
+#include <isc/stdtime.h>
+#include <isc/thread.h>
+#include <isc/time.h>
 #include <isc/util.h>
 
+#include <dns/rdatatype.h>
 #include <dns/sdb.h>
 #include <dns/result.h>
 
@@ -44,6 +67,100 @@
 
 #define TYPE_LENGTH 16
 #define DATA_LENGTH 255
+#define RDATA_LENGTH 1024
+#define ID_LENGTH 256
+#define NAME_LENGTH 1024        /* a name in text form, escapes and all */
+
+/*
+ * Statements prepared on every connection, once per table.  The table
+ * name is substituted with sprintf; everything else is a bind variable.
+ * The _RDATA variants are used when the table has the optional rdata
+ * column (sql/dns_domains_rdata.sql), and the _LNAME lookups when it has
+ * the lowercased lname column of schema version 2
+ * (sql/dns_domains_v2.sql).  Names are lowercased before they are bound.
+ * Zone transfers are read in DNS canonical order through the rname
+ * column of version 3 (sql/dns_domains_v3.sql) when the table has it.
+ */
+#define LOOKUP_QUERY \
+    "SELECT ttl, type, data FROM %s WHERE tenant_id = ? AND domain_id = ? AND name = UPPER(?)"
+#define ALLNODES_QUERY \
+    "SELECT ttl, name, type, data FROM %s WHERE tenant_id = ? AND domain_id = ? ORDER BY name"
+#define LOOKUP_RDATA_QUERY \
+    "SELECT ttl, type, data, rdata FROM %s WHERE tenant_id = ? AND domain_id = ? AND name = UPPER(?)"
+#define ALLNODES_RDATA_QUERY \
+    "SELECT ttl, name, type, data, rdata FROM %s WHERE tenant_id = ? AND domain_id = ? ORDER BY name"
+#define ALLNODES_RNAME_QUERY \
+    "SELECT ttl, name, type, data FROM %s WHERE tenant_id = ? AND domain_id = ? ORDER BY rname"
+#define ALLNODES_RNAME_RDATA_QUERY \
+    "SELECT ttl, name, type, data, rdata FROM %s WHERE tenant_id = ? AND domain_id = ? ORDER BY rname"
+
+/*
+ * One page of a zone transfer with pagesize=N: the rows after the last
+ * one read, in (name, id) or (rname, id) order.  The first two columns
+ * are the id and the ordering key; the parameters are the tenant and
+ * domain ids, the last key twice, the last id and the page size.
+ */
+#define ALLPAGE_QUERY \
+    "SELECT id, name, ttl, name, type, data FROM %s WHERE tenant_id = ? AND domain_id = ? " \
+    "AND (name > ? OR (name = ? AND id > ?)) ORDER BY name, id LIMIT ?"
+#define ALLPAGE_RDATA_QUERY \
+    "SELECT id, name, ttl, name, type, data, rdata FROM %s WHERE tenant_id = ? AND domain_id = ? " \
+    "AND (name > ? OR (name = ? AND id > ?)) ORDER BY name, id LIMIT ?"
+#define ALLPAGE_RNAME_QUERY \
+    "SELECT id, rname, ttl, name, type, data FROM %s WHERE tenant_id = ? AND domain_id = ? " \
+    "AND (rname > ? OR (rname = ? AND id > ?)) ORDER BY rname, id LIMIT ?"
+#define ALLPAGE_RNAME_RDATA_QUERY \
+    "SELECT id, rname, ttl, name, type, data, rdata FROM %s WHERE tenant_id = ? AND domain_id = ? " \
+    "AND (rname > ? OR (rname = ? AND id > ?)) ORDER BY rname, id LIMIT ?"
+
+/*
+ * The records of a name together with those of the ancestors and
+ * wildcards BIND would otherwise look up one by one to resolve it; see
+ * closest_names().  Unused slots repeat the first name.
+ */
+#define CLOSEST_NAMES 16
+#define CLOSEST_IN4 "UPPER(?), UPPER(?), UPPER(?), UPPER(?)"
+#define CLOSEST_IN CLOSEST_IN4 ", " CLOSEST_IN4 ", " CLOSEST_IN4 ", " CLOSEST_IN4
+#define CLOSEST_QUERY \
+    "SELECT ttl, type, data, name FROM %s WHERE tenant_id = ? AND domain_id = ? AND name IN (" CLOSEST_IN ")"
+#define CLOSEST_RDATA_QUERY \
+    "SELECT ttl, type, data, name, rdata FROM %s WHERE tenant_id = ? AND domain_id = ? AND name IN (" CLOSEST_IN ")"
+
+#define LOOKUP_LNAME_QUERY \
+    "SELECT ttl, type, data FROM %s WHERE tenant_id = ? AND domain_id = ? AND lname = ?"
+#define LOOKUP_LNAME_RDATA_QUERY \
+    "SELECT ttl, type, data, rdata FROM %s WHERE tenant_id = ? AND domain_id = ? AND lname = ?"
+#define CLOSEST_LIN4 "?, ?, ?, ?"
+#define CLOSEST_LIN CLOSEST_LIN4 ", " CLOSEST_LIN4 ", " CLOSEST_LIN4 ", " CLOSEST_LIN4
+#define CLOSEST_LNAME_QUERY \
+    "SELECT ttl, type, data, lname FROM %s WHERE tenant_id = ? AND domain_id = ? AND lname IN (" CLOSEST_LIN ")"
+#define CLOSEST_LNAME_RDATA_QUERY \
+    "SELECT ttl, type, data, lname, rdata FROM %s WHERE tenant_id = ? AND domain_id = ? AND lname IN (" CLOSEST_LIN ")"
+
+/*
+ * The records of up to BATCH_NAMES names of any of the table's zones, for
+ * the lookups collected by batch=N; see batch_lookup().  Each name is a
+ * (tenant_id, domain_id, name) triple, and unused slots repeat the first.
+ */
+#define BATCH_NAMES 64
+#define BATCH_IN4 "(?, ?, UPPER(?)), (?, ?, UPPER(?)), (?, ?, UPPER(?)), (?, ?, UPPER(?))"
+#define BATCH_IN16 BATCH_IN4 ", " BATCH_IN4 ", " BATCH_IN4 ", " BATCH_IN4
+#define BATCH_IN BATCH_IN16 ", " BATCH_IN16 ", " BATCH_IN16 ", " BATCH_IN16
+#define BATCH_QUERY \
+    "SELECT ttl, type, data, name, tenant_id, domain_id FROM %s " \
+    "WHERE (tenant_id, domain_id, name) IN (" BATCH_IN ")"
+#define BATCH_RDATA_QUERY \
+    "SELECT ttl, type, data, name, tenant_id, domain_id, rdata FROM %s " \
+    "WHERE (tenant_id, domain_id, name) IN (" BATCH_IN ")"
+#define BATCH_LIN4 "(?, ?, ?), (?, ?, ?), (?, ?, ?), (?, ?, ?)"
+#define BATCH_LIN16 BATCH_LIN4 ", " BATCH_LIN4 ", " BATCH_LIN4 ", " BATCH_LIN4
+#define BATCH_LIN BATCH_LIN16 ", " BATCH_LIN16 ", " BATCH_LIN16 ", " BATCH_LIN16
+#define BATCH_LNAME_QUERY \
+    "SELECT ttl, type, data, lname, tenant_id, domain_id FROM %s " \
+    "WHERE (tenant_id, domain_id, lname) IN (" BATCH_LIN ")"
+#define BATCH_LNAME_RDATA_QUERY \
+    "SELECT ttl, type, data, lname, tenant_id, domain_id, rdata FROM %s " \
+    "WHERE (tenant_id, domain_id, lname) IN (" BATCH_LIN ")"
 
 /*
  * This file is a modification of the PostGreSQL version which is distributed
@@ -53,12 +170,26 @@
  * A simple database driver that interfaces to a MySQL database.  This
  * is not necessarily complete nor designed for general use, but it is has
  * been in use on production systems for some time without known problems.
- * It opens one connection to the database per zone, which is inefficient.  
+ * Connections are pooled per (host, user, database) and shared by every
+ * zone that uses the same server, so the number of open connections is
+ * bounded by the pool size rather than the number of zones.
  * It also may not handle quoting correctly.
  *
  * The table must contain the fields "name", "type", and "data", and 
  * is expected to contain a properly constructed zone.  
  *
+ * The table may also have an "rdata" column holding each record's rdata
+ * in uncompressed wire format, as written by zonetodb.  Where it is
+ * present and not NULL, the driver hands it to BIND as is instead of
+ * having BIND parse "data" on every answer.
+ *
+ * At schema version 2 (sql/dns_domains_v2.sql) the table also has an
+ * "lname" column, the name lowercased with binary collation, and a key on
+ * it covering the columns a lookup reads.  Lookups then match on lname.
+ * Version 3 (sql/dns_domains_v3.sql) adds "rname", the name with its
+ * labels reversed, and zone transfers are then read in rname order, which
+ * is DNS canonical order.
+ *
  * The column domain_id is a unique identifyer for a domain, in this case a UUID
  *
  * Example SQL to create a domain
@@ -95,9 +226,105 @@
  * zone "mydomain.com" {
  *	type master;
  *	notify no;
- *	database "mysqldb dbname tablename hostname user password domain_id";
+ *	database "mysqldb dbname tablename hostname user password domain_id tenant_id";
  * };
  *
+ * Any argument after the password of the form key=value is a driver option:
+ *
+ *	pool=N		maximum number of connections to keep open to this
+ *			(host, user, database); zones naming the same server
+ *			share one pool.  Defaults to MYSQLDB_POOL_SIZE.
+ *			This is also the number of lookups that may be in
+ *			flight to that server at once.  Concurrent lookups
+ *			of the same name share one query.
+ *
+ *	keepalive=SECS	ping this server's pooled connections once they have
+ *			been idle for SECS seconds, reopening any that have
+ *			gone away.  Connections are otherwise not checked
+ *			before use: a query that finds its connection lost
+ *			reconnects and is retried once.
+ *
+ *	timeout=MS	fail a lookup that has not been answered within MS
+ *			milliseconds, so that named answers SERVFAIL rather
+ *			than holding a worker thread on a slow server.  The
+ *			limit is exact with MariaDB's client library; with
+ *			MySQL's it covers the wait for a pooled connection,
+ *			and the server is given whole seconds to reply.
+ *
+ *	cache=SIZE	cache this zone's answers, including NOTFOUND, in a
+ *			driver-wide cache of at most SIZE bytes (k, m and g
+ *			suffixes are accepted).  Answers are kept no longer
+ *			than their smallest TTL; NOTFOUND for the zone's SOA
+ *			negative TTL.  Off by default.
+ *
+ *	stale=SECS	keep cached answers SECS seconds past their TTL, and
+ *			answer from them, with TTLs of at most stalettl=SECS
+ *			(default MYSQLDB_STALE_TTL), when the database fails
+ *			or overruns timeout=MS.  Needs cache=SIZE.
+ *
+ *	breaker=N	mark the server down after N lookups time out, or
+ *			connects fail, in a row, and fail lookups at once
+ *			(or answer them stale) until the maintenance thread
+ *			manages to reconnect.  Off by default.
+ *
+ *	prefetch=N	stream zone transfers through a read-only server
+ *			cursor, N rows per round-trip.  By default the rows
+ *			are streamed without a cursor, which is fastest but
+ *			keeps the query open until the transfer is read.
+ *
+ *	pagesize=N	read zone transfers and snapshot loads in pages of N
+ *			rows, each a short query starting after the last
+ *			(name, id) read, instead of in one query over the
+ *			whole zone.  Overrides prefetch=N.
+ *
+ *	batch=N		send lookups that miss the cache together, up to N
+ *			at a time, as one query over (tenant_id, domain_id,
+ *			name), along with those of other zones in the same
+ *			table on the same server.  The first lookup of a
+ *			batch waits for the others for up to batchwait=USEC
+ *			microseconds (default MYSQLDB_BATCH_WAIT).  Off by
+ *			default.
+ *
+ *	snapshot=SECS	hold the whole zone in memory and answer from there,
+ *			checking the SOA serial every SECS seconds and
+ *			reloading only when it changes.  Lookups keep being
+ *			answered if the database goes away.
+ *
+ *	stats=SECS	log this zone's counters and latency percentiles at
+ *			info level every SECS seconds, along with the
+ *			driver-wide totals.  mysqldb_dumpstats() logs them on
+ *			demand whether or not this is set.
+ *
+ *	zonetable=TABLE	look up the zone's domain_id and tenant_id by its
+ *			name in TABLE (see sql/dns_zones_create.sql) instead
+ *			of giving them on the database line.  The table is
+ *			read once, in one query, for every zone using it,
+ *			and the records at every zone's apex are preloaded
+ *			into the answer cache with a second.  A zone not in
+ *			it has it reread, without the preload.
+ *
+ *	changes=TABLE	follow the change log TABLE, which triggers on the
+ *			records table append to (see
+ *			sql/dns_changes_create.sql), evicting cached answers
+ *			for the names edited and reloading snapshots whose
+ *			records changed, within about a second.
+ *
+ *	replicas=HOST[/WEIGHT],...
+ *			send lookups and transfers to these replicas of the
+ *			database, in proportion to their weights (default
+ *			1), instead of to the zone's own host.  A replica
+ *			that cannot be reached is skipped until a background
+ *			reconnect succeeds; with none left, queries go to the
+ *			zone's host.  Snapshots are always read from there.
+ *
+ *	balance=weighted|latency
+ *			with "latency", draw two replicas by weight and use
+ *			the one whose recent lookups were faster.
+ *
+ *	xfrprimary=yes	answer lookups of the zone's apex, which carry its
+ *			SOA serial, and transfers from the zone's own host,
+ *			so a transfer never sees older data than its serial.
+ *
  * Rebuilding the Server (modified from bind9/doc/misc/sdb)
  * =====================================================
  * 
@@ -123,459 +350,5509 @@
 
 static dns_sdbimplementation_t *mysqldb = NULL;
 
-struct dbinfo
+/*
+ * Default upper bound on the number of connections opened to one
+ * (host, user, database).  Connections are opened lazily, so a pool
+ * only grows as large as the number of queries in flight at once.
+ */
+#define MYSQLDB_POOL_SIZE 8
+
+/*
+ * Default number of microseconds the first lookup of a batch (batch=N)
+ * waits for others to join it.
+ */
+#define MYSQLDB_BATCH_WAIT 200
+
+/*
+ * Default TTL cap on stale answers (stale=SECS), as RFC 8767 suggests.
+ */
+#define MYSQLDB_STALE_TTL 30
+
+/*
+ * Most replicas one zone may list, and the largest weight of one.
+ */
+#define MYSQLDB_MAX_REPLICAS 16
+#define MYSQLDB_MAX_WEIGHT 1000
+
+/*
+ * Seconds between attempts to reconnect to a server marked down.
+ */
+#define POOL_PROBE_INTERVAL 5
+
+struct dbpool;
+
+/*
+ * The statements prepared on one connection for one table.  They live
+ * as long as the connection and are re-prepared after a reconnect.
+ */
+struct querylayout;
+
+struct dbstmts
 {
-    MYSQL conn;
-    char *database;
     char *table;
-    char *host;
-    char *user;
-    char *passwd;
-    char *domain_id;
-    char *tenant_id;
+    const struct querylayout *layout;
+    isc_boolean_t hasrdata;     /* the table has the rdata column */
+    isc_boolean_t hasrname;     /* ... and the rname column */
+    MYSQL_STMT *lookup;
+    MYSQL_STMT *allnodes;
+    MYSQL_STMT *allpage;        /* prepared on first use */
+    MYSQL_STMT *closest;
+    MYSQL_STMT *batch;          /* prepared on first use */
+    struct dbstmts *next;
 };
 
-static void mysqldb_destroy(const char *zone, void *driverdata, void **dbdata);
+/*
+ * A change log's poll statement (changes=TABLE), prepared on a connection
+ * the first time the maintenance thread polls the log through it.
+ */
+struct dbfeedstmt
+{
+    char *table;
+    MYSQL_STMT *poll;
+    struct dbfeedstmt *next;
+};
 
 /*
- * Canonicalize a string before writing it to the database.
- * "dest" must be an array of at least size 2*strlen(source) + 1.
+ * The parameters and results of a connection's lookups.  The lookup
+ * statements are bound to these buffers once, when they are prepared, so
+ * a lookup only copies its ids and names in and reads its rows out, with
+ * no allocation.  The first three parameters are those of LOOKUP_QUERY;
+ * all of them those of CLOSEST_QUERY.
  */
-static void quotestring(const char *source, char *dest)
+struct dbbuf
 {
-    while (*source != 0)
-    {
-        if (*source == '\'')
-            *dest++ = '\'';
-        /* SQL doesn't treat \ as special, but PostgreSQL does */
-        else if (*source == '\\')
-            *dest++ = '\\';
-        *dest++ = *source++;
-    }
-    *dest++ = 0;
-}
+    char tenant_id[ID_LENGTH];
+    char domain_id[ID_LENGTH];
+    char name[NAME_LENGTH];
+    char candidates[CLOSEST_NAMES - 1][DATA_LENGTH + 3];
+    unsigned long param_lengths[2 + CLOSEST_NAMES];
+    MYSQL_BIND params[2 + CLOSEST_NAMES];
+
+    dns_ttl_t ttl;
+    char type[TYPE_LENGTH];
+    char data[DATA_LENGTH];
+    char rowname[DATA_LENGTH];
+    unsigned char rdata[RDATA_LENGTH];
+    my_bool rdnull, rdtruncated;
+    unsigned long result_lengths[5];
+    MYSQL_BIND lookup_results[4];       /* ttl, type, data, rdata */
+    MYSQL_BIND closest_results[5];      /* ttl, type, data, name, rdata */
+};
 
 /*
- * Connect to the database.
+ * The same for a connection's batched lookups, allocated the first time
+ * it runs one.  Slot i of the IN list is parameters 3i to 3i+2.
  */
-static isc_result_t db_connect(struct dbinfo *dbi)
+struct dbbatchbuf
 {
-    if(!mysql_init(&dbi->conn))
-        return (ISC_R_FAILURE);
+    char ids[BATCH_NAMES][2][ID_LENGTH];
+    char names[BATCH_NAMES][DATA_LENGTH + 3];
+    unsigned long param_lengths[3 * BATCH_NAMES];
+    MYSQL_BIND params[3 * BATCH_NAMES];
 
-    if (mysql_real_connect(&dbi->conn, dbi->host, dbi->user, dbi->passwd, dbi->database, 0, NULL, 0))
-        return (ISC_R_SUCCESS);
-    else
-        return (ISC_R_FAILURE);
-}
+    dns_ttl_t ttl;
+    char type[TYPE_LENGTH];
+    char data[DATA_LENGTH];
+    char rowname[DATA_LENGTH];
+    char tenant_id[ID_LENGTH];
+    char domain_id[ID_LENGTH];
+    unsigned char rdata[RDATA_LENGTH];
+    my_bool rdnull, rdtruncated;
+    unsigned long result_lengths[7];
+    MYSQL_BIND results[7];      /* ttl, type, data, name, tenant, domain, rdata */
+};
 
 /*
- * Check to see if the connection is still valid.  If not, attempt to
- * reconnect.
+ * A pooled connection.  "inuse" is set while it is leased to a lookup;
+ * it and the list linkage are protected by the pool's lock.  A leased
+ * connection belongs exclusively to the thread holding it.
  */
-static isc_result_t maybe_reconnect(struct dbinfo *dbi)
+struct dbconn
 {
-    if (!mysql_ping(&dbi->conn))
-	return (ISC_R_SUCCESS);
+    MYSQL conn;
+    isc_boolean_t connected;
+    isc_boolean_t inuse;
+    isc_boolean_t timedout;     /* abandoned mid-query; reconnect before reuse */
+    isc_stdtime_t lastused;
+    struct dbpool *pool;
+    struct dbstmts *stmts;
+    struct dbfeedstmt *feedstmts;
+    struct dbbuf buf;           /* only the leasing thread's */
+    struct dbbatchbuf *batchbuf; /* ditto; NULL until it runs a batch */
+    struct dbconn *next;
+};
 
-     return (db_connect(dbi));
-}
+/*
+ * A pool of connections to one (host, user, database), shared by every
+ * zone configured against it and reference counted by those zones.
+ * Threads wait on "ready" when every connection is leased, and on
+ * "batched" for a batch of lookups to fill or be answered.
+ */
+struct batch;
+
+struct dbpool
+{
+    isc_mutex_t lock;
+    isc_condition_t ready;
+    isc_condition_t batched;
+    char *host;
+    char *user;
+    char *passwd;
+    char *database;
+    unsigned int refs;
+    unsigned int size;
+    unsigned int keepalive;     /* 0 if idle connections are not pinged */
+    unsigned int timeout;       /* milliseconds; set under both locks */
+    unsigned int breaker;       /* 0 if down servers are still tried; ditto */
+    unsigned int count;
+    isc_boolean_t down;         /* the last connect failed */
+    unsigned int failures;      /* timeouts and failed connects in a row */
+    isc_stdtime_t probenext;    /* the maintenance thread's */
+    unsigned int latency;       /* moving average of a lookup, in usec */
+    struct batch *batches;      /* those still open to lookups */
+    struct dbconn *conns;
+    struct dbpool *next;
+    struct dbpool *duenext;     /* the maintenance thread's work */
+};
+
+/*
+ * "pools" and each pool's refs and size are protected by "poollock".  A
+ * pool's timeout, breaker and keepalive are the smallest any zone asked
+ * for; they are changed holding both locks, so either one is enough to
+ * read them.  "down", "failures" and "latency" are protected by the
+ * pool's own lock.
+ */
+static struct dbpool *pools = NULL;
+static isc_mutex_t poollock;
+
+struct snapshot;
+struct catalog;
+struct changefeed;
 
-static int  d_ex(char *search, char *domain)
+/*
+ * A replica a zone's lookups may be sent to, and its share of them.
+ */
+struct replica
 {
+    struct dbpool *pool;
+    unsigned int weight;
+};
 
-  char mdot[]=".";
-  char *array[142];
-  int loop;
+struct dbinfo
+{
+    isc_mutex_t lock;           /* protects negttl */
+    struct dbpool *pool;
+    unsigned int poolsize;
+    unsigned int keepalive;
+    unsigned int timeout;       /* lookup deadline in ms, 0 for none */
+    size_t cachesize;           /* 0 if this zone is not cached */
+    dns_ttl_t negttl;
+    unsigned int prefetch;      /* allnodes rows per cursor fetch */
+    unsigned int pagesize;      /* allnodes rows per query, 0 for one query */
+    unsigned int batch;         /* lookups per batched query, 0 for none */
+    unsigned int batchwait;     /* usec a batch waits for lookups to join */
+    unsigned int stale;         /* secs answers are kept past their TTL */
+    unsigned int stalettl;      /* the most a stale answer's TTL may be */
+    unsigned int breaker;       /* failures in a row that mark a server down */
+    unsigned int snaprefresh;   /* 0 unless the zone is snapshotted */
+    struct snapshot *snap;      /* swapped under snaplock */
+    isc_rwlock_t snaplock;
+    isc_stdtime_t snapcheck;    /* protected by maint_lock */
+    isc_boolean_t snapdirty;    /* reload regardless of serial; ditto */
+    isc_stats_t *stats;
+    unsigned int statsinterval; /* 0 unless stats are logged periodically */
+    isc_stdtime_t statsnext;    /* the maintenance thread's */
+    struct dbinfo *next;        /* "zones", protected by maint_lock */
+    struct dbinfo *duenext;     /* the maintenance thread's work, ditto */
+    unsigned int maintrefs;     /* held by the maintenance thread, ditto */
+    struct catalog *catalog;    /* NULL unless ids come from a zone table */
+    char *zonetable;
+    struct changefeed *feed;    /* NULL unless changes=TABLE */
+    char *changes;
+    struct replica *replicas;   /* NULL unless replicas=HOSTS */
+    unsigned int nreplicas;
+    char *replicaspec;
+    isc_boolean_t leastlatency; /* balance=latency */
+    isc_boolean_t xfrprimary;   /* apex lookups and transfers skip replicas */
+    char *zone;
+    char *database;
+    char *table;
+    char *host;
+    char *user;
+    char *passwd;
+    char *domain_id;
+    char *tenant_id;
+};
 
-  array[0]=strtok(search,mdot);
+static void mysqldb_destroy(const char *zone, void *driverdata, void **dbdata);
+static void pool_return(struct dbconn *dbc);
 
+/*
+ * Statistics.
+ *
+ * Counters are kept in isc_stats sets, one driver-wide and one per zone,
+ * so updating them takes no lock.  Each timed operation also has a
+ * latency histogram: bucket b counts operations that took less than
+ * 2^(b+1) microseconds, and the last bucket everything slower.
+ * Connections are shared by zones, so connects, prepares and reconnects
+ * are only counted driver-wide.
+ */
+enum
+{
+    STAT_LOOKUP,
+    STAT_ALLNODES,
+    STAT_ROWS,
+    STAT_NOTFOUND,
+    STAT_FAILURE,
+    STAT_TIMEOUT,
+    STAT_RECONNECT,
+    STAT_CACHEHIT,
+    STAT_SNAPHIT,
+    STAT_CHANGE,
+    STAT_FAILOVER,
+    STAT_COALESCED,
+    STAT_BATCHED,
+    STAT_STALE,
+    STAT_NCOUNTERS
+};
 
-   if(array[0]==NULL)
-   {
+static const char *stat_names[STAT_NCOUNTERS] = {
+    "lookups", "allnodes", "rows", "notfound", "failures",
+    "timeouts", "reconnects", "cachehits", "snapshothits", "changes",
+    "failovers", "coalesced", "batched", "stale"
+};
 
-           return 1;
+/*
+ * "fetch" is receiving rows: the buffered result of a lookup, or one
+ * streamed row of a transfer.  "lookup" is a whole mysqldb_lookup().
+ */
+enum
+{
+    TIMER_CONNECT,
+    TIMER_PREPARE,
+    TIMER_EXECUTE,
+    TIMER_FETCH,
+    TIMER_PUTRR,
+    TIMER_LOOKUP,
+    TIMER_NTIMERS
+};
 
-   }
+static const char *timer_names[TIMER_NTIMERS] = {
+    "connect", "prepare", "execute", "fetch", "putrr", "lookup"
+};
 
-  for(loop=1;loop<142;loop++)
-   {
-           array[loop]=strtok(NULL,mdot);
-           if(array[loop]==NULL)
-                   break;
-   }
+#define HIST_BUCKETS 20
+#define STATS_COUNTERS (STAT_NCOUNTERS + TIMER_NTIMERS * HIST_BUCKETS)
+#define TIMER_COUNTER(timer, bucket) (STAT_NCOUNTERS + (timer) * HIST_BUCKETS + (bucket))
 
-   if(loop<2) {
-	return 1;
-   }
+static isc_stats_t *driverstats = NULL;
 
-   snprintf(domain,255,"%s.%s",array[loop-2],array[loop-1]);
-   
-   return 0;
+/*
+ * Count an event for the zone, if there is one, and driver-wide.
+ */
+static void stats_increment(struct dbinfo *dbi, isc_statscounter_t counter)
+{
+    isc_stats_increment(driverstats, counter);
+    if (dbi != NULL)
+        isc_stats_increment(dbi->stats, counter);
 }
 
 /*
- * This database operates on absolute names.
- *
- * Queries are converted into SQL queries and issued synchronously.  Errors
- * are handled really badly.
+ * Record the time taken by an operation that began at "start".
  */
- 
-static isc_result_t mysqldb_lookup(const char *zone, const char *name, void *dbdata,
-	                           dns_sdblookup_t *lookup)
+static void stats_time(struct dbinfo *dbi, int timer, const isc_time_t *start)
 {
-   
-    /* TODO: this should go in a conf file */
-    char db_lookup_query[90];
-    char *canonname;
+    isc_time_t now;
+    isc_uint64_t usec;
+    int bucket = 0;
 
-    dns_ttl_t ttl;
-    char type[TYPE_LENGTH];
-    char data[DATA_LENGTH];
-    int result_count = 0;
-    unsigned long param_lengths[3], result_lengths[3];
+    if (isc_time_now(&now) != ISC_R_SUCCESS)
+        return;
+    usec = isc_time_microdiff(&now, start);
+    while (bucket < HIST_BUCKETS - 1 && usec >= ((isc_uint64_t) 2 << bucket))
+        bucket++;
+    stats_increment(dbi, TIMER_COUNTER(timer, bucket));
+}
 
-    MYSQL_STMT *stmt;
-    MYSQL_BIND params[3], results[3];
+static void stats_collect(isc_statscounter_t counter, isc_uint64_t value, void *arg)
+{
+    isc_uint64_t *values = arg;
 
-    isc_result_t result;
+    values[counter] = value;
+}
 
-    struct dbinfo *dbi = dbdata;
+/*
+ * Append the bucket below which "pct" percent of a timer's samples fall.
+ */
+static size_t stats_percentile(char *buf, size_t size, const isc_uint64_t *values,
+                               int timer, isc_uint64_t count, unsigned int pct)
+{
+    isc_uint64_t seen = 0;
+    int bucket;
 
-    /* build the query */
-    sprintf(db_lookup_query,
-             (const char*) "SELECT ttl, type, data FROM %s WHERE tenant_id = ? AND domain_id = ? AND name = UPPER(?)",
-             dbi->table);
+    for (bucket = 0; bucket < HIST_BUCKETS - 1; bucket++)
+    {
+        seen += values[TIMER_COUNTER(timer, bucket)];
+        if (seen * 100 >= count * pct)
+            break;
+    }
+    if (bucket == HIST_BUCKETS - 1)
+        return (snprintf(buf, size, " p%u>=%luus", pct, 1UL << bucket));
+    return (snprintf(buf, size, " p%u<%luus", pct, 2UL << bucket));
+}
 
-    /* set up the canonical name */
-	canonname = isc_mem_get(ns_g_mctx, strlen(name) * 2 + 1);
-	if (canonname == NULL)
-		return (ISC_R_NOMEMORY);
-	quotestring(name, canonname);
+/*
+ * Log one set of counters, with the count and approximate 50th, 90th
+ * and 99th percentile latency of every timed operation.
+ */
+static void stats_log(const char *what, isc_stats_t *stats)
+{
+    isc_uint64_t values[STATS_COUNTERS];
+    isc_uint64_t count;
+    char buf[1024];
+    size_t len;
+    int i, bucket;
 
-    /* zero out param/result structures */
-    memset(params, 0, sizeof (params));
-    memset(results, 0, sizeof (results));
+    memset(values, 0, sizeof(values));
+    isc_stats_dump(stats, stats_collect, values, 0);
 
-#ifdef MYSQLDB_DEBUG
-	isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "Arguments: tenant_id: %s domain_id: %s cananname: %s",
-                  dbi->tenant_id,
-                  dbi->domain_id,
-                  canonname);
-#endif
+    len = 0;
+    for (i = 0; i < STAT_NCOUNTERS && len < sizeof(buf); i++)
+        len += snprintf(buf + len, sizeof(buf) - len, " %s %" ISC_PRINT_QUADFORMAT "u",
+                        stat_names[i], values[i]);
+    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                  NS_LOGMODULE_MAIN, ISC_LOG_INFO,
+                  "mysqldb %s:%s", what, buf);
 
-    param_lengths[0] = strlen(dbi->tenant_id);
-    param_lengths[1] = strlen(dbi->domain_id);
-    param_lengths[2] = strlen(canonname);
+    len = 0;
+    buf[0] = '\0';
+    for (i = 0; i < TIMER_NTIMERS && len < sizeof(buf); i++)
+    {
+        count = 0;
+        for (bucket = 0; bucket < HIST_BUCKETS; bucket++)
+            count += values[TIMER_COUNTER(i, bucket)];
+        if (count == 0)
+            continue;
+        len += snprintf(buf + len, sizeof(buf) - len, " %s %" ISC_PRINT_QUADFORMAT "u",
+                        timer_names[i], count);
+        if (len < sizeof(buf))
+            len += stats_percentile(buf + len, sizeof(buf) - len, values, i, count, 50);
+        if (len < sizeof(buf))
+            len += stats_percentile(buf + len, sizeof(buf) - len, values, i, count, 90);
+        if (len < sizeof(buf))
+            len += stats_percentile(buf + len, sizeof(buf) - len, values, i, count, 99);
+    }
+    if (buf[0] != '\0')
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_INFO,
+                      "mysqldb %s latency:%s", what, buf);
+}
 
-    /* parameter buffer structs */
-    params[0].buffer_type    = MYSQL_TYPE_STRING;
-    params[0].buffer         = dbi->tenant_id;
-    params[0].buffer_length  = param_lengths[0]; 
-    params[0].is_null        = 0;
-    params[0].length         = &param_lengths[0]; 
+/*
+ * Count a lookup that timed out, or a connect that failed, against
+ * breaker=N.  The Nth in a row opens the breaker: pool_lease() refuses
+ * leases until a connect succeeds again.  Returns whether this one did,
+ * for the caller to log once it has let go of the pool's lock.
+ */
+static isc_boolean_t pool_failure_locked(struct dbpool *pool)
+{
+    if (pool->breaker == 0 || ++pool->failures != pool->breaker)
+        return (ISC_FALSE);
+    pool->down = ISC_TRUE;
+    return (ISC_TRUE);
+}
 
-    params[1].buffer_type    = MYSQL_TYPE_STRING;
-    params[1].buffer         = dbi->domain_id;
-    params[1].buffer_length  = param_lengths[1]; 
-    params[1].is_null        = 0;
-    params[1].length         = &param_lengths[1]; 
+static void pool_opened(struct dbpool *pool)
+{
+    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                  NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                  "ERROR: %u lookups or connects in a row failed on the "
+                  "mysql://%s:<password>@%s/%s; marking it down",
+                  pool->breaker, pool->user, pool->host, pool->database);
+}
 
-    params[2].buffer_type    = MYSQL_TYPE_STRING;
-    params[2].buffer         = canonname;
-    params[2].buffer_length  = param_lengths[2]; 
-    params[2].is_null        = 0;
-    params[2].length         = &param_lengths[2]; 
+/*
+ * Connect to the database.  The pool is marked down when this fails, and
+ * up again when it next succeeds.
+ */
+static isc_result_t db_connect(struct dbconn *dbc)
+{
+    struct dbpool *pool = dbc->pool;
+    unsigned int timeout;
+    isc_boolean_t wasdown, opened;
+    isc_time_t start;
 
-    /* result buffer structs */
-    results[0].buffer_type    = MYSQL_TYPE_LONG;
-    results[0].buffer         = (char *) &ttl; 
-    results[0].is_unsigned    = 1;
-    results[0].is_null        = 0;
-    results[0].length         = &result_lengths[0]; 
+    if (!mysql_init(&dbc->conn))
+        return (ISC_R_FAILURE);
 
-    results[1].buffer_type    = MYSQL_TYPE_STRING;
-    results[1].buffer         = (char *) type; 
-    results[1].buffer_length  = TYPE_LENGTH; 
-    results[1].is_null        = 0;
-    results[1].length         = &result_lengths[1]; 
+    LOCK(&pool->lock);
+    timeout = (pool->timeout + 999) / 1000;
+    UNLOCK(&pool->lock);
+    if (timeout > 0)
+    {
+        (void)mysql_options(&dbc->conn, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+#ifndef MYSQLDB_NONBLOCKING
+        (void)mysql_options(&dbc->conn, MYSQL_OPT_READ_TIMEOUT, &timeout);
+        (void)mysql_options(&dbc->conn, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+#endif
+    }
+#ifdef MYSQLDB_NONBLOCKING
+    (void)mysql_options(&dbc->conn, MYSQL_OPT_NONBLOCK, 0);
+#endif
 
-    results[2].buffer_type    = MYSQL_TYPE_STRING;
-    results[2].buffer         = (char *) data; 
-    results[2].buffer_length  = DATA_LENGTH; 
-    results[2].is_null        = 0;
-    results[2].length         = &result_lengths[2]; 
+    (void)isc_time_now(&start);
+    if (mysql_real_connect(&dbc->conn, pool->host, pool->user, pool->passwd, pool->database, 0, NULL, 0))
+    {
+        stats_time(NULL, TIMER_CONNECT, &start);
+        dbc->connected = ISC_TRUE;
+        LOCK(&pool->lock);
+        wasdown = pool->down;
+        pool->down = ISC_FALSE;
+        if (wasdown)
+            pool->failures = 0;     /* reopening a timed-out one is no success */
+        UNLOCK(&pool->lock);
+        if (wasdown)
+            isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                          NS_LOGMODULE_MAIN, ISC_LOG_INFO,
+                          "mysql://%s:<password>@%s/%s is reachable again",
+                          pool->user, pool->host, pool->database);
+        return (ISC_R_SUCCESS);
+    }
 
-    UNUSED(zone);
+    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                  NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                  "ERROR: (%d):%s - unable to connect to the mysql://%s:<password>@%s/%s",
+                  mysql_errno(&dbc->conn),
+                  mysql_error(&dbc->conn),
+                  pool->user,
+                  pool->host,
+                  pool->database);
+    mysql_close(&dbc->conn);
+    dbc->connected = ISC_FALSE;
+    LOCK(&pool->lock);
+    pool->down = ISC_TRUE;
+    opened = pool_failure_locked(pool);
+    UNLOCK(&pool->lock);
+    if (opened)
+        pool_opened(pool);
+    return (ISC_R_FAILURE);
+}
 
+/*
+ * Close a connection if it is open, along with its prepared statements.
+ */
+static void db_disconnect(struct dbconn *dbc)
+{
+    struct dbstmts *st;
+    struct dbfeedstmt *fst;
 
-    result = maybe_reconnect(dbi);
-    if (result != ISC_R_SUCCESS)
+    while ((st = dbc->stmts) != NULL)
     {
-	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "ERROR: (%d):%s - unable to (re)connect to the mysql://%s:<password>@%s/%s",
-                  mysql_stmt_errno(stmt),
-                  mysql_stmt_error(stmt),
-                  dbi->user,
-                  dbi->host,
-                  dbi->database);
-        return (result);
+        dbc->stmts = st->next;
+        if (st->lookup != NULL)
+            mysql_stmt_close(st->lookup);
+        if (st->allnodes != NULL)
+            mysql_stmt_close(st->allnodes);
+        if (st->allpage != NULL)
+            mysql_stmt_close(st->allpage);
+        if (st->closest != NULL)
+            mysql_stmt_close(st->closest);
+        if (st->batch != NULL)
+            mysql_stmt_close(st->batch);
+        isc_mem_free(ns_g_mctx, st->table);
+        isc_mem_put(ns_g_mctx, st, sizeof(struct dbstmts));
     }
+    while ((fst = dbc->feedstmts) != NULL)
+    {
+        dbc->feedstmts = fst->next;
+        mysql_stmt_close(fst->poll);
+        isc_mem_free(ns_g_mctx, fst->table);
+        isc_mem_put(ns_g_mctx, fst, sizeof(struct dbfeedstmt));
+    }
+    if (dbc->connected)
+        mysql_close(&dbc->conn);
+    dbc->connected = ISC_FALSE;
+    dbc->timedout = ISC_FALSE;
+}
 
-#ifdef MYSQLDB_DEBUG
-	isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "connected to the mysql://%s:<password>@%s/%s",
-                  dbi->user,
-                  dbi->host,
-                  dbi->database);
-#endif
+/*
+ * Whether a query failed because the connection has gone away, rather
+ * than on the server.
+ */
+static isc_boolean_t connection_lost(unsigned int err)
+{
+    return (ISC_TF(err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST));
+}
+
+/*
+ * Prepare one of the driver's queries against "table".  A failure is
+ * logged unless "quiet" is set, and its error number stored in "errp" if
+ * that is not NULL: closing the failed statement clears the connection's.
+ */
+static MYSQL_STMT *db_prepare(struct dbconn *dbc, const char *format, const char *table,
+                              isc_boolean_t quiet, unsigned int *errp)
+{
+    MYSQL_STMT *stmt;
+    isc_time_t start;
+    char *query;
+    size_t len;
 
-    stmt = mysql_stmt_init(&dbi->conn);
+    if (errp != NULL)
+        *errp = 0;
+    len = strlen(format) + strlen(table) + 1;
+    query = isc_mem_get(ns_g_mctx, len);
+    if (query == NULL)
+        return (NULL);
+    snprintf(query, len, format, table);
 
+    (void)isc_time_now(&start);
+    stmt = mysql_stmt_init(&dbc->conn);
     if (!stmt)
     {
 	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
 			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
 			      "Failure! Unable to initialize prepared statement handle");
-        return (ISC_R_FAILURE);
+        if (errp != NULL)
+            *errp = mysql_errno(&dbc->conn);
     }
-    if (mysql_stmt_prepare(stmt, db_lookup_query, strlen(db_lookup_query)) != 0)
-    {
-	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "ERROR: Unable to prepare statement: %s",
-                  db_lookup_query);
-        return (ISC_R_FAILURE);
-    } 
-    if (mysql_stmt_bind_param(stmt, params) != 0)
+    else if (mysql_stmt_prepare(stmt, query, strlen(query)) != 0)
     {
+        if (!quiet)
 	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
 			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "ERROR: Unable to bind input params");
-        return (ISC_R_FAILURE);
-    } 
-    if (mysql_stmt_execute(stmt) != 0)
-    {
-	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "ERROR: Unable to execute statement!");
-        return (ISC_R_FAILURE);
+			      "ERROR: Unable to prepare statement: %s: %s",
+                  query, mysql_stmt_error(stmt));
+        if (errp != NULL)
+            *errp = mysql_stmt_errno(stmt);
+        mysql_stmt_close(stmt);
+        stmt = NULL;
+    }
+    else
+        stats_time(NULL, TIMER_PREPARE, &start);
+    isc_mem_put(ns_g_mctx, query, len);
+    return (stmt);
+}
+
+#ifdef MYSQLDB_NONBLOCKING
+/*
+ * Wait for what a non-blocking call is waiting on: its socket, or the
+ * client library's own timeout.  Once the deadline has passed, the socket
+ * is shut down instead, which makes the call fail at its next step, and
+ * the connection is marked to be reopened.  A library timeout that has
+ * already run out (0 ms) is handed back at once rather than polled for.
+ */
+static int db_wait(struct dbconn *dbc, int status, const isc_time_t *deadline)
+{
+    struct pollfd pfd;
+    isc_time_t now;
+    isc_uint64_t usec;
+    unsigned int libtimeout;
+    isc_boolean_t libwait;
+    int timeout, n;
+
+    pfd.fd = mysql_get_socket(&dbc->conn);
+    pfd.events = 0;
+    if ((status & MYSQL_WAIT_READ) != 0)
+        pfd.events |= POLLIN;
+    if ((status & MYSQL_WAIT_WRITE) != 0)
+        pfd.events |= POLLOUT;
+    if ((status & MYSQL_WAIT_EXCEPT) != 0)
+        pfd.events |= POLLPRI;
+
+    for (;;)
+    {
+        (void)isc_time_now(&now);
+        usec = isc_time_microdiff(deadline, &now);
+        if (usec == 0)
+        {
+            dbc->timedout = ISC_TRUE;
+            (void)shutdown(pfd.fd, SHUT_RDWR);
+            return (status & ~MYSQL_WAIT_TIMEOUT);
+        }
+
+        timeout = (int)((usec + 999) / 1000);
+        libwait = ISC_FALSE;
+        if ((status & MYSQL_WAIT_TIMEOUT) != 0)
+        {
+            libtimeout = mysql_get_timeout_value_ms(&dbc->conn);
+            if (libtimeout <= (unsigned int)timeout)
+            {
+                timeout = libtimeout;
+                libwait = ISC_TRUE;
+            }
+        }
+
+        n = poll(&pfd, 1, timeout);
+        if (n > 0)
+        {
+            status = 0;
+            if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+                status |= MYSQL_WAIT_READ;
+            if ((pfd.revents & (POLLOUT | POLLHUP | POLLERR)) != 0)
+                status |= MYSQL_WAIT_WRITE;
+            if ((pfd.revents & POLLPRI) != 0)
+                status |= MYSQL_WAIT_EXCEPT;
+            return (status);
+        }
+        if (n == 0 && libwait)
+            return (MYSQL_WAIT_TIMEOUT);
+        if (n < 0 && errno != EINTR)
+            return (status);
+    }
+}
+#endif
+
+/*
+ * Execute a statement, giving up at "deadline" if there is one.  Either
+ * way a failure is reported like mysql_stmt_execute()'s, and
+ * dbc->timedout is set if it was the deadline.
+ */
+static int db_execute(struct dbconn *dbc, MYSQL_STMT *stmt, const isc_time_t *deadline)
+{
+#ifdef MYSQLDB_NONBLOCKING
+    int status, ret;
+
+    if (deadline != NULL)
+    {
+        status = mysql_stmt_execute_start(&ret, stmt);
+        while (status != 0)
+            status = mysql_stmt_execute_cont(&ret, stmt, db_wait(dbc, status, deadline));
+        return (ret);
+    }
+#else
+    UNUSED(dbc);
+    UNUSED(deadline);
+#endif
+    return (mysql_stmt_execute(stmt));
+}
+
+/*
+ * Buffer a statement's result, giving up at "deadline" as db_execute()
+ * does.
+ */
+static int db_store_result(struct dbconn *dbc, MYSQL_STMT *stmt, const isc_time_t *deadline)
+{
+#ifdef MYSQLDB_NONBLOCKING
+    int status, ret;
+
+    if (deadline != NULL)
+    {
+        status = mysql_stmt_store_result_start(&ret, stmt);
+        while (status != 0)
+            status = mysql_stmt_store_result_cont(&ret, stmt, db_wait(dbc, status, deadline));
+        return (ret);
+    }
+#else
+    UNUSED(dbc);
+    UNUSED(deadline);
+#endif
+    return (mysql_stmt_store_result(stmt));
+}
+
+/*
+ * The statements for each layout of the records table, the most capable
+ * first.  A table lacking a column makes the lookup fail to prepare, and
+ * the next layout is tried.  The rname column is looked for separately,
+ * by preparing the rname allnodes query.
+ */
+struct querylayout
+{
+    const char *lookup;
+    const char *closest;
+    const char *allnodes;
+    const char *allpage;
+    const char *allnodes_rname;
+    const char *allpage_rname;
+    const char *batch;
+    isc_boolean_t hasrdata;
+};
+
+static const struct querylayout layouts[] = {
+    { LOOKUP_LNAME_RDATA_QUERY, CLOSEST_LNAME_RDATA_QUERY, ALLNODES_RDATA_QUERY,
+      ALLPAGE_RDATA_QUERY, ALLNODES_RNAME_RDATA_QUERY, ALLPAGE_RNAME_RDATA_QUERY,
+      BATCH_LNAME_RDATA_QUERY, ISC_TRUE },
+    { LOOKUP_LNAME_QUERY, CLOSEST_LNAME_QUERY, ALLNODES_QUERY,
+      ALLPAGE_QUERY, ALLNODES_RNAME_QUERY, ALLPAGE_RNAME_QUERY,
+      BATCH_LNAME_QUERY, ISC_FALSE },
+    { LOOKUP_RDATA_QUERY, CLOSEST_RDATA_QUERY, ALLNODES_RDATA_QUERY,
+      ALLPAGE_RDATA_QUERY, ALLNODES_RNAME_RDATA_QUERY, ALLPAGE_RNAME_RDATA_QUERY,
+      BATCH_RDATA_QUERY, ISC_TRUE },
+    { LOOKUP_QUERY, CLOSEST_QUERY, ALLNODES_QUERY,
+      ALLPAGE_QUERY, ALLNODES_RNAME_QUERY, ALLPAGE_RNAME_QUERY,
+      BATCH_QUERY, ISC_FALSE }
+};
+
+/*
+ * Find the statements already prepared on this connection for "table",
+ * preparing them on first use.  Only the leasing thread touches them.
+ * ISC_R_CONNECTIONRESET means the connection was found lost, and is
+ * worth reopening (see db_reconnect()) and trying again.
+ */
+static isc_result_t db_statements(struct dbconn *dbc, const char *table, struct dbstmts **stp)
+{
+    struct dbstmts *st;
+    isc_boolean_t last;
+    unsigned int i, err = 0;
+
+    for (st = dbc->stmts; st != NULL; st = st->next)
+    {
+        if (strcmp(st->table, table) == 0)
+        {
+            *stp = st;
+            return (ISC_R_SUCCESS);
+        }
+    }
+
+    st = isc_mem_get(ns_g_mctx, sizeof(struct dbstmts));
+    if (st == NULL)
+        return (ISC_R_NOMEMORY);
+    memset(st, 0, sizeof(struct dbstmts));
+    st->table = isc_mem_strdup(ns_g_mctx, table);
+    if (st->table == NULL)
+        goto failure;
+
+    for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++)
+    {
+        last = ISC_TF(i == sizeof(layouts) / sizeof(layouts[0]) - 1);
+        st->lookup = db_prepare(dbc, layouts[i].lookup, table, ISC_TF(!last), &err);
+        if (st->lookup != NULL)
+            break;
+        if (last || connection_lost(err))
+            goto failure;
+    }
+    st->layout = &layouts[i];
+    st->hasrdata = layouts[i].hasrdata;
+    st->allnodes = db_prepare(dbc, layouts[i].allnodes_rname, table, ISC_TRUE, &err);
+    st->hasrname = ISC_TF(st->allnodes != NULL);
+    if (st->allnodes == NULL && connection_lost(err))
+        goto failure;
+    if (st->allnodes == NULL)
+        st->allnodes = db_prepare(dbc, layouts[i].allnodes, table, ISC_FALSE, &err);
+    if (st->allnodes == NULL)
+        goto failure;
+    st->closest = db_prepare(dbc, layouts[i].closest, table, ISC_FALSE, &err);
+    if (st->closest == NULL)
+        goto failure;
+
+    if (mysql_stmt_bind_param(st->lookup, dbc->buf.params) != 0 ||
+        mysql_stmt_bind_result(st->lookup, dbc->buf.lookup_results) != 0 ||
+        mysql_stmt_bind_param(st->closest, dbc->buf.params) != 0 ||
+        mysql_stmt_bind_result(st->closest, dbc->buf.closest_results) != 0)
+    {
+	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "ERROR: Unable to bind the lookup statements' buffers");
+        goto failure;
+    }
+
+    st->next = dbc->stmts;
+    dbc->stmts = st;
+    *stp = st;
+    return (ISC_R_SUCCESS);
+
+failure:
+    if (st->lookup != NULL)
+        mysql_stmt_close(st->lookup);
+    if (st->allnodes != NULL)
+        mysql_stmt_close(st->allnodes);
+    if (st->closest != NULL)
+        mysql_stmt_close(st->closest);
+    if (st->table != NULL)
+        isc_mem_free(ns_g_mctx, st->table);
+    isc_mem_put(ns_g_mctx, st, sizeof(struct dbstmts));
+    return (connection_lost(err) ? ISC_R_CONNECTIONRESET : ISC_R_FAILURE);
+}
+
+/*
+ * Replace a connection that a query found dead.  Connections are not
+ * checked before use; instead a query that fails with connection_lost()
+ * reconnects, prepares its statements again (those of the old connection
+ * are discarded) and is retried once.  (Automatic reconnection in the
+ * client library stays off, since it would silently invalidate them.)
+ */
+static isc_result_t db_reconnect(struct dbconn *dbc)
+{
+    stats_increment(NULL, STAT_RECONNECT);
+    db_disconnect(dbc);
+    return (db_connect(dbc));
+}
+
+static isc_boolean_t same_string(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return (ISC_TF(a == b));
+    return (ISC_TF(strcmp(a, b) == 0));
+}
+
+/*
+ * Find the pool for (host, user, database), with the zone's user and
+ * database, creating it if this is the first zone to use that server.
+ * "host" is the zone's own or one of its replicas.  The pool's size is
+ * the largest "pool=" requested by any of its zones.
+ */
+static isc_result_t pool_attach(struct dbinfo *dbi, const char *host,
+                                struct dbpool **poolp)
+{
+    struct dbpool *pool;
+    isc_result_t result = ISC_R_NOMEMORY;
+
+    LOCK(&poollock);
+    for (pool = pools; pool != NULL; pool = pool->next)
+    {
+        if (same_string(pool->host, host) &&
+            same_string(pool->user, dbi->user) &&
+            same_string(pool->database, dbi->database))
+            break;
+    }
+
+    if (pool == NULL)
+    {
+        pool = isc_mem_get(ns_g_mctx, sizeof(struct dbpool));
+        if (pool == NULL)
+        {
+            UNLOCK(&poollock);
+            return (ISC_R_NOMEMORY);
+        }
+        memset(pool, 0, sizeof(struct dbpool));
+
+#define POOL_STRDUP(target, source)                             \
+        if ((source) != NULL)                                   \
+        {                                                       \
+            target = isc_mem_strdup(ns_g_mctx, source);         \
+            if (target == NULL)                                 \
+                goto nomemory;                                  \
+        }
+
+        POOL_STRDUP(pool->host,     host);
+        POOL_STRDUP(pool->user,     dbi->user);
+        POOL_STRDUP(pool->passwd,   dbi->passwd);
+        POOL_STRDUP(pool->database, dbi->database);
+#undef POOL_STRDUP
+
+        result = isc_mutex_init(&pool->lock);
+        if (result != ISC_R_SUCCESS)
+            goto nomemory;
+        result = isc_condition_init(&pool->ready);
+        if (result != ISC_R_SUCCESS)
+        {
+            DESTROYLOCK(&pool->lock);
+            goto nomemory;
+        }
+        result = isc_condition_init(&pool->batched);
+        if (result != ISC_R_SUCCESS)
+        {
+            (void)isc_condition_destroy(&pool->ready);
+            DESTROYLOCK(&pool->lock);
+            goto nomemory;
+        }
+
+        pool->next = pools;
+        pools = pool;
+    }
+
+    if (pool->size < dbi->poolsize)
+        pool->size = dbi->poolsize;
+    if (dbi->keepalive > 0 &&
+        (pool->keepalive == 0 || dbi->keepalive < pool->keepalive))
+    {
+        LOCK(&pool->lock);
+        pool->keepalive = dbi->keepalive;
+        UNLOCK(&pool->lock);
+    }
+    if (dbi->timeout > 0 &&
+        (pool->timeout == 0 || dbi->timeout < pool->timeout))
+    {
+        LOCK(&pool->lock);
+        pool->timeout = dbi->timeout;
+        UNLOCK(&pool->lock);
+    }
+    if (dbi->breaker > 0 &&
+        (pool->breaker == 0 || dbi->breaker < pool->breaker))
+    {
+        LOCK(&pool->lock);
+        pool->breaker = dbi->breaker;
+        UNLOCK(&pool->lock);
+    }
+    pool->refs++;
+    *poolp = pool;
+    UNLOCK(&poollock);
+    return (ISC_R_SUCCESS);
+
+nomemory:
+    UNLOCK(&poollock);
+    if (pool->host != NULL)
+        isc_mem_free(ns_g_mctx, pool->host);
+    if (pool->user != NULL)
+        isc_mem_free(ns_g_mctx, pool->user);
+    if (pool->passwd != NULL)
+        isc_mem_free(ns_g_mctx, pool->passwd);
+    if (pool->database != NULL)
+        isc_mem_free(ns_g_mctx, pool->database);
+    isc_mem_put(ns_g_mctx, pool, sizeof(struct dbpool));
+    return (result);
+}
+
+/*
+ * Drop a zone's reference to a pool, closing every connection once the
+ * last zone using it is gone.
+ */
+static void pool_detach(struct dbpool **poolp)
+{
+    struct dbpool *pool = *poolp;
+    struct dbpool **prevp;
+    struct dbconn *dbc;
+
+    if (pool == NULL)
+        return;
+    *poolp = NULL;
+
+    LOCK(&poollock);
+    if (--pool->refs > 0)
+    {
+        UNLOCK(&poollock);
+        return;
+    }
+
+    for (prevp = &pools; *prevp != pool; prevp = &(*prevp)->next)
+        ;
+    *prevp = pool->next;
+    UNLOCK(&poollock);
+
+    while ((dbc = pool->conns) != NULL)
+    {
+        pool->conns = dbc->next;
+        db_disconnect(dbc);
+        if (dbc->batchbuf != NULL)
+            isc_mem_put(ns_g_mctx, dbc->batchbuf, sizeof(struct dbbatchbuf));
+        isc_mem_put(ns_g_mctx, dbc, sizeof(struct dbconn));
+    }
+    if (pool->host != NULL)
+        isc_mem_free(ns_g_mctx, pool->host);
+    if (pool->user != NULL)
+        isc_mem_free(ns_g_mctx, pool->user);
+    if (pool->passwd != NULL)
+        isc_mem_free(ns_g_mctx, pool->passwd);
+    if (pool->database != NULL)
+        isc_mem_free(ns_g_mctx, pool->database);
+    (void)isc_condition_destroy(&pool->batched);
+    (void)isc_condition_destroy(&pool->ready);
+    DESTROYLOCK(&pool->lock);
+    isc_mem_put(ns_g_mctx, pool, sizeof(struct dbpool));
+}
+
+/*
+ * Point a connection's lookup bindings at its buffers.
+ */
+static void dbbuf_init(struct dbbuf *buf)
+{
+    MYSQL_BIND *b;
+    unsigned int i;
+
+    for (i = 0; i < 2 + CLOSEST_NAMES; i++)
+    {
+        b = &buf->params[i];
+        b->buffer_type = MYSQL_TYPE_STRING;
+        if (i == 0)
+        {
+            b->buffer = buf->tenant_id;
+            b->buffer_length = ID_LENGTH;
+        }
+        else if (i == 1)
+        {
+            b->buffer = buf->domain_id;
+            b->buffer_length = ID_LENGTH;
+        }
+        else if (i == 2)
+        {
+            b->buffer = buf->name;
+            b->buffer_length = NAME_LENGTH;
+        }
+        else
+        {
+            b->buffer = buf->candidates[i - 3];
+            b->buffer_length = DATA_LENGTH + 3;
+        }
+        b->length = &buf->param_lengths[i];
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        b = (i == 0) ? buf->lookup_results : buf->closest_results;
+
+        b[0].buffer_type    = MYSQL_TYPE_LONG;
+        b[0].buffer         = (char *) &buf->ttl;
+        b[0].is_unsigned    = 1;
+        b[0].length         = &buf->result_lengths[0];
+
+        b[1].buffer_type    = MYSQL_TYPE_STRING;
+        b[1].buffer         = buf->type;
+        b[1].buffer_length  = TYPE_LENGTH;
+        b[1].length         = &buf->result_lengths[1];
+
+        b[2].buffer_type    = MYSQL_TYPE_STRING;
+        b[2].buffer         = buf->data;
+        b[2].buffer_length  = DATA_LENGTH;
+        b[2].length         = &buf->result_lengths[2];
+
+        /* the names are only selected when there are several to tell apart */
+        if (i == 1)
+        {
+            b[3].buffer_type    = MYSQL_TYPE_STRING;
+            b[3].buffer         = buf->rowname;
+            b[3].buffer_length  = DATA_LENGTH;
+            b[3].length         = &buf->result_lengths[3];
+            b++;
+        }
+
+        /* only bound when the statement selects rdata */
+        b[3].buffer_type    = MYSQL_TYPE_BLOB;
+        b[3].buffer         = buf->rdata;
+        b[3].buffer_length  = RDATA_LENGTH;
+        b[3].is_null        = &buf->rdnull;
+        b[3].error          = &buf->rdtruncated;
+        b[3].length         = &buf->result_lengths[4];
+    }
+}
+
+/*
+ * Add an unconnected connection to the pool.  Called with the pool's
+ * lock held, once it is known to be below its size.
+ */
+static struct dbconn *pool_grow(struct dbpool *pool)
+{
+    struct dbconn *dbc;
+
+    dbc = isc_mem_get(ns_g_mctx, sizeof(struct dbconn));
+    if (dbc == NULL)
+        return (NULL);
+    memset(dbc, 0, sizeof(struct dbconn));
+    dbbuf_init(&dbc->buf);
+    dbc->pool = pool;
+    dbc->next = pool->conns;
+    pool->conns = dbc;
+    pool->count++;
+    return (dbc);
+}
+
+/*
+ * Lease a live connection from the pool.  Idle connections are reused
+ * first; a new one is opened only if the pool is below its size,
+ * otherwise the caller waits for another thread to return one, until
+ * "deadline" if it is not NULL.  The (re)connect happens outside the pool
+ * lock so one slow server handshake does not stall every other lease.
+ */
+static isc_result_t pool_lease(struct dbpool *pool, isc_time_t *deadline,
+                               struct dbconn **dbcp)
+{
+    struct dbconn *dbc;
+    isc_result_t result;
+
+    LOCK(&pool->lock);
+    if (pool->breaker > 0 && pool->failures >= pool->breaker)
+    {
+        UNLOCK(&pool->lock);
+        return (ISC_R_CONNREFUSED);
+    }
+    for (;;)
+    {
+        for (dbc = pool->conns; dbc != NULL; dbc = dbc->next)
+        {
+            if (!dbc->inuse)
+                break;
+        }
+        if (dbc != NULL)
+            break;
+
+        if (pool->count < pool->size)
+        {
+            dbc = pool_grow(pool);
+            if (dbc == NULL)
+            {
+                UNLOCK(&pool->lock);
+                return (ISC_R_NOMEMORY);
+            }
+            break;
+        }
+
+        if (deadline == NULL)
+            WAIT(&pool->ready, &pool->lock);
+        else if (isc_condition_waituntil(&pool->ready, &pool->lock,
+                                         deadline) == ISC_R_TIMEDOUT)
+        {
+            UNLOCK(&pool->lock);
+            return (ISC_R_TIMEDOUT);
+        }
+    }
+    dbc->inuse = ISC_TRUE;
+    UNLOCK(&pool->lock);
+
+    /* the client library keeps per-thread state; this is a no-op once set up */
+    mysql_thread_init();
+
+    if (!dbc->connected)
+    {
+        result = db_connect(dbc);
+        if (result != ISC_R_SUCCESS)
+        {
+            pool_return(dbc);
+            return (result);
+        }
+    }
+
+    *dbcp = dbc;
+    return (ISC_R_SUCCESS);
+}
+
+/*
+ * Hand a leased connection back to its pool and wake one waiter.  A
+ * connection abandoned mid-query is closed first, to be reopened by its
+ * next lease.
+ */
+static void pool_return(struct dbconn *dbc)
+{
+    struct dbpool *pool = dbc->pool;
+
+    if (dbc->timedout)
+        db_disconnect(dbc);
+
+    LOCK(&pool->lock);
+    dbc->inuse = ISC_FALSE;
+    isc_stdtime_get(&dbc->lastused);
+    SIGNAL(&pool->ready);
+    UNLOCK(&pool->lock);
+}
+
+/*
+ * Ping the connections that have sat idle for the pool's keepalive
+ * interval, replacing any that have gone away, so that idle connections
+ * stay open and a lookup is rarely the one to find a dead connection.
+ * Called by the maintenance thread, which holds a reference on the pool,
+ * without poollock.
+ */
+static void pool_keepalive(struct dbpool *pool, isc_stdtime_t now)
+{
+    struct dbconn *dbc;
+
+    for (;;)
+    {
+        LOCK(&pool->lock);
+        for (dbc = pool->conns; dbc != NULL; dbc = dbc->next)
+        {
+            if (!dbc->inuse && dbc->connected && pool->keepalive > 0 &&
+                now >= dbc->lastused + pool->keepalive)
+                break;
+        }
+        if (dbc != NULL)
+            dbc->inuse = ISC_TRUE;
+        UNLOCK(&pool->lock);
+        if (dbc == NULL)
+            break;
+
+        if (mysql_ping(&dbc->conn) != 0)
+            (void)db_reconnect(dbc);
+        pool_return(dbc);
+    }
+}
+
+/*
+ * Try to reconnect to a server marked down, every POOL_PROBE_INTERVAL
+ * seconds, so that its pool is marked up again (and replica_pick() sends
+ * it lookups again) without a lookup having to wait on the attempt.  With
+ * breaker=N this is the only attempt made while the server is down.  An
+ * idle connection is reopened; if every one is leased, the server is
+ * evidently answering and the probe waits for the next pass.  Called as
+ * pool_keepalive() is.
+ */
+static void pool_probe(struct dbpool *pool, isc_stdtime_t now)
+{
+    struct dbconn *dbc;
+
+    LOCK(&pool->lock);
+    if (!pool->down || now < pool->probenext)
+    {
+        UNLOCK(&pool->lock);
+        return;
+    }
+    pool->probenext = now + POOL_PROBE_INTERVAL;
+    for (dbc = pool->conns; dbc != NULL; dbc = dbc->next)
+    {
+        if (!dbc->inuse)
+            break;
+    }
+    if (dbc == NULL && pool->count < pool->size)
+        dbc = pool_grow(pool);
+    if (dbc != NULL)
+        dbc->inuse = ISC_TRUE;
+    UNLOCK(&pool->lock);
+    if (dbc == NULL)
+        return;
+
+    db_disconnect(dbc);
+    (void)db_connect(dbc);
+    pool_return(dbc);
+}
+
+/*
+ * Fold the time a lookup took, from "start", into the server's moving
+ * average, weighting the newest by 1/8, and count a timeout against
+ * breaker=N.
+ */
+static void pool_latency(struct dbpool *pool, const isc_time_t *start,
+                         isc_boolean_t timedout)
+{
+    isc_time_t now;
+    isc_uint64_t usec;
+    isc_boolean_t opened = ISC_FALSE;
+
+    if (isc_time_now(&now) != ISC_R_SUCCESS)
+        return;
+    usec = isc_time_microdiff(&now, start);
+    if (usec > 0xffffffffU)
+        usec = 0xffffffffU;
+
+    LOCK(&pool->lock);
+    if (usec >= pool->latency)
+        pool->latency += (unsigned int)(usec - pool->latency) / 8;
+    else
+        pool->latency -= (pool->latency - (unsigned int)usec) / 8;
+    if (!timedout)
+        pool->failures = 0;
+    else
+        opened = pool_failure_locked(pool);
+    UNLOCK(&pool->lock);
+
+    if (opened)
+        pool_opened(pool);
+}
+
+/*
+ * Draw an index at random, each in proportion to its weight.
+ */
+static unsigned int replica_draw(const unsigned int *weights, unsigned int total)
+{
+    isc_uint32_t r;
+    unsigned int i;
+
+    isc_random_get(&r);
+    r %= total;
+    for (i = 0; r >= weights[i]; i++)
+        r -= weights[i];
+    return (i);
+}
+
+/*
+ * Choose which of the zone's replicas to send a lookup to, skipping those
+ * marked down, or NULL if they all are.  Replicas are drawn in proportion
+ * to their weights.  With balance=latency, two are drawn and the one
+ * whose recent lookups were faster is used; always taking the fastest
+ * would send it every lookup until it slowed down.
+ */
+static struct dbpool *replica_pick(struct dbinfo *dbi)
+{
+    unsigned int weights[MYSQLDB_MAX_REPLICAS];
+    unsigned int latency[MYSQLDB_MAX_REPLICAS];
+    unsigned int i, a, b, total = 0;
+    struct dbpool *pool;
+
+    for (i = 0; i < dbi->nreplicas; i++)
+    {
+        pool = dbi->replicas[i].pool;
+        LOCK(&pool->lock);
+        weights[i] = pool->down ? 0 : dbi->replicas[i].weight;
+        latency[i] = pool->latency;
+        UNLOCK(&pool->lock);
+        total += weights[i];
+    }
+    if (total == 0)
+        return (NULL);
+
+    a = replica_draw(weights, total);
+    if (dbi->leastlatency)
+    {
+        b = replica_draw(weights, total);
+        if (latency[b] < latency[a])
+            a = b;
+    }
+    return (dbi->replicas[a].pool);
+}
+
+/*
+ * Lease a connection for one of the zone's queries.  Unless "primary" is
+ * set, it comes from one of the zone's replicas, if it has any.  A
+ * replica that cannot be reached is marked down by db_connect() and
+ * another is tried; once none is left, the query goes to the zone's own
+ * host.
+ */
+static isc_result_t db_lease(struct dbinfo *dbi, isc_boolean_t primary,
+                             isc_time_t *deadline, struct dbconn **dbcp)
+{
+    struct dbpool *pool;
+    unsigned int tries;
+    isc_result_t result;
+
+    if (!primary && dbi->nreplicas > 0)
+    {
+        for (tries = 0; tries < dbi->nreplicas; tries++)
+        {
+            pool = replica_pick(dbi);
+            if (pool == NULL)
+                break;
+            result = pool_lease(pool, deadline, dbcp);
+            if (result == ISC_R_SUCCESS || result == ISC_R_TIMEDOUT)
+                return (result);
+        }
+        stats_increment(dbi, STAT_FAILOVER);
+    }
+    return (pool_lease(dbi->pool, deadline, dbcp));
+}
+
+/*
+ * Answer cache.
+ *
+ * Rows fetched by mysqldb_lookup are kept, keyed on (tenant_id,
+ * domain_id, name), for no longer than the smallest TTL among them.  A
+ * name with no rows is cached as NOTFOUND for the zone's negative TTL,
+ * min(SOA TTL, SOA minimum), once the apex SOA has been seen.  The cache
+ * is split into shards, each with its own lock, LRU list and share of the
+ * memory bound, so concurrent lookups rarely contend.
+ *
+ * With stale=SECS, an answer outlives its TTL by SECS seconds, until it
+ * is evicted or replaced.  It is no longer a hit, but cache_stale() still
+ * finds it for a lookup the database has failed to answer.
+ *
+ * An answer is held as a packed rrset: for each record, the TTL, the
+ * length of its wire-format rdata (RDLEN_NONE if it has none) and the
+ * NUL-terminated type, followed by either the rdata or the NUL-terminated
+ * data string.
+ */
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 4096
+#define RRSET_LENGTH 4096
+#define KEY_LENGTH 1280
+#define RDLEN_NONE 0xffffffffU
+
+struct rrset
+{
+    unsigned char buf[RRSET_LENGTH];
+    unsigned int len;
+    unsigned int count;
+    dns_ttl_t minttl;
+    isc_boolean_t overflow;
+};
+
+struct cacheentry
+{
+    struct cacheentry *next;
+    struct cacheentry *lru_prev;
+    struct cacheentry *lru_next;
+    isc_uint32_t hash;
+    isc_stdtime_t expire;
+    isc_stdtime_t stale;        /* kept until then for cache_stale() */
+    unsigned int size;
+    unsigned int keylen;
+    unsigned int rrlen;         /* 0 for a cached NOTFOUND */
+    /* followed by the key, then the packed rrset */
+};
+
+struct cacheshard
+{
+    isc_mutex_t lock;
+    struct cacheentry **buckets;
+    struct cacheentry *lru_head;
+    struct cacheentry *lru_tail;
+    size_t size;
+    size_t maxsize;
+};
+
+static struct cacheshard cache[CACHE_SHARDS];
+
+/*
+ * Bumped by the change feed before it evicts anything.  An answer read
+ * from the database is only cached if the generation has not moved since
+ * the read began, so a lookup racing an edit cannot cache the old rows
+ * after the feed has evicted them.
+ */
+static unsigned int cache_gen = 0;
+static isc_mutex_t cache_genlock;
+
+#define ENTRY_KEY(e) ((char *)((e) + 1))
+#define ENTRY_RRSET(e) ((unsigned char *)((e) + 1) + (e)->keylen)
+
+static void rrset_init(struct rrset *rrs)
+{
+    rrs->len = 0;
+    rrs->count = 0;
+    rrs->minttl = 0xffffffffU;
+    rrs->overflow = ISC_FALSE;
+}
+
+/*
+ * Convert a type name to its number.
+ */
+static isc_boolean_t rdatatype(const char *type, dns_rdatatype_t *rdtypep)
+{
+    isc_textregion_t r;
+
+    r.base = (char *) type;
+    r.length = strlen(type);
+    return (ISC_TF(dns_rdatatype_fromtext(rdtypep, &r) == ISC_R_SUCCESS));
+}
+
+/*
+ * Hand one record to BIND.  Wire-format rdata, when a row has it, is
+ * passed as is; otherwise BIND parses the text.  The fetch functions
+ * only supply rdata for types rdatatype() understands.
+ */
+static isc_result_t put_rr(struct dbinfo *dbi, dns_sdblookup_t *lookup, const char *type,
+                           dns_ttl_t ttl, const char *data,
+                           const unsigned char *rdata, unsigned int rdlen)
+{
+    dns_rdatatype_t rdtype;
+    isc_time_t start;
+    isc_result_t result;
+
+    (void)isc_time_now(&start);
+    if (rdata == NULL)
+        result = dns_sdb_putrr(lookup, type, ttl, data);
+    else if (!rdatatype(type, &rdtype))
+        result = ISC_R_UNEXPECTED;
+    else
+        result = dns_sdb_putrdata(lookup, rdtype, ttl, rdata, rdlen);
+    stats_time(dbi, TIMER_PUTRR, &start);
+    return (result);
+}
+
+static isc_result_t put_namedrr(struct dbinfo *dbi, dns_sdballnodes_t *allnodes,
+                                const char *name, const char *type, dns_ttl_t ttl,
+                                const char *data,
+                                const unsigned char *rdata, unsigned int rdlen)
+{
+    dns_rdatatype_t rdtype;
+    isc_time_t start;
+    isc_result_t result;
+
+    (void)isc_time_now(&start);
+    if (rdata == NULL)
+        result = dns_sdb_putnamedrr(allnodes, name, type, ttl, data);
+    else if (!rdatatype(type, &rdtype))
+        result = ISC_R_UNEXPECTED;
+    else
+        result = dns_sdb_putnamedrdata(allnodes, name, rdtype, ttl, rdata, rdlen);
+    stats_time(dbi, TIMER_PUTRR, &start);
+    return (result);
+}
+
+/*
+ * Append one fetched row.  The text is kept only when there is no wire
+ * rdata.  An rrset too large for the buffer is marked and simply not
+ * cached.
+ */
+static void rrset_add(struct rrset *rrs, dns_ttl_t ttl, const char *type, const char *data,
+                      const unsigned char *rdata, unsigned int rdlen)
+{
+    size_t typelen = strlen(type) + 1;
+    size_t datalen = (rdata != NULL) ? rdlen : strlen(data) + 1;
+    isc_uint32_t len = (rdata != NULL) ? rdlen : RDLEN_NONE;
+
+    if (rrs->overflow ||
+        rrs->len + sizeof(ttl) + sizeof(len) + typelen + datalen > sizeof(rrs->buf))
+    {
+        rrs->overflow = ISC_TRUE;
+        return;
+    }
+    memcpy(rrs->buf + rrs->len, &ttl, sizeof(ttl));
+    rrs->len += sizeof(ttl);
+    memcpy(rrs->buf + rrs->len, &len, sizeof(len));
+    rrs->len += sizeof(len);
+    memcpy(rrs->buf + rrs->len, type, typelen);
+    rrs->len += typelen;
+    memcpy(rrs->buf + rrs->len, (rdata != NULL) ? (const void *) rdata : data, datalen);
+    rrs->len += datalen;
+    rrs->count++;
+    if (ttl < rrs->minttl)
+        rrs->minttl = ttl;
+}
+
+/*
+ * Hand every record of a packed rrset to BIND.
+ */
+static isc_result_t rrset_replay(struct dbinfo *dbi, const unsigned char *buf, unsigned int len,
+                                 dns_sdblookup_t *lookup)
+{
+    const unsigned char *p = buf, *end = buf + len;
+    const unsigned char *rdata;
+    const char *type, *data;
+    isc_uint32_t rdlen;
+    dns_ttl_t ttl;
+    isc_result_t result;
+
+    while (p < end)
+    {
+        memcpy(&ttl, p, sizeof(ttl));
+        p += sizeof(ttl);
+        memcpy(&rdlen, p, sizeof(rdlen));
+        p += sizeof(rdlen);
+        type = (const char *) p;
+        p += strlen(type) + 1;
+        if (rdlen != RDLEN_NONE)
+        {
+            rdata = p;
+            data = NULL;
+            p += rdlen;
+        }
+        else
+        {
+            rdata = NULL;
+            data = (const char *) p;
+            p += strlen(data) + 1;
+        }
+
+        result = put_rr(dbi, lookup, type, ttl, data, rdata, rdlen);
+        if (result != ISC_R_SUCCESS)
+            return (result);
+    }
+    return (ISC_R_SUCCESS);
+}
+
+/*
+ * Build the cache key "tenant_id\0domain_id\0name" with the name folded
+ * to lower case, since the table matches names case-insensitively.
+ */
+static isc_boolean_t cache_key(const char *tenant_id, const char *domain_id, const char *name,
+                               char *key, unsigned int *keylenp)
+{
+    size_t tlen, dlen, nlen, i;
+
+    if (tenant_id == NULL)
+        tenant_id = "";
+    if (domain_id == NULL)
+        domain_id = "";
+    tlen = strlen(tenant_id) + 1;
+    dlen = strlen(domain_id) + 1;
+    nlen = strlen(name) + 1;
+    if (tlen + dlen + nlen > KEY_LENGTH)
+        return (ISC_FALSE);
+
+    memcpy(key, tenant_id, tlen);
+    memcpy(key + tlen, domain_id, dlen);
+    for (i = 0; i < nlen; i++)
+        key[tlen + dlen + i] = tolower((unsigned char) name[i]);
+    *keylenp = tlen + dlen + nlen;
+    return (ISC_TRUE);
+}
+
+/* FNV-1a */
+static isc_uint32_t cache_hash(const char *key, unsigned int keylen)
+{
+    isc_uint32_t hash = 2166136261U;
+    unsigned int i;
+
+    for (i = 0; i < keylen; i++)
+        hash = (hash ^ (unsigned char) key[i]) * 16777619U;
+    return (hash);
+}
+
+#define SHARD(hash) (&cache[(hash) % CACHE_SHARDS])
+#define BUCKET(hash) (((hash) / CACHE_SHARDS) % CACHE_BUCKETS)
+
+static void lru_unlink(struct cacheshard *shard, struct cacheentry *e)
+{
+    if (e->lru_prev != NULL)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        shard->lru_head = e->lru_next;
+    if (e->lru_next != NULL)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        shard->lru_tail = e->lru_prev;
+}
+
+static void lru_push(struct cacheshard *shard, struct cacheentry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL)
+        shard->lru_head->lru_prev = e;
+    else
+        shard->lru_tail = e;
+    shard->lru_head = e;
+}
+
+/*
+ * Unlink an entry from its hash chain and LRU list and free it.  The
+ * shard lock must be held.
+ */
+static void cache_remove(struct cacheshard *shard, struct cacheentry *e)
+{
+    struct cacheentry **ep;
+
+    for (ep = &shard->buckets[BUCKET(e->hash)]; *ep != e; ep = &(*ep)->next)
+        ;
+    *ep = e->next;
+    lru_unlink(shard, e);
+    shard->size -= e->size;
+    isc_mem_put(ns_g_mctx, e, e->size);
+}
+
+static struct cacheentry *cache_find_locked(struct cacheshard *shard, isc_uint32_t hash,
+                                            const char *key, unsigned int keylen)
+{
+    struct cacheentry *e;
+
+    for (e = shard->buckets[BUCKET(hash)]; e != NULL; e = e->next)
+    {
+        if (e->hash == hash && e->keylen == keylen &&
+            memcmp(ENTRY_KEY(e), key, keylen) == 0)
+            return (e);
+    }
+    return (NULL);
+}
+
+/*
+ * Look a key up.  On a hit the packed rrset is copied out, so it can be
+ * replayed without holding the shard lock; ISC_R_NOTFOUND is returned
+ * for a cached negative answer and ISC_R_NOMORE on a miss.
+ */
+static isc_result_t cache_get(const char *key, unsigned int keylen, struct rrset *rrs)
+{
+    isc_uint32_t hash = cache_hash(key, keylen);
+    struct cacheshard *shard = SHARD(hash);
+    struct cacheentry *e;
+    isc_stdtime_t now;
+    isc_result_t result = ISC_R_NOMORE;
+
+    isc_stdtime_get(&now);
+
+    LOCK(&shard->lock);
+    if (shard->buckets == NULL)
+    {
+        UNLOCK(&shard->lock);
+        return (ISC_R_NOMORE);
+    }
+    e = cache_find_locked(shard, hash, key, keylen);
+    if (e != NULL && e->expire <= now)
+    {
+        if (e->stale <= now)
+            cache_remove(shard, e);
+        e = NULL;
+    }
+    if (e != NULL)
+    {
+        lru_unlink(shard, e);
+        lru_push(shard, e);
+        memcpy(rrs->buf, ENTRY_RRSET(e), e->rrlen);
+        rrs->len = e->rrlen;
+        result = (e->rrlen == 0) ? ISC_R_NOTFOUND : ISC_R_SUCCESS;
+    }
+    UNLOCK(&shard->lock);
+
+    return (result);
+}
+
+/*
+ * Look a key up as cache_get() does, but also find an answer that has
+ * expired and is only kept for stale=SECS.  The copy's TTLs are capped at
+ * "maxttl", so a stale answer is soon asked for again.
+ */
+static isc_result_t cache_stale(const char *key, unsigned int keylen, struct rrset *rrs,
+                                dns_ttl_t maxttl)
+{
+    isc_uint32_t hash = cache_hash(key, keylen);
+    struct cacheshard *shard = SHARD(hash);
+    struct cacheentry *e;
+    unsigned char *p, *end;
+    isc_uint32_t rdlen;
+    dns_ttl_t ttl;
+    isc_stdtime_t now;
+    isc_result_t result = ISC_R_NOMORE;
+
+    isc_stdtime_get(&now);
+
+    LOCK(&shard->lock);
+    if (shard->buckets != NULL)
+    {
+        e = cache_find_locked(shard, hash, key, keylen);
+        if (e != NULL && e->stale > now)
+        {
+            memcpy(rrs->buf, ENTRY_RRSET(e), e->rrlen);
+            rrs->len = e->rrlen;
+            result = (e->rrlen == 0) ? ISC_R_NOTFOUND : ISC_R_SUCCESS;
+        }
+    }
+    UNLOCK(&shard->lock);
+
+    for (p = rrs->buf, end = rrs->buf + rrs->len; result == ISC_R_SUCCESS && p < end; )
+    {
+        memcpy(&ttl, p, sizeof(ttl));
+        if (ttl > maxttl)
+            memcpy(p, &maxttl, sizeof(maxttl));
+        p += sizeof(ttl);
+        memcpy(&rdlen, p, sizeof(rdlen));
+        p += sizeof(rdlen);
+        p += strlen((char *) p) + 1;
+        p += (rdlen != RDLEN_NONE) ? rdlen : strlen((char *) p) + 1;
+    }
+    return (result);
+}
+
+static unsigned int cache_generation(void)
+{
+    unsigned int gen;
+
+    LOCK(&cache_genlock);
+    gen = cache_gen;
+    UNLOCK(&cache_genlock);
+    return (gen);
+}
+
+/*
+ * Store an answer for "ttl" seconds, and "stale" more for cache_stale(),
+ * replacing any previous one and evicting least recently used entries to
+ * stay within the shard's bound.  A NOTFOUND answer is an empty rrset.
+ * Nothing is stored if the cache generation is no longer "gen".
+ */
+static void cache_put(const char *key, unsigned int keylen, const struct rrset *rrs, dns_ttl_t ttl,
+                      unsigned int stale, unsigned int gen)
+{
+    isc_uint32_t hash = cache_hash(key, keylen);
+    struct cacheshard *shard = SHARD(hash);
+    struct cacheentry *e, *old;
+    unsigned int size;
+    isc_stdtime_t now;
+
+    if ((ttl == 0 && stale == 0) || rrs->overflow)
+        return;
+
+    size = sizeof(struct cacheentry) + keylen + rrs->len;
+    isc_stdtime_get(&now);
+
+    LOCK(&shard->lock);
+    if (shard->buckets == NULL || size > shard->maxsize ||
+        cache_generation() != gen)
+    {
+        UNLOCK(&shard->lock);
+        return;
+    }
+
+    old = cache_find_locked(shard, hash, key, keylen);
+    if (old != NULL)
+        cache_remove(shard, old);
+    while (shard->lru_tail != NULL && shard->size + size > shard->maxsize)
+        cache_remove(shard, shard->lru_tail);
+
+    e = isc_mem_get(ns_g_mctx, size);
+    if (e != NULL)
+    {
+        e->hash = hash;
+        e->expire = now + ttl;
+        e->stale = e->expire + stale;
+        e->size = size;
+        e->keylen = keylen;
+        e->rrlen = rrs->len;
+        memcpy(ENTRY_KEY(e), key, keylen);
+        memcpy(ENTRY_RRSET(e), rrs->buf, rrs->len);
+        e->next = shard->buckets[BUCKET(hash)];
+        shard->buckets[BUCKET(hash)] = e;
+        lru_push(shard, e);
+        shard->size += size;
+    }
+    UNLOCK(&shard->lock);
+}
+
+/*
+ * Grow the cache to at least "size" bytes in total.  The bound is the
+ * largest "cache=" asked for by any zone.
+ */
+static isc_result_t cache_setsize(size_t size)
+{
+    struct cacheshard *shard;
+    isc_result_t result = ISC_R_SUCCESS;
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        shard = &cache[i];
+        LOCK(&shard->lock);
+        if (shard->buckets == NULL)
+        {
+            shard->buckets = isc_mem_get(ns_g_mctx, CACHE_BUCKETS * sizeof(struct cacheentry *));
+            if (shard->buckets == NULL)
+                result = ISC_R_NOMEMORY;
+            else
+                memset(shard->buckets, 0, CACHE_BUCKETS * sizeof(struct cacheentry *));
+        }
+        if (shard->maxsize < size / CACHE_SHARDS)
+            shard->maxsize = size / CACHE_SHARDS;
+        UNLOCK(&shard->lock);
+    }
+    return (result);
+}
+
+/*
+ * Evict one key, cached or not, on behalf of the change feed, which has
+ * bumped the generation first.
+ */
+static void cache_evict(const char *key, unsigned int keylen)
+{
+    isc_uint32_t hash = cache_hash(key, keylen);
+    struct cacheshard *shard = SHARD(hash);
+    struct cacheentry *e;
+
+    LOCK(&shard->lock);
+    if (shard->buckets != NULL)
+    {
+        e = cache_find_locked(shard, hash, key, keylen);
+        if (e != NULL)
+            cache_remove(shard, e);
+    }
+    UNLOCK(&shard->lock);
+}
+
+/*
+ * Evict every key starting with "prefix", which takes a walk of the whole
+ * cache.
+ */
+static void cache_evict_prefix(const char *prefix, unsigned int len)
+{
+    struct cacheshard *shard;
+    struct cacheentry *e, *prev;
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        shard = &cache[i];
+        LOCK(&shard->lock);
+        for (e = shard->lru_tail; e != NULL; e = prev)
+        {
+            prev = e->lru_prev;
+            if (e->keylen >= len && memcmp(ENTRY_KEY(e), prefix, len) == 0)
+                cache_remove(shard, e);
+        }
+        UNLOCK(&shard->lock);
+    }
+}
+
+/*
+ * Whether "key" is that of a name below the one keyed by "anc", in the
+ * same zone.  An "anc" of only the zone's "tenant_id\0domain_id\0"
+ * covers the whole zone.
+ */
+static isc_boolean_t cache_key_below(const char *key, unsigned int keylen,
+                                     const char *anc, unsigned int anclen)
+{
+    unsigned int zonelen, namelen;
+
+    zonelen = strlen(anc) + 1;
+    zonelen += strlen(anc + zonelen) + 1;
+    if (keylen < zonelen || memcmp(key, anc, zonelen) != 0)
+        return (ISC_FALSE);
+    if (anclen == zonelen)
+        return (ISC_TRUE);
+    namelen = anclen - zonelen;         /* with its NUL */
+    return (ISC_TF(keylen > zonelen + namelen &&
+                   key[keylen - namelen - 1] == '.' &&
+                   memcmp(key + keylen - namelen, anc + zonelen, namelen) == 0));
+}
+
+/*
+ * Evict every key below any of "n" others, as cache_key_below() has it,
+ * in one walk of the whole cache.
+ */
+static void cache_evict_below(char (*keys)[KEY_LENGTH], const unsigned int *lens,
+                              unsigned int n)
+{
+    struct cacheshard *shard;
+    struct cacheentry *e, *prev;
+    unsigned int j;
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        shard = &cache[i];
+        LOCK(&shard->lock);
+        for (e = shard->lru_tail; e != NULL; e = prev)
+        {
+            prev = e->lru_prev;
+            for (j = 0; j < n; j++)
+            {
+                if (cache_key_below(ENTRY_KEY(e), e->keylen, keys[j], lens[j]))
+                {
+                    cache_remove(shard, e);
+                    break;
+                }
+            }
+        }
+        UNLOCK(&shard->lock);
+    }
+}
+
+static isc_result_t cache_init(void)
+{
+    isc_result_t result;
+    int i;
+
+    memset(cache, 0, sizeof(cache));
+    result = isc_mutex_init(&cache_genlock);
+    if (result != ISC_R_SUCCESS)
+        return (result);
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        result = isc_mutex_init(&cache[i].lock);
+        if (result != ISC_R_SUCCESS)
+        {
+            while (i-- > 0)
+                DESTROYLOCK(&cache[i].lock);
+            DESTROYLOCK(&cache_genlock);
+            return (result);
+        }
+    }
+    return (ISC_R_SUCCESS);
+}
+
+static void cache_destroy(void)
+{
+    struct cacheshard *shard;
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        shard = &cache[i];
+        while (shard->lru_tail != NULL)
+            cache_remove(shard, shard->lru_tail);
+        if (shard->buckets != NULL)
+            isc_mem_put(ns_g_mctx, shard->buckets, CACHE_BUCKETS * sizeof(struct cacheentry *));
+        shard->buckets = NULL;
+        DESTROYLOCK(&shard->lock);
+    }
+    DESTROYLOCK(&cache_genlock);
+}
+
+/*
+ * Lookups in flight.
+ *
+ * A lookup that has to go to the database first registers its cache key
+ * here.  Lookups for the same key that arrive while its query is running
+ * wait for it and replay its rows, so a popular name whose answer has
+ * just expired, or one with a TTL of 0, costs one query per round-trip
+ * however many lookups want it at once.  The flight is given back by the
+ * last of the leader and its waiters to let go of it, and kept on its
+ * shard's free list for the next, so a lookup allocates nothing.
+ */
+#define FLIGHT_SHARDS 16
+#define FLIGHT_BUCKETS 256
+
+struct flight
+{
+    struct flight *next;
+    isc_uint32_t hash;
+    unsigned int keylen;
+    unsigned int refs;
+    isc_boolean_t done;
+    isc_result_t result;
+    struct rrset rrs;           /* the leader's rows, once done */
+    char key[KEY_LENGTH];
+};
+
+struct flightshard
+{
+    isc_mutex_t lock;
+    isc_condition_t done;
+    struct flight *buckets[FLIGHT_BUCKETS];
+    struct flight *free;
+};
+
+static struct flightshard flights[FLIGHT_SHARDS];
+
+#define FLIGHT_SHARD(hash) (&flights[(hash) % FLIGHT_SHARDS])
+#define FLIGHT_BUCKET(hash) (((hash) / FLIGHT_SHARDS) % FLIGHT_BUCKETS)
+
+/*
+ * Join the flight for a key, or start one.  *leaderp is set if the caller
+ * started it and must run the query, collecting its rows in the flight's
+ * rrset, and then call flight_end().  NULL is returned if a new flight
+ * cannot be allocated, and the caller runs the query on its own.
+ */
+static struct flight *flight_join(const char *key, unsigned int keylen,
+                                  isc_boolean_t *leaderp)
+{
+    isc_uint32_t hash = cache_hash(key, keylen);
+    struct flightshard *shard = FLIGHT_SHARD(hash);
+    struct flight *f;
+
+    LOCK(&shard->lock);
+    for (f = shard->buckets[FLIGHT_BUCKET(hash)]; f != NULL; f = f->next)
+    {
+        if (f->hash == hash && f->keylen == keylen &&
+            memcmp(f->key, key, keylen) == 0)
+        {
+            f->refs++;
+            UNLOCK(&shard->lock);
+            *leaderp = ISC_FALSE;
+            return (f);
+        }
+    }
+
+    f = shard->free;
+    if (f != NULL)
+        shard->free = f->next;
+    else
+        f = isc_mem_get(ns_g_mctx, sizeof(*f));
+    if (f != NULL)
+    {
+        f->hash = hash;
+        f->keylen = keylen;
+        f->refs = 1;
+        f->done = ISC_FALSE;
+        f->result = ISC_R_UNEXPECTED;
+        rrset_init(&f->rrs);
+        memcpy(f->key, key, keylen);
+        f->next = shard->buckets[FLIGHT_BUCKET(hash)];
+        shard->buckets[FLIGHT_BUCKET(hash)] = f;
+    }
+    UNLOCK(&shard->lock);
+    *leaderp = ISC_TRUE;
+    return (f);
+}
+
+static void flight_release_locked(struct flight *f)
+{
+    struct flightshard *shard = FLIGHT_SHARD(f->hash);
+
+    if (--f->refs == 0)
+    {
+        f->next = shard->free;
+        shard->free = f;
+    }
+}
+
+/*
+ * Called by the leader with the result of its query.  The flight leaves
+ * the table, so later lookups start their own, and its waiters are woken.
+ */
+static void flight_end(struct flight *f, isc_result_t result)
+{
+    struct flightshard *shard = FLIGHT_SHARD(f->hash);
+    struct flight **fp;
+
+    LOCK(&shard->lock);
+    for (fp = &shard->buckets[FLIGHT_BUCKET(f->hash)]; *fp != f; fp = &(*fp)->next)
+        ;
+    *fp = f->next;
+    f->result = result;
+    f->done = ISC_TRUE;
+    BROADCAST(&shard->done);
+    flight_release_locked(f);
+    UNLOCK(&shard->lock);
+}
+
+/*
+ * Wait, until "deadline" if it is not NULL, for the leader to finish.
+ * The flight's result and rows may be read once this returns
+ * ISC_R_SUCCESS, and until flight_release().
+ */
+static isc_result_t flight_wait(struct flight *f, isc_time_t *deadline)
+{
+    struct flightshard *shard = FLIGHT_SHARD(f->hash);
+    isc_result_t result = ISC_R_SUCCESS;
+
+    LOCK(&shard->lock);
+    while (!f->done && result == ISC_R_SUCCESS)
+    {
+        if (deadline == NULL)
+            WAIT(&shard->done, &shard->lock);
+        else
+            result = isc_condition_waituntil(&shard->done, &shard->lock, deadline);
+    }
+    if (f->done)
+        result = ISC_R_SUCCESS;
+    UNLOCK(&shard->lock);
+    return (result);
+}
+
+static void flight_release(struct flight *f)
+{
+    struct flightshard *shard = FLIGHT_SHARD(f->hash);
+
+    LOCK(&shard->lock);
+    flight_release_locked(f);
+    UNLOCK(&shard->lock);
+}
+
+static isc_result_t flight_init(void)
+{
+    isc_result_t result;
+    int i;
+
+    memset(flights, 0, sizeof(flights));
+    for (i = 0; i < FLIGHT_SHARDS; i++)
+    {
+        result = isc_mutex_init(&flights[i].lock);
+        if (result == ISC_R_SUCCESS)
+        {
+            result = isc_condition_init(&flights[i].done);
+            if (result != ISC_R_SUCCESS)
+                DESTROYLOCK(&flights[i].lock);
+        }
+        if (result != ISC_R_SUCCESS)
+        {
+            while (i-- > 0)
+            {
+                (void)isc_condition_destroy(&flights[i].done);
+                DESTROYLOCK(&flights[i].lock);
+            }
+            return (result);
+        }
+    }
+    return (ISC_R_SUCCESS);
+}
+
+static void flight_destroy(void)
+{
+    struct flight *f;
+    int i;
+
+    for (i = 0; i < FLIGHT_SHARDS; i++)
+    {
+        while ((f = flights[i].free) != NULL)
+        {
+            flights[i].free = f->next;
+            isc_mem_put(ns_g_mctx, f, sizeof(*f));
+        }
+        (void)isc_condition_destroy(&flights[i].done);
+        DESTROYLOCK(&flights[i].lock);
+    }
+}
+
+/*
+ * Work out a negative caching TTL from an SOA record: the smaller of the
+ * record's TTL and the SOA minimum field.
+ */
+static isc_boolean_t soa_negttl(dns_ttl_t ttl, const char *data, dns_ttl_t *negttlp)
+{
+    const char *minimum;
+    unsigned long val;
+
+    minimum = data + strlen(data);
+    while (minimum > data && isspace((unsigned char) minimum[-1]))
+        minimum--;
+    while (minimum > data && !isspace((unsigned char) minimum[-1]))
+        minimum--;
+    if (!isdigit((unsigned char) *minimum))
+        return (ISC_FALSE);
+    val = strtoul(minimum, NULL, 10);
+    if (val < ttl)
+        ttl = (dns_ttl_t) val;
+    *negttlp = ttl;
+    return (ISC_TRUE);
+}
+
+/*
+ * Remember the zone's negative caching TTL from its apex SOA record.
+ */
+static void learn_negttl(struct dbinfo *dbi, dns_ttl_t ttl, const char *data)
+{
+    dns_ttl_t negttl;
+
+    if (!soa_negttl(ttl, data, &negttl))
+        return;
+
+    LOCK(&dbi->lock);
+    dbi->negttl = negttl;
+    UNLOCK(&dbi->lock);
+}
+
+static dns_ttl_t get_negttl(struct dbinfo *dbi)
+{
+    dns_ttl_t ttl;
+
+    LOCK(&dbi->lock);
+    ttl = dbi->negttl;
+    UNLOCK(&dbi->lock);
+    return (ttl);
+}
+
+/*
+ * Zone catalogue.
+ *
+ * A zone configured with zonetable=TABLE, and without a domain_id and
+ * tenant_id of its own, has them looked up by its name in TABLE.  The
+ * whole table is read with one query when the first such zone is created
+ * and is shared by every zone naming the same pool and table, so starting
+ * named with thousands of zones costs one query instead of thousands.  A
+ * zone missing from it (one added since it was read, say) rereads the
+ * table, at most once a second.
+ *
+ * Each time the table is read, every record at the apex of every zone in
+ * it is read too, in a second streamed query, and put in the answer
+ * cache if there is one.  The first queries for a zone, which are nearly
+ * all for its apex SOA and NS, are then answered from memory, and can be
+ * answered stale if the server goes away before anything refreshes them.
+ * Zones without an SOA record are reported up front.
+ */
+#define CATALOG_QUERY "SELECT name, tenant_id, domain_id FROM %s"
+#define PRELOAD_QUERY "SELECT d.tenant_id, d.domain_id, d.name, d.ttl, d.type, d.data " \
+                      "FROM %s d JOIN %s z ON d.tenant_id = z.tenant_id " \
+                      "AND d.domain_id = z.domain_id AND d.name = z.name " \
+                      "ORDER BY d.tenant_id, d.domain_id"
+#define PRELOAD_LNAME_QUERY "SELECT d.tenant_id, d.domain_id, d.lname, d.ttl, d.type, d.data " \
+                      "FROM %s d JOIN %s z ON d.tenant_id = z.tenant_id " \
+                      "AND d.domain_id = z.domain_id " \
+                      "AND d.lname = CONVERT(LOWER(z.name) USING ascii) COLLATE ascii_bin " \
+                      "ORDER BY d.tenant_id, d.domain_id"
+
+/*
+ * One zone's row, allocated in one piece: the entry is followed by the
+ * NUL-terminated name, tenant_id and domain_id.
+ */
+struct catentry
+{
+    unsigned int size;
+    isc_boolean_t hassoa;       /* seen by the last preload */
+    dns_ttl_t negttl;
+    const char *tenant_id;
+    const char *domain_id;
+};
+
+#define CATENTRY_NAME(e) ((const char *)((e) + 1))
+
+struct catalog
+{
+    struct dbpool *pool;
+    char *table;
+    char *records;              /* the table the zones' records are in */
+    unsigned int refs;
+    unsigned int stale;         /* the largest stale=SECS of its zones */
+    isc_stdtime_t loaded;
+    struct catentry **entries;  /* sorted by name */
+    unsigned int count;
+    unsigned int size;
+    struct catalog *next;
+};
+
+/* "catalogs" and everything in them are protected by "catalog_lock" */
+static struct catalog *catalogs = NULL;
+static isc_mutex_t catalog_lock;
+
+/*
+ * Compare zone names, ignoring case and a trailing dot.
+ */
+static int catalog_namecmp(const char *a, const char *b)
+{
+    size_t alen = strlen(a), blen = strlen(b);
+    size_t i;
+    int c;
+
+    if (alen > 0 && a[alen - 1] == '.')
+        alen--;
+    if (blen > 0 && b[blen - 1] == '.')
+        blen--;
+    for (i = 0; i < alen && i < blen; i++)
+    {
+        c = tolower((unsigned char)a[i]) - tolower((unsigned char)b[i]);
+        if (c != 0)
+            return (c);
+    }
+    return ((alen > i) - (blen > i));
+}
+
+static int catalog_sortcmp(const void *a, const void *b)
+{
+    const struct catentry *x = *(const struct catentry * const *)a;
+    const struct catentry *y = *(const struct catentry * const *)b;
+
+    return (catalog_namecmp(CATENTRY_NAME(x), CATENTRY_NAME(y)));
+}
+
+static void catalog_clear(struct catalog *cat)
+{
+    unsigned int i;
+
+    for (i = 0; i < cat->count; i++)
+        isc_mem_put(ns_g_mctx, cat->entries[i], cat->entries[i]->size);
+    if (cat->entries != NULL)
+        isc_mem_put(ns_g_mctx, cat->entries,
+                    cat->size * sizeof(struct catentry *));
+    cat->entries = NULL;
+    cat->count = 0;
+    cat->size = 0;
+}
+
+/*
+ * Add a row to the catalogue being read.
+ */
+static isc_result_t catalog_add(struct catalog *cat, const char *name,
+                                const char *tenant_id, const char *domain_id)
+{
+    struct catentry *e, **entries;
+    size_t namelen, tenantlen, domainlen;
+    unsigned int size;
+    char *p;
+
+    if (cat->count == cat->size)
+    {
+        size = cat->size == 0 ? 256 : cat->size * 2;
+        entries = isc_mem_get(ns_g_mctx, size * sizeof(struct catentry *));
+        if (entries == NULL)
+            return (ISC_R_NOMEMORY);
+        if (cat->entries != NULL)
+        {
+            memcpy(entries, cat->entries,
+                   cat->count * sizeof(struct catentry *));
+            isc_mem_put(ns_g_mctx, cat->entries,
+                        cat->size * sizeof(struct catentry *));
+        }
+        cat->entries = entries;
+        cat->size = size;
+    }
+
+    namelen = strlen(name) + 1;
+    tenantlen = strlen(tenant_id) + 1;
+    domainlen = strlen(domain_id) + 1;
+    size = sizeof(struct catentry) + namelen + tenantlen + domainlen;
+    e = isc_mem_get(ns_g_mctx, size);
+    if (e == NULL)
+        return (ISC_R_NOMEMORY);
+    e->size = size;
+    e->hassoa = ISC_FALSE;
+    e->negttl = 0;
+    p = (char *)(e + 1);
+    memcpy(p, name, namelen);
+    p += namelen;
+    memcpy(p, tenant_id, tenantlen);
+    e->tenant_id = p;
+    p += tenantlen;
+    memcpy(p, domain_id, domainlen);
+    e->domain_id = p;
+    cat->entries[cat->count++] = e;
+    return (ISC_R_SUCCESS);
+}
+
+static struct catentry *catalog_find(struct catalog *cat, const char *zone)
+{
+    unsigned int lo = 0, hi = cat->count, mid;
+    int c;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        c = catalog_namecmp(zone, CATENTRY_NAME(cat->entries[mid]));
+        if (c == 0)
+            return (cat->entries[mid]);
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return (NULL);
+}
+
+/*
+ * Read the records at every zone's apex into the answer cache, noting
+ * each zone's SOA.  The rows arrive grouped by zone, so each group is
+ * cached as soon as the next one starts.  A table with the lname column
+ * is joined on its key, since version 2 has no key on name.
+ */
+static void catalog_preload(struct catalog *cat, struct dbconn *dbc)
+{
+    MYSQL_STMT *stmt;
+    MYSQL_BIND results[6];
+    unsigned long lengths[6];
+    my_bool isnull[6];
+    char tenant_id[ID_LENGTH];
+    char domain_id[ID_LENGTH];
+    char name[DATA_LENGTH];
+    char type[TYPE_LENGTH];
+    char data[DATA_LENGTH];
+    dns_ttl_t ttl;
+    static const char *queries[] = { PRELOAD_LNAME_QUERY, PRELOAD_QUERY };
+    char *format;
+    size_t len;
+    char key[KEY_LENGTH], zonekey[KEY_LENGTH];
+    unsigned int keylen, zonekeylen = 0;
+    unsigned int zones = 0, records = 0, missing = 0, i;
+    struct catentry *e = NULL;
+    struct rrset rrs;
+    isc_time_t start, now;
+    unsigned int gen;
+    int status;
+
+    (void)isc_time_now(&start);
+    gen = cache_generation();
+
+    stmt = NULL;
+    for (i = 0; i < 2 && stmt == NULL; i++)
+    {
+        /* the format for db_prepare(), with the zone table filled in */
+        len = strlen(queries[i]) + strlen(cat->table) + 1;
+        format = isc_mem_get(ns_g_mctx, len);
+        if (format == NULL)
+            return;
+        snprintf(format, len, queries[i], "%s", cat->table);
+        stmt = db_prepare(dbc, format, cat->records, ISC_TF(i == 0), NULL);
+        isc_mem_put(ns_g_mctx, format, len);
+    }
+    if (stmt == NULL)
+        return;
+
+    memset(results, 0, sizeof(results));
+    results[0].buffer_type   = MYSQL_TYPE_STRING;
+    results[0].buffer        = tenant_id;
+    results[0].buffer_length = sizeof(tenant_id);
+    results[1].buffer_type   = MYSQL_TYPE_STRING;
+    results[1].buffer        = domain_id;
+    results[1].buffer_length = sizeof(domain_id);
+    results[2].buffer_type   = MYSQL_TYPE_STRING;
+    results[2].buffer        = name;
+    results[2].buffer_length = sizeof(name);
+    results[3].buffer_type   = MYSQL_TYPE_LONG;
+    results[3].buffer        = (char *) &ttl;
+    results[3].is_unsigned   = 1;
+    results[4].buffer_type   = MYSQL_TYPE_STRING;
+    results[4].buffer        = type;
+    results[4].buffer_length = sizeof(type);
+    results[5].buffer_type   = MYSQL_TYPE_STRING;
+    results[5].buffer        = data;
+    results[5].buffer_length = sizeof(data);
+    for (i = 0; i < 6; i++)
+    {
+        results[i].length  = &lengths[i];
+        results[i].is_null = &isnull[i];
+    }
+
+    if (mysql_stmt_execute(stmt) != 0 ||
+        mysql_stmt_bind_result(stmt, results) != 0)
+    {
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                      "ERROR: unable to preload zone apexes from %s: %s",
+                      cat->records, mysql_stmt_error(stmt));
+        mysql_stmt_close(stmt);
+        return;
+    }
+
+    rrset_init(&rrs);
+    while ((status = mysql_stmt_fetch(stmt)) == 0)
+    {
+        if (isnull[0] || isnull[1] || isnull[2] ||
+            isnull[3] || isnull[4] || isnull[5])
+            continue;
+        if (!cache_key(tenant_id, domain_id, name, key, &keylen))
+            continue;
+        if (keylen != zonekeylen || memcmp(key, zonekey, keylen) != 0)
+        {
+            if (zonekeylen > 0)
+                cache_put(zonekey, zonekeylen, &rrs, rrs.minttl, cat->stale, gen);
+            memcpy(zonekey, key, keylen);
+            zonekeylen = keylen;
+            rrset_init(&rrs);
+            e = catalog_find(cat, name);
+            zones++;
+        }
+        rrset_add(&rrs, ttl, type, data, NULL, 0);
+        if (e != NULL && strcasecmp(type, "SOA") == 0)
+            e->hassoa = soa_negttl(ttl, data, &e->negttl);
+        records++;
+    }
+    if (zonekeylen > 0)
+        cache_put(zonekey, zonekeylen, &rrs, rrs.minttl, cat->stale, gen);
+    if (status != MYSQL_NO_DATA)
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                      "ERROR: unable to preload zone apexes from %s: %s",
+                      cat->records, mysql_stmt_error(stmt));
+    mysql_stmt_close(stmt);
+
+    for (i = 0; i < cat->count; i++)
+    {
+        if (cat->entries[i]->hassoa)
+            continue;
+        missing++;
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_WARNING,
+                      "mysqldb: zone %s has no SOA record in %s",
+                      CATENTRY_NAME(cat->entries[i]), cat->records);
+    }
+
+    (void)isc_time_now(&now);
+    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                  NS_LOGMODULE_MAIN, ISC_LOG_INFO,
+                  "mysqldb: preloaded %u apex records of %u zones from %s "
+                  "in %u ms, %u zones without an SOA",
+                  records, zones, cat->records,
+                  (unsigned int)(isc_time_microdiff(&now, &start) / 1000),
+                  missing);
+}
+
+/*
+ * (Re)read the whole zone table, then preload the zones' apexes.  The
+ * rows are streamed rather than buffered, since the table may be large.
+ * They are read into a fresh array that replaces the catalogue only
+ * once the whole table has been read, so on failure it is left as it was.
+ * Only the first load that finds any zones preloads: a reread, made for
+ * a zone missing from the table, keeps what the zones it already had
+ * learned and leaves the new ones' apexes to be looked up, rather than
+ * reading every apex again under "catalog_lock".
+ */
+static isc_result_t catalog_load(struct catalog *cat)
+{
+    struct catalog fresh;
+    struct catentry *e;
+    struct dbconn *dbc;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND results[3];
+    unsigned long lengths[3];
+    my_bool isnull[3];
+    char name[DATA_LENGTH];
+    char tenant_id[ID_LENGTH];
+    char domain_id[ID_LENGTH];
+    isc_boolean_t reread = ISC_TF(cat->count > 0);
+    unsigned int i;
+    isc_result_t result;
+    int status;
+
+    memset(&fresh, 0, sizeof(fresh));
+
+    result = pool_lease(cat->pool, NULL, &dbc);
+    if (result != ISC_R_SUCCESS)
+        goto done;
+
+    stmt = db_prepare(dbc, CATALOG_QUERY, cat->table, ISC_FALSE, NULL);
+    if (stmt == NULL)
+    {
+        pool_return(dbc);
+        result = ISC_R_FAILURE;
+        goto done;
+    }
+
+    memset(results, 0, sizeof(results));
+    results[0].buffer_type   = MYSQL_TYPE_STRING;
+    results[0].buffer        = name;
+    results[0].buffer_length = sizeof(name);
+    results[0].length        = &lengths[0];
+    results[0].is_null       = &isnull[0];
+
+    results[1].buffer_type   = MYSQL_TYPE_STRING;
+    results[1].buffer        = tenant_id;
+    results[1].buffer_length = sizeof(tenant_id);
+    results[1].length        = &lengths[1];
+    results[1].is_null       = &isnull[1];
+
+    results[2].buffer_type   = MYSQL_TYPE_STRING;
+    results[2].buffer        = domain_id;
+    results[2].buffer_length = sizeof(domain_id);
+    results[2].length        = &lengths[2];
+    results[2].is_null       = &isnull[2];
+
+    result = ISC_R_FAILURE;
+    if (mysql_stmt_execute(stmt) != 0 ||
+        mysql_stmt_bind_result(stmt, results) != 0)
+    {
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                      "ERROR: unable to read zone table %s: %s",
+                      cat->table, mysql_stmt_error(stmt));
+        goto cleanup;
+    }
+
+    result = ISC_R_SUCCESS;
+    while ((status = mysql_stmt_fetch(stmt)) == 0)
+    {
+        if (isnull[0] || isnull[1] || isnull[2])
+            continue;
+        result = catalog_add(&fresh, name, tenant_id, domain_id);
+        if (result != ISC_R_SUCCESS)
+            break;
+    }
+    if (result == ISC_R_SUCCESS && status != MYSQL_NO_DATA)
+    {
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                      "ERROR: unable to read zone table %s: %s",
+                      cat->table, mysql_stmt_error(stmt));
+        result = ISC_R_FAILURE;
+    }
+
+cleanup:
+    mysql_stmt_close(stmt);
+    if (result != ISC_R_SUCCESS)
+    {
+        pool_return(dbc);
+        catalog_clear(&fresh);
+        goto done;
+    }
+
+    qsort(fresh.entries, fresh.count, sizeof(struct catentry *),
+          catalog_sortcmp);
+    for (i = 0; i < fresh.count; i++)
+    {
+        e = catalog_find(cat, CATENTRY_NAME(fresh.entries[i]));
+        if (e == NULL)
+            continue;
+        fresh.entries[i]->hassoa = e->hassoa;
+        fresh.entries[i]->negttl = e->negttl;
+    }
+    catalog_clear(cat);
+    cat->entries = fresh.entries;
+    cat->count = fresh.count;
+    cat->size = fresh.size;
+    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                  NS_LOGMODULE_MAIN, ISC_LOG_INFO,
+                  "mysqldb: read %u zones from %s", cat->count, cat->table);
+    if (!reread)
+        catalog_preload(cat, dbc);
+    pool_return(dbc);
+
+done:
+    isc_stdtime_get(&cat->loaded);
+    return (result);
+}
+
+/*
+ * Set a zone's domain_id and tenant_id from the catalogue of its zone
+ * table, reading the table if no zone has yet.
+ */
+static isc_result_t catalog_attach(struct dbinfo *dbi)
+{
+    struct catalog *cat;
+    struct catentry *e;
+    isc_stdtime_t now;
+    isc_result_t result;
+
+    LOCK(&catalog_lock);
+    for (cat = catalogs; cat != NULL; cat = cat->next)
+    {
+        if (cat->pool == dbi->pool && strcmp(cat->table, dbi->zonetable) == 0 &&
+            strcmp(cat->records, dbi->table) == 0)
+            break;
+    }
+
+    if (cat == NULL)
+    {
+        cat = isc_mem_get(ns_g_mctx, sizeof(struct catalog));
+        if (cat == NULL)
+        {
+            UNLOCK(&catalog_lock);
+            return (ISC_R_NOMEMORY);
+        }
+        memset(cat, 0, sizeof(struct catalog));
+        cat->table = isc_mem_strdup(ns_g_mctx, dbi->zonetable);
+        cat->records = isc_mem_strdup(ns_g_mctx, dbi->table);
+        if (cat->table == NULL || cat->records == NULL)
+        {
+            if (cat->table != NULL)
+                isc_mem_free(ns_g_mctx, cat->table);
+            if (cat->records != NULL)
+                isc_mem_free(ns_g_mctx, cat->records);
+            isc_mem_put(ns_g_mctx, cat, sizeof(struct catalog));
+            UNLOCK(&catalog_lock);
+            return (ISC_R_NOMEMORY);
+        }
+        cat->pool = dbi->pool;
+        cat->stale = dbi->stale;
+        cat->next = catalogs;
+        catalogs = cat;
+        (void)catalog_load(cat);
+    }
+    if (dbi->stale > cat->stale)
+        cat->stale = dbi->stale;
+    cat->refs++;
+    dbi->catalog = cat;
+
+    e = catalog_find(cat, dbi->zone);
+    isc_stdtime_get(&now);
+    if (e == NULL && now > cat->loaded)
+    {
+        (void)catalog_load(cat);
+        e = catalog_find(cat, dbi->zone);
+    }
+
+    result = ISC_R_NOTFOUND;
+    if (e != NULL)
+    {
+        dbi->negttl = e->negttl;
+        dbi->tenant_id = isc_mem_strdup(ns_g_mctx, e->tenant_id);
+        dbi->domain_id = isc_mem_strdup(ns_g_mctx, e->domain_id);
+        result = ISC_R_NOMEMORY;
+        if (dbi->tenant_id != NULL && dbi->domain_id != NULL)
+            result = ISC_R_SUCCESS;
+    }
+    else
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                      "ERROR: zone %s is not in the zone table %s",
+                      dbi->zone, dbi->zonetable);
+    UNLOCK(&catalog_lock);
+    return (result);
+}
+
+/*
+ * Drop a zone's reference to its catalogue, freeing it with the last.
+ */
+static void catalog_detach(struct dbinfo *dbi)
+{
+    struct catalog *cat = dbi->catalog;
+    struct catalog **prevp;
+
+    if (cat == NULL)
+        return;
+    dbi->catalog = NULL;
+
+    LOCK(&catalog_lock);
+    if (--cat->refs == 0)
+    {
+        for (prevp = &catalogs; *prevp != cat; prevp = &(*prevp)->next)
+            ;
+        *prevp = cat->next;
+        catalog_clear(cat);
+        isc_mem_free(ns_g_mctx, cat->table);
+        isc_mem_free(ns_g_mctx, cat->records);
+        isc_mem_put(ns_g_mctx, cat, sizeof(struct catalog));
+    }
+    UNLOCK(&catalog_lock);
+}
+
+/*
+ * Called for every row fetched by db_lookup() and db_allnodes(), with the
+ * name it belongs to.  "rdata" is the row's wire-format rdata, or NULL if
+ * only the text is usable.  Returning anything but ISC_R_SUCCESS stops
+ * the fetch.
+ */
+typedef isc_result_t (*rowfunc_t)(void *arg, const char *name, dns_ttl_t ttl,
+                                  const char *type, const char *data,
+                                  const unsigned char *rdata, unsigned int rdlen);
+
+/*
+ * The wire-format rdata fetched with a row, or NULL if there is none to
+ * use: the table has no rdata column, the value is NULL or did not fit
+ * the buffer, or the type is one BIND cannot name.
+ */
+static const unsigned char *row_rdata(const struct dbstmts *st, const char *type,
+                                      const unsigned char *rdata,
+                                      my_bool isnull, my_bool truncated)
+{
+    dns_rdatatype_t rdtype;
+
+    if (!st->hasrdata || isnull || truncated || !rdatatype(type, &rdtype))
+        return (NULL);
+    return (rdata);
+}
+
+/*
+ * Copy "len" bytes of a name, lowercasing ASCII letters as the lname
+ * column stores them.  The name queries compare without regard to case
+ * anyway, so every layout is bound lowercased names.
+ */
+static void lowercase(char *dst, const char *src, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        dst[i] = (src[i] >= 'A' && src[i] <= 'Z') ? src[i] - 'A' + 'a' : src[i];
+}
+
+/*
+ * The deadline for a lookup starting now, or NULL if the zone has no
+ * timeout.
+ */
+static isc_time_t *lookup_deadline(struct dbinfo *dbi, isc_time_t *deadline)
+{
+    isc_interval_t interval;
+
+    if (dbi->timeout == 0)
+        return (NULL);
+    isc_interval_set(&interval, dbi->timeout / 1000,
+                     (dbi->timeout % 1000) * 1000000);
+    if (isc_time_nowplusinterval(deadline, &interval) != ISC_R_SUCCESS)
+        return (NULL);
+    return (deadline);
+}
+
+/*
+ * Batched lookups.
+ *
+ * With batch=N, a lookup that has to go to the database joins an open
+ * batch of lookups bound for the same table on the same server, or opens
+ * one and waits up to batchwait=USEC microseconds for others to join.
+ * The batch is then sent as one query, once N lookups or BATCH_NAMES
+ * names have joined or the wait is over, whichever comes first.  Lookups
+ * of other zones in the table join too, as long as they would be sent to
+ * the same servers and give up at the same time.
+ *
+ * The batch and its lookups live on the stacks of the waiting threads.
+ * The thread that opened a batch runs it and hands each lookup's rows to
+ * its rowfunc_t while the lookup waits, then wakes it with its result.
+ */
+struct batchentry
+{
+    struct dbinfo *dbi;
+    const char **names;
+    unsigned int count;
+    rowfunc_t func;
+    void *arg;
+    isc_boolean_t done;
+    isc_result_t result;
+    struct batchentry *next;
+};
+
+struct batch
+{
+    struct dbinfo *dbi;         /* that of the lookup running it */
+    isc_boolean_t primary;
+    struct batchentry *entries;
+    struct batchentry **tail;
+    unsigned int nentries;
+    unsigned int nnames;
+    isc_boolean_t full;
+    struct batch *next;
+};
+
+/*
+ * Whether a lookup can be batched at all: its ids and names must fit the
+ * batch buffers.
+ */
+static isc_boolean_t batchable(struct dbinfo *dbi, const char **names, unsigned int count)
+{
+    unsigned int i;
+
+    if (dbi->tenant_id == NULL || dbi->domain_id == NULL ||
+        strlen(dbi->tenant_id) >= ID_LENGTH || strlen(dbi->domain_id) >= ID_LENGTH)
+        return (ISC_FALSE);
+    for (i = 0; i < count; i++)
+    {
+        if (strlen(names[i]) >= DATA_LENGTH + 3)
+            return (ISC_FALSE);
+    }
+    return (ISC_TRUE);
+}
+
+/*
+ * Whether a lookup of "count" names in "dbi" may join batch "b": the
+ * query would go to the same table on the same servers, with the same
+ * timeout, and there is room for it.
+ */
+static isc_boolean_t batch_fits(struct batch *b, struct dbinfo *dbi,
+                                isc_boolean_t primary, unsigned int count)
+{
+    struct dbinfo *first = b->dbi;
+    unsigned int i;
+
+    if (b->full || b->primary != primary || first->timeout != dbi->timeout ||
+        b->nentries >= first->batch || b->nnames + count > BATCH_NAMES ||
+        strcmp(first->table, dbi->table) != 0)
+        return (ISC_FALSE);
+    if (!primary)
+    {
+        if (first->nreplicas != dbi->nreplicas ||
+            first->leastlatency != dbi->leastlatency)
+            return (ISC_FALSE);
+        for (i = 0; i < dbi->nreplicas; i++)
+        {
+            if (first->replicas[i].pool != dbi->replicas[i].pool ||
+                first->replicas[i].weight != dbi->replicas[i].weight)
+                return (ISC_FALSE);
+        }
+    }
+    return (ISC_TRUE);
+}
+
+/*
+ * Add a lookup to a batch.  The pool's lock must be held.
+ */
+static void batch_add(struct batch *b, struct batchentry *e)
+{
+    e->next = NULL;
+    *b->tail = e;
+    b->tail = &e->next;
+    b->nentries++;
+    b->nnames += e->count;
+    if (b->nentries >= b->dbi->batch || b->nnames >= BATCH_NAMES)
+        b->full = ISC_TRUE;
+}
+
+/*
+ * Point a connection's batch bindings at its batch buffers, allocating
+ * them the first time.
+ */
+static isc_result_t batch_buffers(struct dbconn *dbc)
+{
+    struct dbbatchbuf *buf;
+    MYSQL_BIND *b;
+    unsigned int i;
+
+    if (dbc->batchbuf != NULL)
+        return (ISC_R_SUCCESS);
+    buf = isc_mem_get(ns_g_mctx, sizeof(struct dbbatchbuf));
+    if (buf == NULL)
+        return (ISC_R_NOMEMORY);
+    memset(buf, 0, sizeof(struct dbbatchbuf));
+
+    for (i = 0; i < 3 * BATCH_NAMES; i++)
+    {
+        b = &buf->params[i];
+        b->buffer_type = MYSQL_TYPE_STRING;
+        if (i % 3 < 2)
+        {
+            b->buffer = buf->ids[i / 3][i % 3];
+            b->buffer_length = ID_LENGTH;
+        }
+        else
+        {
+            b->buffer = buf->names[i / 3];
+            b->buffer_length = DATA_LENGTH + 3;
+        }
+        b->length = &buf->param_lengths[i];
+    }
+
+    b = buf->results;
+    b[0].buffer_type    = MYSQL_TYPE_LONG;
+    b[0].buffer         = (char *) &buf->ttl;
+    b[0].is_unsigned    = 1;
+    b[0].length         = &buf->result_lengths[0];
+
+    b[1].buffer_type    = MYSQL_TYPE_STRING;
+    b[1].buffer         = buf->type;
+    b[1].buffer_length  = TYPE_LENGTH;
+    b[1].length         = &buf->result_lengths[1];
+
+    b[2].buffer_type    = MYSQL_TYPE_STRING;
+    b[2].buffer         = buf->data;
+    b[2].buffer_length  = DATA_LENGTH;
+    b[2].length         = &buf->result_lengths[2];
+
+    b[3].buffer_type    = MYSQL_TYPE_STRING;
+    b[3].buffer         = buf->rowname;
+    b[3].buffer_length  = DATA_LENGTH;
+    b[3].length         = &buf->result_lengths[3];
+
+    b[4].buffer_type    = MYSQL_TYPE_STRING;
+    b[4].buffer         = buf->tenant_id;
+    b[4].buffer_length  = ID_LENGTH;
+    b[4].length         = &buf->result_lengths[4];
+
+    b[5].buffer_type    = MYSQL_TYPE_STRING;
+    b[5].buffer         = buf->domain_id;
+    b[5].buffer_length  = ID_LENGTH;
+    b[5].length         = &buf->result_lengths[5];
+
+    /* only bound when the statement selects rdata */
+    b[6].buffer_type    = MYSQL_TYPE_BLOB;
+    b[6].buffer         = buf->rdata;
+    b[6].buffer_length  = RDATA_LENGTH;
+    b[6].is_null        = &buf->rdnull;
+    b[6].error          = &buf->rdtruncated;
+    b[6].length         = &buf->result_lengths[6];
+
+    dbc->batchbuf = buf;
+    return (ISC_R_SUCCESS);
+}
+
+/*
+ * The connection's batch statement for the zone's table, prepared and
+ * bound on first use.  Fails as db_statements() does.
+ */
+static isc_result_t batch_statement(struct dbconn *dbc, struct dbinfo *dbi,
+                                    MYSQL_STMT **stmtp, struct dbstmts **stp)
+{
+    struct dbstmts *st;
+    isc_result_t result;
+    unsigned int err;
+
+    result = db_statements(dbc, dbi->table, &st);
+    if (result != ISC_R_SUCCESS)
+        return (result);
+    if (st->batch == NULL)
+    {
+        st->batch = db_prepare(dbc, st->layout->batch, dbi->table, ISC_FALSE, &err);
+        if (st->batch == NULL)
+            return (connection_lost(err) ? ISC_R_CONNECTIONRESET : ISC_R_FAILURE);
+        if (mysql_stmt_bind_param(st->batch, dbc->batchbuf->params) != 0 ||
+            mysql_stmt_bind_result(st->batch, dbc->batchbuf->results) != 0)
+        {
+            isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                          NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                          "ERROR: Unable to bind the batch statement's buffers");
+            mysql_stmt_close(st->batch);
+            st->batch = NULL;
+            return (ISC_R_FAILURE);
+        }
+    }
+    *stmtp = st->batch;
+    *stp = st;
+    return (ISC_R_SUCCESS);
+}
+
+/*
+ * Hand each lookup of a batch the rows of its names, grouped by name in
+ * the order of its names as db_lookup() does, and set its result.  A row
+ * that fails to fetch fails every lookup not yet answered, rather than
+ * cutting its names' rows short and having them cached as NOTFOUND.
+ */
+static void batch_deliver(struct batch *b, struct dbconn *dbc, struct dbstmts *st,
+                          MYSQL_STMT *stmt)
+{
+    struct dbbatchbuf *buf = dbc->batchbuf;
+    struct batchentry *e;
+    isc_result_t result;
+    unsigned int i;
+    int status;
+
+    for (e = b->entries; e != NULL; e = e->next)
+    {
+        e->result = ISC_R_NOTFOUND;
+        for (i = 0; i < e->count; i++)
+        {
+            mysql_stmt_data_seek(stmt, 0);
+            while ((status = mysql_stmt_fetch(stmt)) == 0 ||
+                   (status == MYSQL_DATA_TRUNCATED && buf->rdtruncated))
+            {
+                if (strcasecmp(buf->tenant_id, e->dbi->tenant_id) != 0 ||
+                    strcasecmp(buf->domain_id, e->dbi->domain_id) != 0 ||
+                    catalog_namecmp(buf->rowname, e->names[i]) != 0)
+                    continue;
+                stats_increment(e->dbi, STAT_ROWS);
+                result = e->func(e->arg, e->names[i], buf->ttl, buf->type, buf->data,
+                                 row_rdata(st, buf->type, buf->rdata, buf->rdnull,
+                                           buf->rdtruncated),
+                                 buf->result_lengths[6]);
+                if (result != ISC_R_SUCCESS)
+                {
+                    e->result = result;
+                    break;
+                }
+                e->result = ISC_R_SUCCESS;
+            }
+            if (e->result != ISC_R_SUCCESS && e->result != ISC_R_NOTFOUND)
+                break;
+            if (status != MYSQL_NO_DATA)
+            {
+                isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                              "ERROR: Unable to fetch a batch's rows: %s",
+                              (status == MYSQL_DATA_TRUNCATED) ? "data truncated" :
+                              mysql_stmt_error(stmt));
+                for (; e != NULL; e = e->next)
+                    e->result = ISC_R_FAILURE;
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Send a closed batch as one query, giving up at "deadline" if there is
+ * one, and hand out the rows.  Each lookup's result is set, that of every
+ * lookup to the query's if it fails.
+ */
+static void batch_run(struct batch *b, isc_time_t *deadlinep)
+{
+    struct dbinfo *dbi = b->dbi;
+    struct dbbatchbuf *buf;
+    struct batchentry *e;
+    struct dbconn *dbc;
+    struct dbstmts *st;
+    MYSQL_STMT *stmt = NULL;
+    isc_boolean_t retried;
+    isc_time_t begin, start;
+    isc_result_t result;
+    unsigned int i, n;
+    size_t len;
+
+    result = db_lease(dbi, b->primary, deadlinep, &dbc);
+    if (result == ISC_R_CONNREFUSED)
+        goto failed;
+    if (result != ISC_R_SUCCESS)
+    {
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                      "ERROR: unable to lease a connection for a batch of %u lookups",
+                      b->nentries);
+        goto failed;
+    }
+    result = batch_buffers(dbc);
+    if (result != ISC_R_SUCCESS)
+    {
+        pool_return(dbc);
+        goto failed;
+    }
+
+    /* every slot of the IN list is filled; those past the last name repeat the first */
+    buf = dbc->batchbuf;
+    n = 0;
+    for (e = b->entries; e != NULL; e = e->next)
+    {
+        for (i = 0; i < e->count; i++, n++)
+        {
+            len = strlen(e->dbi->tenant_id);
+            memcpy(buf->ids[n][0], e->dbi->tenant_id, len);
+            buf->param_lengths[3 * n] = len;
+            len = strlen(e->dbi->domain_id);
+            memcpy(buf->ids[n][1], e->dbi->domain_id, len);
+            buf->param_lengths[3 * n + 1] = len;
+            len = strlen(e->names[i]);
+            lowercase(buf->names[n], e->names[i], len);
+            buf->param_lengths[3 * n + 2] = len;
+        }
+    }
+    for (; n < BATCH_NAMES; n++)
+    {
+        memcpy(buf->ids[n], buf->ids[0], sizeof(buf->ids[0]));
+        memcpy(buf->names[n], buf->names[0], buf->param_lengths[2]);
+        memcpy(&buf->param_lengths[3 * n], &buf->param_lengths[0],
+               3 * sizeof(buf->param_lengths[0]));
+    }
+    buf->rdnull = buf->rdtruncated = 0;
+
+    (void)isc_time_now(&begin);
+    retried = ISC_FALSE;
+retry:
+    result = batch_statement(dbc, dbi, &stmt, &st);
+    if (result != ISC_R_SUCCESS)
+    {
+        stmt = NULL;
+        if (!retried && result == ISC_R_CONNECTIONRESET)
+        {
+            retried = ISC_TRUE;
+            if (db_reconnect(dbc) == ISC_R_SUCCESS)
+                goto retry;
+        }
+        goto cleanup;
+    }
+
+    result = ISC_R_FAILURE;
+    (void)isc_time_now(&start);
+    if (db_execute(dbc, stmt, deadlinep) != 0)
+    {
+        if (dbc->timedout)
+            goto timedout;
+        if (!retried && connection_lost(mysql_stmt_errno(stmt)))
+        {
+            retried = ISC_TRUE;
+            stmt = NULL;
+            if (db_reconnect(dbc) == ISC_R_SUCCESS)
+                goto retry;
+            goto cleanup;
+        }
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                      "ERROR: Unable to execute statement!");
+        goto cleanup;
+    }
+    stats_time(dbi, TIMER_EXECUTE, &start);
+
+    (void)isc_time_now(&start);
+    if (db_store_result(dbc, stmt, deadlinep) != 0)
+    {
+        if (dbc->timedout)
+            goto timedout;
+        if (!retried && connection_lost(mysql_stmt_errno(stmt)))
+        {
+            retried = ISC_TRUE;
+            stmt = NULL;
+            if (db_reconnect(dbc) == ISC_R_SUCCESS)
+                goto retry;
+        }
+        goto cleanup;
+    }
+    stats_time(dbi, TIMER_FETCH, &start);
+    pool_latency(dbc->pool, &begin, ISC_FALSE);
+
+    batch_deliver(b, dbc, st, stmt);
+    mysql_stmt_free_result(stmt);
+    pool_return(dbc);
+    return;
+
+timedout:
+    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                  NS_LOGMODULE_MAIN, ISC_LOG_ERROR,
+                  "ERROR: batch of %u lookups timed out after %u ms",
+                  b->nentries, dbi->timeout);
+    pool_latency(dbc->pool, &begin, ISC_TRUE);
+    result = ISC_R_TIMEDOUT;
+
+cleanup:
+    if (stmt != NULL)
+        mysql_stmt_free_result(stmt);
+    pool_return(dbc);
+
+failed:
+    for (e = b->entries; e != NULL; e = e->next)
+        e->result = result;
+}
+
+/*
+ * Look names up as part of a batch; see "Batched lookups" above.
+ * ISC_R_NOMORE is returned, having looked nothing up, if no other lookup
+ * joined the batch the caller opened, which it then runs on its own.
+ */
+static isc_result_t batch_lookup(struct dbinfo *dbi, isc_boolean_t primary,
+                                 const char **names, unsigned int count,
+                                 rowfunc_t func, void *arg)
+{
+    struct dbpool *pool = dbi->pool;
+    struct batchentry entry, *e;
+    struct batch batch, *b, **bp;
+    isc_interval_t interval;
+    isc_time_t until, deadline, *deadlinep;
+
+    entry.dbi = dbi;
+    entry.names = names;
+    entry.count = count;
+    entry.func = func;
+    entry.arg = arg;
+    entry.done = ISC_FALSE;
+    entry.result = ISC_R_UNEXPECTED;
+
+    LOCK(&pool->lock);
+    for (b = pool->batches; b != NULL; b = b->next)
+    {
+        if (batch_fits(b, dbi, primary, count))
+            break;
+    }
+    if (b != NULL)
+    {
+        batch_add(b, &entry);
+        if (b->full)
+            BROADCAST(&pool->batched);
+        while (!entry.done)
+            WAIT(&pool->batched, &pool->lock);
+        UNLOCK(&pool->lock);
+        stats_increment(dbi, STAT_BATCHED);
+        return (entry.result);
+    }
+
+    deadlinep = lookup_deadline(dbi, &deadline);
+    batch.dbi = dbi;
+    batch.primary = primary;
+    batch.entries = NULL;
+    batch.tail = &batch.entries;
+    batch.nentries = 0;
+    batch.nnames = 0;
+    batch.full = ISC_FALSE;
+    batch_add(&batch, &entry);
+    batch.next = pool->batches;
+    pool->batches = &batch;
+
+    isc_interval_set(&interval, dbi->batchwait / 1000000,
+                     (dbi->batchwait % 1000000) * 1000);
+    if (isc_time_nowplusinterval(&until, &interval) == ISC_R_SUCCESS)
+    {
+        while (!batch.full &&
+               isc_condition_waituntil(&pool->batched, &pool->lock, &until) != ISC_R_TIMEDOUT)
+            ;
+    }
+    for (bp = &pool->batches; *bp != &batch; bp = &(*bp)->next)
+        ;
+    *bp = batch.next;
+    UNLOCK(&pool->lock);
+
+    if (batch.nentries == 1)
+        return (ISC_R_NOMORE);
+
+    batch_run(&batch, deadlinep);
+
+    LOCK(&pool->lock);
+    for (e = batch.entries; e != NULL; e = e->next)
+        e->done = ISC_TRUE;
+    BROADCAST(&pool->batched);
+    UNLOCK(&pool->lock);
+    return (entry.result);
+}
+
+/*
+ * Fetch the records of one or more names in the zone in a single query,
+ * from the zone's own host if "primary" is set and otherwise from a
+ * replica if it has any.  Rows are passed to "func" grouped by name, in
+ * the order of "names", each with the name it belongs to.  The result is
+ * ISC_R_NOTFOUND if none of the names has any.
+ *
+ * The ids and names are copied into the leased connection's buffers,
+ * which its statements are already bound to, so nothing is allocated.
+ * The names are lowercased on the way.
+ *
+ * Queries are converted into SQL queries and issued synchronously.  Errors
+ * are handled really badly.
+ */
+static isc_result_t db_lookup(struct dbinfo *dbi, isc_boolean_t primary,
+                              const char **names, unsigned int count,
+                              rowfunc_t func, void *arg)
+{
+    const char *name = names[0];
+    struct dbbuf *buf;
+    int result_count = 0;
+    int status;
+    unsigned int i;
+    size_t len;
+
+    MYSQL_STMT *stmt = NULL;
+
+    isc_boolean_t retried;
+    isc_time_t begin, start, deadline, *deadlinep;
+    isc_result_t result;
+
+    struct dbconn *dbc;
+    struct dbstmts *st;
+
+    REQUIRE(count >= 1 && count <= CLOSEST_NAMES);
+
+    if (dbi->batch > 1 && batchable(dbi, names, count))
+    {
+        result = batch_lookup(dbi, primary, names, count, func, arg);
+        if (result != ISC_R_NOMORE)
+            return (result);
+    }
+
+    deadlinep = lookup_deadline(dbi, &deadline);
+
+#ifdef MYSQLDB_DEBUG
+	isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "Arguments: tenant_id: %s domain_id: %s name: %s names: %u",
+                  dbi->tenant_id,
+                  dbi->domain_id,
+                  name,
+                  count);
+#endif
+
+    result = db_lease(dbi, primary, deadlinep, &dbc);
+    if (result == ISC_R_TIMEDOUT)
+    {
+	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+			      NS_LOGMODULE_MAIN, ISC_LOG_ERROR,
+			      "ERROR: lookup of %s timed out after %u ms waiting for a connection",
+                  name, dbi->timeout);
+        return (result);
+    }
+    if (result == ISC_R_CONNREFUSED)
+        return (result);        /* marked down; logged when it was */
+    if (result != ISC_R_SUCCESS)
+    {
+	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "ERROR: unable to lease a connection to the mysql://%s:<password>@%s/%s",
+                  dbi->user,
+                  dbi->host,
+                  dbi->database);
+        return (result);
+    }
+
+#ifdef MYSQLDB_DEBUG
+	isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "connected to the mysql://%s:<password>@%s/%s",
+                  dbi->user,
+                  dbi->host,
+                  dbi->database);
+#endif
+
+    /* every slot of the IN list is filled; those past "count" repeat the first name */
+    buf = &dbc->buf;
+    result = ISC_R_NOSPACE;
+    for (i = 0; i < (count > 1 ? 2 + CLOSEST_NAMES : 3); i++)
+    {
+        const char *value;
+
+        if (i == 0)
+            value = dbi->tenant_id;
+        else if (i == 1)
+            value = dbi->domain_id;
+        else
+            value = names[i - 2 < count ? i - 2 : 0];
+        len = strlen(value);
+        if (len >= buf->params[i].buffer_length)
+            goto cleanup;
+        if (i < 2)
+            memcpy(buf->params[i].buffer, value, len);
+        else
+            lowercase(buf->params[i].buffer, value, len);
+        buf->param_lengths[i] = len;
+    }
+    buf->rdnull = buf->rdtruncated = 0;
+
+    (void)isc_time_now(&begin);
+    retried = ISC_FALSE;
+retry:
+    result = db_statements(dbc, dbi->table, &st);
+    if (result != ISC_R_SUCCESS)
+    {
+        if (!retried && result == ISC_R_CONNECTIONRESET)
+        {
+            retried = ISC_TRUE;
+            if (db_reconnect(dbc) == ISC_R_SUCCESS)
+                goto retry;
+        }
+        goto cleanup;
+    }
+
+    result = ISC_R_FAILURE;
+    stmt = (count > 1) ? st->closest : st->lookup;
+    (void)isc_time_now(&start);
+    if (db_execute(dbc, stmt, deadlinep) != 0)
+    {
+        if (dbc->timedout)
+            goto timedout;
+        if (!retried && connection_lost(mysql_stmt_errno(stmt)))
+        {
+            retried = ISC_TRUE;
+            stmt = NULL;
+            if (db_reconnect(dbc) == ISC_R_SUCCESS)
+                goto retry;
+            goto cleanup;
+        }
+	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "ERROR: Unable to execute statement!");
+        goto cleanup;
+    }
+    stats_time(dbi, TIMER_EXECUTE, &start);
+
+    (void)isc_time_now(&start);
+    if (db_store_result(dbc, stmt, deadlinep) != 0)
+    {
+        if (dbc->timedout)
+            goto timedout;
+        if (!retried && connection_lost(mysql_stmt_errno(stmt)))
+        {
+            retried = ISC_TRUE;
+            stmt = NULL;
+            if (db_reconnect(dbc) == ISC_R_SUCCESS)
+                goto retry;
+        }
+        goto cleanup;
+    }
+    stats_time(dbi, TIMER_FETCH, &start);
+    pool_latency(dbc->pool, &begin, ISC_FALSE);
+    result_count = mysql_stmt_num_rows(stmt); 
+    if (result_count == 0)
+    {
+#ifdef MYSQLDB_DEBUG
+	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "no result(s)");
+#endif
+        result = ISC_R_NOTFOUND;
+        goto cleanup;
+    }
+
+    /*
+     * The result is buffered, so it is read once per name to hand the
+     * rows over grouped.  An rdata value too long for the buffer just
+     * falls back to the text; any other row that fails to fetch fails
+     * the lookup, since a pass cut short would have the name answered
+     * from a wildcard, or denied, and cached that way.
+     */
+    result = ISC_R_SUCCESS;
+    for (i = 0; i < count && result == ISC_R_SUCCESS; i++)
+    {
+        if (count > 1)
+            mysql_stmt_data_seek(stmt, 0);
+        while ((status = mysql_stmt_fetch(stmt)) == 0 ||
+               (status == MYSQL_DATA_TRUNCATED && buf->rdtruncated))
+        {
+            if (count > 1 && catalog_namecmp(buf->rowname, names[i]) != 0)
+                continue;
+            stats_increment(dbi, STAT_ROWS);
+            result = func(arg, names[i], buf->ttl, buf->type, buf->data,
+                          row_rdata(st, buf->type, buf->rdata, buf->rdnull,
+                                    buf->rdtruncated),
+                          buf->result_lengths[4]);
+            if (result != ISC_R_SUCCESS)
+                break;
+        }
+        if (result == ISC_R_SUCCESS && status != MYSQL_NO_DATA)
+        {
+            isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                          NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                          "ERROR: Unable to fetch the rows of %s: %s", names[i],
+                          (status == MYSQL_DATA_TRUNCATED) ? "data truncated" :
+                          mysql_stmt_error(stmt));
+            result = ISC_R_FAILURE;
+        }
+    }
+    goto cleanup;
+
+timedout:
+    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                  NS_LOGMODULE_MAIN, ISC_LOG_ERROR,
+                  "ERROR: lookup of %s timed out after %u ms",
+                  name, dbi->timeout);
+    pool_latency(dbc->pool, &begin, ISC_TRUE);
+    result = ISC_R_TIMEDOUT;
+
+cleanup:
+    if (stmt != NULL)
+        mysql_stmt_free_result(stmt);
+    pool_return(dbc);
+    return (result);
+}
+
+/*
+ * Issue an SQL query to return all nodes in the database, in name order,
+ * or in DNS canonical order when the table has the rname column.  The
+ * server is chosen as for db_lookup().  With pagesize=N the zone is read
+ * N rows per query, each page starting after the (name, id) or (rname,
+ * id) of the last row of the one before, so no query runs for longer
+ * than a page takes and a connection lost between pages only costs the
+ * page.
+ */
+static isc_result_t db_allnodes(struct dbinfo *dbi, isc_boolean_t primary,
+                                rowfunc_t func, void *arg)
+{
+    isc_result_t result;
+    MYSQL_STMT *stmt = NULL;
+    MYSQL_BIND params[6], results[7];
+    struct dbconn *dbc;
+    struct dbstmts *st;
+    char name[DATA_LENGTH];
+    char type[TYPE_LENGTH];
+    char data[DATA_LENGTH];
+    char key[DATA_LENGTH];
+    char lastkey[DATA_LENGTH];
+    unsigned char rdata[RDATA_LENGTH];
+    my_bool rdnull, rdtruncated;
+    unsigned long param_lengths[4], result_lengths[7];
+    dns_ttl_t ttl;
+    unsigned int id, lastid, pagesize, err;
+    int result_count = 0, page_count = 0;
+    int status = 0;
+    unsigned long cursor, prefetch;
+    isc_boolean_t paged, retried;
+    isc_time_t start;
+
+    memset(params, 0, sizeof (params)); /* zero the structures */
+    memset(results, 0, sizeof (results)); /* zero the structures */
+
+#ifdef MYSQLDB_DEBUG
+	isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "Arguments: tenant_id: %s domain_id: %s",
+                  dbi->tenant_id,
+                  dbi->domain_id);
+#endif
+
+    paged = ISC_TF(dbi->pagesize > 0);
+    pagesize = dbi->pagesize;
+    lastkey[0] = '\0';
+    lastid = 0;
+
+    param_lengths[0] = strlen(dbi->tenant_id);
+    param_lengths[1] = strlen(dbi->domain_id);
+    param_lengths[2] = param_lengths[3] = 0;
+
+    /* parameter buffer structs */
+    params[0].buffer_type    = MYSQL_TYPE_STRING;
+    params[0].buffer         = dbi->tenant_id;
+    params[0].buffer_length  = param_lengths[0]; 
+    params[0].is_null        = 0;
+    params[0].length         = &param_lengths[0]; 
+
+    params[1].buffer_type    = MYSQL_TYPE_STRING;
+    params[1].buffer         = dbi->domain_id;
+    params[1].buffer_length  = param_lengths[1]; 
+    params[1].is_null        = 0;
+    params[1].length         = &param_lengths[1]; 
+
+    /* the rest are only bound when paging */
+    params[2].buffer_type    = MYSQL_TYPE_STRING;
+    params[2].buffer         = lastkey;
+    params[2].buffer_length  = DATA_LENGTH; 
+    params[2].is_null        = 0;
+    params[2].length         = &param_lengths[2]; 
+
+    params[3].buffer_type    = MYSQL_TYPE_STRING;
+    params[3].buffer         = lastkey;
+    params[3].buffer_length  = DATA_LENGTH; 
+    params[3].is_null        = 0;
+    params[3].length         = &param_lengths[3]; 
+
+    params[4].buffer_type    = MYSQL_TYPE_LONG;
+    params[4].buffer         = (char *) &lastid;
+    params[4].is_unsigned    = 1;
+    params[4].is_null        = 0;
+
+    params[5].buffer_type    = MYSQL_TYPE_LONG;
+    params[5].buffer         = (char *) &pagesize;
+    params[5].is_unsigned    = 1;
+    params[5].is_null        = 0;
+
+    /*
+     * result buffer structs; the paged query selects the id and the
+     * ordering key first, so the one-shot query is bound from results[2]
+     */
+    results[0].buffer_type    = MYSQL_TYPE_LONG;
+    results[0].buffer         = (char *) &id; 
+    results[0].is_unsigned    = 1;
+    results[0].is_null        = 0;
+    results[0].length         = &result_lengths[0]; 
+
+    results[1].buffer_type    = MYSQL_TYPE_STRING;
+    results[1].buffer         = (char *) key; 
+    results[1].buffer_length  = DATA_LENGTH; 
+    results[1].is_null        = 0;
+    results[1].length         = &result_lengths[1]; 
+
+    results[2].buffer_type    = MYSQL_TYPE_LONG;
+    results[2].buffer         = (char *) &ttl; 
+    results[2].is_unsigned    = 1;
+    results[2].is_null        = 0;
+    results[2].length         = &result_lengths[2]; 
+
+    results[3].buffer_type    = MYSQL_TYPE_STRING;
+    results[3].buffer         = (char *) name; 
+    results[3].buffer_length  = DATA_LENGTH; 
+    results[3].is_null        = 0;
+    results[3].length         = &result_lengths[3]; 
+
+    results[4].buffer_type    = MYSQL_TYPE_STRING;
+    results[4].buffer         = (char *) type; 
+    results[4].buffer_length  = TYPE_LENGTH; 
+    results[4].is_null        = 0;
+    results[4].length         = &result_lengths[4]; 
+
+    results[5].buffer_type    = MYSQL_TYPE_STRING;
+    results[5].buffer         = (char *) data; 
+    results[5].buffer_length  = DATA_LENGTH; 
+    results[5].is_null        = 0;
+    results[5].length         = &result_lengths[5]; 
+
+    /* only bound when the statement selects rdata */
+    results[6].buffer_type    = MYSQL_TYPE_BLOB;
+    results[6].buffer         = (char *) rdata; 
+    results[6].buffer_length  = RDATA_LENGTH; 
+    results[6].is_null        = &rdnull;
+    results[6].error          = &rdtruncated;
+    results[6].length         = &result_lengths[6]; 
+    rdnull = rdtruncated = 0;
+
+    result = db_lease(dbi, primary, NULL, &dbc);
+    if (result != ISC_R_SUCCESS)
+    {
+	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "ERROR: unable to lease a connection to the mysql://%s:<password>@%s/%s",
+                  dbi->user,
+                  dbi->host,
+                  dbi->database);
+        return (result);
+    }
+
+    retried = ISC_FALSE;
+retry:
+    result = db_statements(dbc, dbi->table, &st);
+    if (result != ISC_R_SUCCESS)
+    {
+        if (!retried && result == ISC_R_CONNECTIONRESET)
+        {
+            retried = ISC_TRUE;
+            if (db_reconnect(dbc) == ISC_R_SUCCESS)
+                goto retry;
+        }
+        goto cleanup;
+    }
+
+    result = ISC_R_FAILURE;
+    if (paged)
+    {
+        if (st->allpage == NULL)
+            st->allpage = db_prepare(dbc, st->hasrname ? st->layout->allpage_rname :
+                                     st->layout->allpage, dbi->table, ISC_FALSE, &err);
+        stmt = st->allpage;
+        if (stmt == NULL && !retried && connection_lost(err))
+        {
+            retried = ISC_TRUE;
+            if (db_reconnect(dbc) == ISC_R_SUCCESS)
+                goto retry;
+        }
+        if (stmt == NULL)
+            goto cleanup;
+        cursor = CURSOR_TYPE_NO_CURSOR;
+        prefetch = 0;
+    }
+    else
+    {
+        stmt = st->allnodes;
+        cursor = (dbi->prefetch > 0) ? CURSOR_TYPE_READ_ONLY : CURSOR_TYPE_NO_CURSOR;
+        prefetch = dbi->prefetch;
+    }
+    if (mysql_stmt_attr_set(stmt, STMT_ATTR_CURSOR_TYPE, &cursor) != 0 ||
+        (prefetch > 0 && mysql_stmt_attr_set(stmt, STMT_ATTR_PREFETCH_ROWS, &prefetch) != 0))
+    {
+	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "ERROR: Unable to set the statement's cursor attributes");
+        goto cleanup;
+    }
+    if (mysql_stmt_bind_param(stmt, params) != 0)
+    {
+	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "ERROR: Unable to bind input params");
+        goto cleanup;
+    } 
+page:
+    (void)isc_time_now(&start);
+    if (mysql_stmt_execute(stmt) != 0)
+    {
+        if (!retried && connection_lost(mysql_stmt_errno(stmt)))
+        {
+            /* a later page resumes from the last row handed on */
+            retried = ISC_TRUE;
+            stmt = NULL;
+            if (db_reconnect(dbc) == ISC_R_SUCCESS)
+                goto retry;
+            goto cleanup;
+        }
+	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "ERROR: Unable to execute statement!");
+        goto cleanup;
+    }
+    stats_time(dbi, TIMER_EXECUTE, &start);
+
+    if (mysql_stmt_bind_result(stmt, paged ? results : results + 2) != 0)
+    {
+	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "ERROR: Unable to bind result!");
+        goto cleanup;
+    } 
+
+    /*
+     * The rows are not buffered with mysql_stmt_store_result(); each
+     * one is handed on as it arrives, so a large zone never has to fit
+     * in memory twice.  With a cursor, the server sends "prefetch" rows
+     * per round-trip.
+     */
+    result = ISC_R_SUCCESS;
+    page_count = 0;
+    (void)isc_time_now(&start);
+    while ((status = mysql_stmt_fetch(stmt)) == 0 ||
+           (status == MYSQL_DATA_TRUNCATED && rdtruncated))
+    {
+        stats_time(dbi, TIMER_FETCH, &start);
+        stats_increment(dbi, STAT_ROWS);
+        result_count++;
+        page_count++;
+	    result = func(arg, name, ttl, type, data,
+                      row_rdata(st, type, rdata, rdnull, rdtruncated),
+                      result_lengths[6]);
+	    if (result != ISC_R_SUCCESS)
+            break;
+        if (paged)
+        {
+            param_lengths[2] = ISC_MIN(result_lengths[1], DATA_LENGTH);
+            param_lengths[3] = param_lengths[2];
+            memcpy(lastkey, key, param_lengths[2]);
+            lastid = id;
+        }
+        (void)isc_time_now(&start);
+    }   
+    if (result == ISC_R_SUCCESS && status != MYSQL_NO_DATA)
+    {
+	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "ERROR: Unable to fetch row %d: %s",
+                  result_count + 1,
+                  (status == MYSQL_DATA_TRUNCATED) ? "data truncated" : mysql_stmt_error(stmt));
+        result = ISC_R_FAILURE;
+    }
+    else if (result == ISC_R_SUCCESS && paged && (unsigned int) page_count == pagesize)
+    {
+        /* a full page; there may be more */
+        mysql_stmt_free_result(stmt);
+        retried = ISC_FALSE;
+        goto page;
+    }
+    else if (result == ISC_R_SUCCESS && result_count == 0)
+    {
+#ifdef MYSQLDB_DEBUG
+	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+			      "no result(s)");
+#endif
+        result = ISC_R_NOTFOUND;
+    }
+
+cleanup:
+    if (stmt != NULL)
+        mysql_stmt_free_result(stmt);
+    pool_return(dbc);
+    return (result);
+}
+
+/*
+ * Zone snapshots.
+ *
+ * A zone configured with "snapshot=" is loaded whole into memory when it
+ * is created and answered from there without touching the database.  The
+ * maintenance thread re-reads the apex SOA every refresh interval and
+ * reloads the zone only when the serial has changed; if the database is
+ * unreachable the old snapshot keeps being served.
+ *
+ * Records are kept sorted by name as offsets into one string pool, so a
+ * lookup is a binary search.  A record's "data" is its wire-format rdata
+ * when rdlen is not RDLEN_NONE, and its text otherwise.
+ */
+struct snaprec
+{
+    unsigned int name;
+    unsigned int type;
+    unsigned int data;
+    unsigned int rdlen;
+    dns_ttl_t ttl;
+};
+
+struct snapshot
+{
+    struct snaprec *recs;
+    unsigned int count;
+    unsigned int nalloc;
+    char *strings;
+    size_t used;
+    size_t size;
+    const char *zone;           /* used only while loading */
+    isc_boolean_t hasserial;
+    isc_uint32_t serial;
+};
+
+#define SNAP_STRING(snap, off) ((snap)->strings + (off))
+
+static void snapshot_free(struct snapshot *snap)
+{
+    if (snap->recs != NULL)
+        isc_mem_put(ns_g_mctx, snap->recs, snap->nalloc * sizeof(struct snaprec));
+    if (snap->strings != NULL)
+        isc_mem_put(ns_g_mctx, snap->strings, snap->size);
+    isc_mem_put(ns_g_mctx, snap, sizeof(struct snapshot));
+}
+
+/*
+ * Copy bytes into the snapshot's pool, growing it as needed, and return
+ * their offset.
+ */
+static isc_result_t snapshot_copy(struct snapshot *snap, const void *str, size_t len,
+                                  unsigned int *offp)
+{
+    size_t size;
+    char *strings;
+
+    if (snap->used + len > snap->size)
+    {
+        size = (snap->size == 0) ? 4096 : snap->size * 2;
+        while (size < snap->used + len)
+            size *= 2;
+        strings = isc_mem_get(ns_g_mctx, size);
+        if (strings == NULL)
+            return (ISC_R_NOMEMORY);
+        if (snap->strings != NULL)
+        {
+            memcpy(strings, snap->strings, snap->used);
+            isc_mem_put(ns_g_mctx, snap->strings, snap->size);
+        }
+        snap->strings = strings;
+        snap->size = size;
+    }
+    memcpy(snap->strings + snap->used, str, len);
+    *offp = snap->used;
+    snap->used += len;
+    return (ISC_R_SUCCESS);
+}
+
+static isc_result_t snapshot_string(struct snapshot *snap, const char *str, unsigned int *offp)
+{
+    return (snapshot_copy(snap, str, strlen(str) + 1, offp));
+}
+
+/*
+ * Return the serial field of SOA rdata, the third field.
+ */
+static isc_boolean_t soa_serial(const char *data, isc_uint32_t *serialp)
+{
+    const char *p = data;
+    int field;
+
+    for (field = 0; field < 2; field++)
+    {
+        while (*p != '\0' && !isspace((unsigned char) *p))
+            p++;
+        while (isspace((unsigned char) *p))
+            p++;
+    }
+    if (!isdigit((unsigned char) *p))
+        return (ISC_FALSE);
+    *serialp = (isc_uint32_t) strtoul(p, NULL, 10);
+    return (ISC_TRUE);
+}
+
+static isc_result_t snapshot_row(void *arg, const char *name, dns_ttl_t ttl,
+                                 const char *type, const char *data,
+                                 const unsigned char *rdata, unsigned int rdlen)
+{
+    struct snapshot *snap = arg;
+    struct snaprec *rec, *recs;
+    unsigned int nalloc;
+    isc_result_t result;
+
+    if (snap->count == snap->nalloc)
+    {
+        nalloc = (snap->nalloc == 0) ? 64 : snap->nalloc * 2;
+        recs = isc_mem_get(ns_g_mctx, nalloc * sizeof(struct snaprec));
+        if (recs == NULL)
+            return (ISC_R_NOMEMORY);
+        if (snap->recs != NULL)
+        {
+            memcpy(recs, snap->recs, snap->count * sizeof(struct snaprec));
+            isc_mem_put(ns_g_mctx, snap->recs, snap->nalloc * sizeof(struct snaprec));
+        }
+        snap->recs = recs;
+        snap->nalloc = nalloc;
+    }
+
+    rec = &snap->recs[snap->count];
+    rec->ttl = ttl;
+    /* rows arrive grouped by name, so consecutive owners share one copy */
+    if (snap->count > 0 &&
+        strcasecmp(SNAP_STRING(snap, rec[-1].name), name) == 0)
+        rec->name = rec[-1].name;
+    else if ((result = snapshot_string(snap, name, &rec->name)) != ISC_R_SUCCESS)
+        return (result);
+    if ((result = snapshot_string(snap, type, &rec->type)) != ISC_R_SUCCESS)
+        return (result);
+    if (rdata != NULL)
+    {
+        rec->rdlen = rdlen;
+        result = snapshot_copy(snap, rdata, rdlen, &rec->data);
+    }
+    else
+    {
+        rec->rdlen = RDLEN_NONE;
+        result = snapshot_string(snap, data, &rec->data);
+    }
+    if (result != ISC_R_SUCCESS)
+        return (result);
+    snap->count++;
+
+    if (strcasecmp(type, "SOA") == 0 && strcasecmp(name, snap->zone) == 0)
+        snap->hasserial = soa_serial(data, &snap->serial);
+    return (ISC_R_SUCCESS);
+}
+
+/* qsort() has no argument pointer; the strings of the snapshot being sorted */
+static const char *snapsort_strings;
+
+static int snaprec_compare(const void *a, const void *b)
+{
+    const struct snaprec *ra = a, *rb = b;
+
+    return (strcasecmp(snapsort_strings + ra->name, snapsort_strings + rb->name));
+}
+
+/*
+ * Load the whole zone into a new snapshot.  The database's collation
+ * need not agree with strcasecmp(), so the records are sorted again
+ * here; "snapsort_lock" serializes the sort.  Snapshots are always read
+ * from the zone's own host, never a replica, so that the records loaded
+ * are at least as new as the serial that prompted the load.
+ */
+static isc_mutex_t snapsort_lock;
+
+static isc_result_t snapshot_load(struct dbinfo *dbi, struct snapshot **snapp)
+{
+    struct snapshot *snap;
+    isc_result_t result;
+
+    snap = isc_mem_get(ns_g_mctx, sizeof(struct snapshot));
+    if (snap == NULL)
+        return (ISC_R_NOMEMORY);
+    memset(snap, 0, sizeof(struct snapshot));
+    snap->zone = dbi->zone;
+
+    result = db_allnodes(dbi, ISC_TRUE, snapshot_row, snap);
+    if (result == ISC_R_NOTFOUND)
+        result = ISC_R_SUCCESS;
+    if (result != ISC_R_SUCCESS)
+    {
+        snapshot_free(snap);
+        return (result);
+    }
+
+    LOCK(&snapsort_lock);
+    snapsort_strings = snap->strings;
+    qsort(snap->recs, snap->count, sizeof(struct snaprec), snaprec_compare);
+    UNLOCK(&snapsort_lock);
+
+    snap->zone = NULL;
+    *snapp = snap;
+    return (ISC_R_SUCCESS);
+}
+
+/*
+ * Index of the first record whose name is not less than "name".
+ */
+static unsigned int snapshot_find(const struct snapshot *snap, const char *name)
+{
+    unsigned int lo = 0, hi = snap->count, mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (strcasecmp(SNAP_STRING(snap, snap->recs[mid].name), name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo);
+}
+
+static isc_result_t snapshot_lookup(struct dbinfo *dbi, const char *name, dns_sdblookup_t *lookup)
+{
+    struct snapshot *snap;
+    struct snaprec *rec;
+    unsigned int i;
+    isc_result_t result = ISC_R_NOTFOUND;
+
+    RWLOCK(&dbi->snaplock, isc_rwlocktype_read);
+    snap = dbi->snap;
+    for (i = snapshot_find(snap, name); i < snap->count; i++)
+    {
+        rec = &snap->recs[i];
+        if (strcasecmp(SNAP_STRING(snap, rec->name), name) != 0)
+            break;
+        result = put_rr(dbi, lookup, SNAP_STRING(snap, rec->type), rec->ttl,
+                        SNAP_STRING(snap, rec->data),
+                        (rec->rdlen != RDLEN_NONE) ?
+                        (unsigned char *) SNAP_STRING(snap, rec->data) : NULL,
+                        rec->rdlen);
+        if (result != ISC_R_SUCCESS)
+            break;
+    }
+    RWUNLOCK(&dbi->snaplock, isc_rwlocktype_read);
+    return (result);
+}
+
+static isc_result_t snapshot_allnodes(struct dbinfo *dbi, dns_sdballnodes_t *allnodes)
+{
+    struct snapshot *snap;
+    struct snaprec *rec;
+    unsigned int i;
+    isc_result_t result = ISC_R_NOTFOUND;
+
+    RWLOCK(&dbi->snaplock, isc_rwlocktype_read);
+    snap = dbi->snap;
+    for (i = 0; i < snap->count; i++)
+    {
+        rec = &snap->recs[i];
+        result = put_namedrr(dbi, allnodes, SNAP_STRING(snap, rec->name),
+                             SNAP_STRING(snap, rec->type), rec->ttl,
+                             SNAP_STRING(snap, rec->data),
+                             (rec->rdlen != RDLEN_NONE) ?
+                             (unsigned char *) SNAP_STRING(snap, rec->data) : NULL,
+                             rec->rdlen);
+        if (result != ISC_R_SUCCESS)
+            break;
+    }
+    RWUNLOCK(&dbi->snaplock, isc_rwlocktype_read);
+    return (result);
+}
+
+static isc_result_t serial_row(void *arg, const char *name, dns_ttl_t ttl,
+                               const char *type, const char *data,
+                               const unsigned char *rdata, unsigned int rdlen)
+{
+    isc_uint32_t *serialp = arg;
+
+    UNUSED(name);
+    UNUSED(ttl);
+    UNUSED(rdata);
+    UNUSED(rdlen);
+
+    if (strcasecmp(type, "SOA") == 0 && soa_serial(data, serialp))
+        return (ISC_R_EXISTS);
+    return (ISC_R_SUCCESS);
+}
+
+/* the maintenance thread's lock, described with it below */
+static isc_mutex_t maint_lock;
+
+/*
+ * Reload the snapshot if the zone's SOA serial has moved on, or the
+ * change feed has seen its records change.  Called by the maintenance
+ * thread without maint_lock, which it takes only to read and set
+ * "snapdirty".
+ */
+static void snapshot_refresh(struct dbinfo *dbi)
+{
+    struct snapshot *snap, *old;
+    isc_uint32_t serial;
+    isc_boolean_t dirty;
+    isc_result_t result;
+
+    result = db_lookup(dbi, ISC_TRUE, (const char **)&dbi->zone, 1, serial_row, &serial);
+    if (result != ISC_R_EXISTS)
+    {
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_WARNING,
+                      "zone %s: unable to read the SOA serial, serving the snapshot as is",
+                      dbi->zone);
+        return;
+    }
+
+    RWLOCK(&dbi->snaplock, isc_rwlocktype_read);
+    old = dbi->snap;
+    result = (old->hasserial && old->serial == serial) ? ISC_R_EXISTS : ISC_R_SUCCESS;
+    RWUNLOCK(&dbi->snaplock, isc_rwlocktype_read);
+    LOCK(&maint_lock);
+    dirty = dbi->snapdirty;
+    if (result != ISC_R_EXISTS || dirty)
+        dbi->snapdirty = ISC_FALSE;
+    UNLOCK(&maint_lock);
+    if (result == ISC_R_EXISTS && !dirty)
+        return;
+
+    result = snapshot_load(dbi, &snap);
+    if (result != ISC_R_SUCCESS)
+    {
+        LOCK(&maint_lock);
+        dbi->snapdirty = ISC_TRUE;
+        UNLOCK(&maint_lock);
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_WARNING,
+                      "zone %s: snapshot reload failed: %s",
+                      dbi->zone, isc_result_totext(result));
+        return;
+    }
+
+    RWLOCK(&dbi->snaplock, isc_rwlocktype_write);
+    old = dbi->snap;
+    dbi->snap = snap;
+    RWUNLOCK(&dbi->snaplock, isc_rwlocktype_write);
+    snapshot_free(old);
+
+    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                  NS_LOGMODULE_MAIN, ISC_LOG_INFO,
+                  "zone %s: snapshot reloaded, serial %u, %u records",
+                  dbi->zone, snap->serial, snap->count);
+}
+
+/*
+ * The maintenance thread.
+ *
+ * One thread per driver does all periodic work, waking every
+ * MAINT_INTERVAL seconds.  It is started by the first zone that needs
+ * it.  The zone lists it walks are protected by "maint_lock", under
+ * which it picks out the feeds and zones that are due and takes a
+ * reference on each.  It then drops the lock for their queries, so that
+ * zones can come and go, and stats be dumped, while the server is slow.
+ * A zone being destroyed waits on "maint_idle" for the thread to let it
+ * go.
+ */
+#define MAINT_INTERVAL 1
+
+static isc_condition_t maint_wakeup;
+static isc_condition_t maint_idle;
+static isc_thread_t maint_thread;
+static isc_boolean_t maint_running = ISC_FALSE;
+static isc_boolean_t maint_exiting = ISC_FALSE;
+static unsigned int maint_statsinterval = 0;
+static isc_stdtime_t maint_statsnext;
+
+/* every zone, linked by dbi->next and protected by maint_lock */
+static struct dbinfo *zones = NULL;
+
+static void zone_stats_log(struct dbinfo *dbi)
+{
+    char what[1100];
+
+    snprintf(what, sizeof(what), "zone %s", dbi->zone);
+    stats_log(what, dbi->stats);
+}
+
+/*
+ * Change feed.
+ *
+ * A zone with changes=TABLE learns of edits to its records from TABLE, a
+ * log appended to by triggers on the records table (see
+ * sql/dns_changes_create.sql).  The maintenance thread reads the rows
+ * past the last id it has seen every MAINT_INTERVAL seconds.  For each
+ * one it evicts the cached answers for the changed name and for its
+ * ancestors, whose answers can change when a name below them comes or
+ * goes, or every cached answer of the zone for a wildcard.  Snapshotted
+ * zones it names are reloaded straight away rather than at their next
+ * serial check.  One feed is kept per (pool, table) and shared by its
+ * zones.
+ *
+ * Ids are handed out when rows are inserted but become visible when
+ * their transaction commits, so a smaller id can turn up after a larger
+ * one.  The feed remembers up to CHANGES_MAXGAPS ids it has skipped, and
+ * keeps reading from below them until they turn up or CHANGES_GAPWAIT
+ * seconds have passed (their transactions were rolled back).  Past that
+ * many it applies every row it rereads again, which does no harm beyond
+ * the extra evictions.
+ */
+#define CHANGES_START_QUERY "SELECT COALESCE(MAX(id), 0) FROM %s"
+#define CHANGES_QUERY "SELECT id, tenant_id, domain_id, name FROM %s " \
+                      "WHERE id > ? ORDER BY id LIMIT 10000"
+#define CHANGES_BATCH 10000
+#define CHANGES_GAPWAIT 30
+#define CHANGES_MAXGAPS 256
+#define CHANGES_MAXBELOW 32
+
+struct changefeed
+{
+    struct dbpool *pool;
+    char *table;
+    unsigned int refs;
+    isc_uint64_t lastid;        /* every change up to here is applied */
+    isc_uint64_t seenid;        /* the largest id applied */
+    isc_uint64_t gaps[CHANGES_MAXGAPS]; /* ids below seenid not yet seen */
+    unsigned int ngaps;
+    isc_boolean_t overflow;     /* more gaps than fit in "gaps" */
+    isc_stdtime_t gapsince;     /* 0 unless waiting on a gap */
+    char below[CHANGES_MAXBELOW][KEY_LENGTH]; /* this poll's changed names */
+    unsigned int belowlen[CHANGES_MAXBELOW];
+    unsigned int nbelow;
+    isc_boolean_t belowall;     /* too many zones; evict everything */
+    struct changefeed *next;
+    struct changefeed *duenext; /* the maintenance thread's work */
+};
+
+/*
+ * Note a change's id, returning whether it is new: above every id seen,
+ * or one of the gaps below.
+ */
+static isc_boolean_t changes_newid(struct changefeed *feed, isc_uint64_t id)
+{
+    isc_uint64_t skipped;
+    unsigned int i;
+
+    if (id > feed->seenid)
+    {
+        for (skipped = feed->seenid + 1; skipped < id; skipped++)
+        {
+            if (feed->ngaps == CHANGES_MAXGAPS)
+            {
+                feed->overflow = ISC_TRUE;
+                break;
+            }
+            feed->gaps[feed->ngaps++] = skipped;
+        }
+        feed->seenid = id;
+        return (ISC_TRUE);
+    }
+
+    for (i = 0; i < feed->ngaps; i++)
+    {
+        if (feed->gaps[i] == id)
+        {
+            feed->gaps[i] = feed->gaps[--feed->ngaps];
+            return (ISC_TRUE);
+        }
+    }
+    return (feed->overflow);
+}
+
+/*
+ * "feeds", and their links and references, are protected by maint_lock.
+ * The rest of a feed is only touched by the maintenance thread.
+ */
+static struct changefeed *feeds = NULL;
+
+/*
+ * Note a changed name whose subtree is to be evicted at the end of the
+ * poll.  Answers cached under names below it may have been synthesized
+ * from a wildcard, or denied, on the strength of the name's absence or
+ * presence.  Past CHANGES_MAXBELOW names, a zone's are widened to the
+ * whole zone, and a zone that is not already listed evicts everything.
+ */
+static void changes_below(struct changefeed *feed, const char *key, unsigned int keylen)
+{
+    unsigned int zonelen, i;
+    isc_boolean_t widened = ISC_FALSE;
+
+    zonelen = strlen(key) + 1;
+    zonelen += strlen(key + zonelen) + 1;
+    if (feed->nbelow < CHANGES_MAXBELOW)
+    {
+        memcpy(feed->below[feed->nbelow], key, keylen);
+        feed->belowlen[feed->nbelow++] = keylen;
+        return;
+    }
+    for (i = 0; i < feed->nbelow; i++)
+    {
+        if (cache_key_below(feed->below[i], feed->belowlen[i], key, zonelen))
+        {
+            feed->belowlen[i] = zonelen;
+            widened = ISC_TRUE;
+        }
+    }
+    if (!widened)
+        feed->belowall = ISC_TRUE;
+}
+
+/*
+ * Evict what one change can have made stale: the name and its parents at
+ * once, and its subtree with the poll's others (see changes_below()).
+ */
+static void changes_apply(struct changefeed *feed, const char *tenant_id,
+                          const char *domain_id, const char *name)
+{
+    char key[KEY_LENGTH];
+    unsigned int keylen;
+    const char *label;
+    struct dbinfo *dbi;
+
+    stats_increment(NULL, STAT_CHANGE);
+
+    if (cache_key(tenant_id, domain_id, name, key, &keylen))
+    {
+        if (name[0] == '*' && (name[1] == '.' || name[1] == '\0'))
+        {
+            /* the key up to the name */
+            cache_evict_prefix(key, keylen - strlen(name) - 1);
+        }
+        else
+        {
+            changes_below(feed, key, keylen);
+            for (label = name; label != NULL; label = strchr(label, '.'))
+            {
+                if (*label == '.')
+                    label++;
+                if (cache_key(tenant_id, domain_id, label, key, &keylen))
+                    cache_evict(key, keylen);
+            }
+        }
+    }
+
+    LOCK(&maint_lock);
+    for (dbi = zones; dbi != NULL; dbi = dbi->next)
+    {
+        if (dbi->snap != NULL && dbi->pool == feed->pool &&
+            dbi->tenant_id != NULL && strcmp(dbi->tenant_id, tenant_id) == 0 &&
+            dbi->domain_id != NULL && strcmp(dbi->domain_id, domain_id) == 0)
+        {
+            dbi->snapdirty = ISC_TRUE;
+            dbi->snapcheck = 0;
+        }
+    }
+    UNLOCK(&maint_lock);
+}
+
+/*
+ * Find the connection's poll statement for a change log, preparing it on
+ * first use.  Fails as db_statements() does.
+ */
+static isc_result_t changes_statement(struct dbconn *dbc, const char *table,
+                                      MYSQL_STMT **stmtp)
+{
+    struct dbfeedstmt *fst;
+    unsigned int err;
+
+    for (fst = dbc->feedstmts; fst != NULL; fst = fst->next)
+    {
+        if (strcmp(fst->table, table) == 0)
+        {
+            *stmtp = fst->poll;
+            return (ISC_R_SUCCESS);
+        }
     }
 
-    if (mysql_stmt_bind_result(stmt, results) != 0)
+    fst = isc_mem_get(ns_g_mctx, sizeof(struct dbfeedstmt));
+    if (fst == NULL)
+        return (ISC_R_NOMEMORY);
+    fst->table = isc_mem_strdup(ns_g_mctx, table);
+    if (fst->table == NULL)
     {
-	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "ERROR: Unable to bind result!");
-        return (ISC_R_FAILURE);
-    } 
-    if (mysql_stmt_store_result(stmt) != 0)
+        isc_mem_put(ns_g_mctx, fst, sizeof(struct dbfeedstmt));
+        return (ISC_R_NOMEMORY);
+    }
+    fst->poll = db_prepare(dbc, CHANGES_QUERY, table, ISC_FALSE, &err);
+    if (fst->poll == NULL)
     {
-        return (ISC_R_FAILURE);
+        isc_mem_free(ns_g_mctx, fst->table);
+        isc_mem_put(ns_g_mctx, fst, sizeof(struct dbfeedstmt));
+        return (connection_lost(err) ? ISC_R_CONNECTIONRESET : ISC_R_FAILURE);
     }
-    result_count = mysql_stmt_num_rows(stmt); 
-    if (result_count == 0)
+    fst->next = dbc->feedstmts;
+    dbc->feedstmts = fst;
+    *stmtp = fst->poll;
+    return (ISC_R_SUCCESS);
+}
+
+/*
+ * Read and apply the changes logged since the last poll.  A connection
+ * found lost is reopened and the read resumed from the last change read,
+ * once, as a lookup would be.  A pool whose connections stay busy for
+ * MAINT_INTERVAL has the poll skipped until the next tick, rather than
+ * holding up the thread's other work.  Called by the maintenance thread,
+ * which holds a reference on the feed, without maint_lock.
+ */
+static void changes_poll(struct changefeed *feed, isc_stdtime_t now)
+{
+    struct dbconn *dbc;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[1], results[4];
+    unsigned long lengths[4];
+    my_bool isnull[4];
+    isc_uint64_t from, id;
+    char tenant_id[ID_LENGTH];
+    char domain_id[ID_LENGTH];
+    char name[DATA_LENGTH];
+    unsigned int rows;
+    isc_boolean_t bumped = ISC_FALSE, retried = ISC_FALSE;
+    isc_interval_t interval;
+    isc_time_t deadline;
+    isc_result_t result;
+    int status, i;
+
+    isc_interval_set(&interval, MAINT_INTERVAL, 0);
+    if (isc_time_nowplusinterval(&deadline, &interval) != ISC_R_SUCCESS ||
+        pool_lease(feed->pool, &deadline, &dbc) != ISC_R_SUCCESS)
+        return;
+
+    memset(params, 0, sizeof(params));
+    params[0].buffer_type = MYSQL_TYPE_LONGLONG;
+    params[0].buffer      = (char *) &from;
+    params[0].is_unsigned = 1;
+
+    memset(results, 0, sizeof(results));
+    results[0].buffer_type   = MYSQL_TYPE_LONGLONG;
+    results[0].buffer        = (char *) &id;
+    results[0].is_unsigned   = 1;
+    results[1].buffer_type   = MYSQL_TYPE_STRING;
+    results[1].buffer        = tenant_id;
+    results[1].buffer_length = sizeof(tenant_id);
+    results[2].buffer_type   = MYSQL_TYPE_STRING;
+    results[2].buffer        = domain_id;
+    results[2].buffer_length = sizeof(domain_id);
+    results[3].buffer_type   = MYSQL_TYPE_STRING;
+    results[3].buffer        = name;
+    results[3].buffer_length = sizeof(name);
+    for (i = 0; i < 4; i++)
     {
-	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "no result(s)");
+        results[i].length  = &lengths[i];
+        results[i].is_null = &isnull[i];
+    }
+
+    from = feed->lastid;
+retry:
+    result = changes_statement(dbc, feed->table, &stmt);
+    if (result != ISC_R_SUCCESS)
+    {
+        if (!retried && result == ISC_R_CONNECTIONRESET)
+        {
+            retried = ISC_TRUE;
+            if (db_reconnect(dbc) == ISC_R_SUCCESS)
+                goto retry;
+        }
+        pool_return(dbc);
+        return;
+    }
+    do
+    {
+        if (mysql_stmt_bind_param(stmt, params) != 0 ||
+            mysql_stmt_execute(stmt) != 0 ||
+            mysql_stmt_bind_result(stmt, results) != 0)
+        {
+            if (!retried && connection_lost(mysql_stmt_errno(stmt)))
+            {
+                /* carries on from the last change read */
+                retried = ISC_TRUE;
+                if (db_reconnect(dbc) == ISC_R_SUCCESS)
+                    goto retry;
+                break;          /* stmt is gone; db_connect() logged why */
+            }
+            isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                          NS_LOGMODULE_MAIN, ISC_LOG_WARNING,
+                          "mysqldb: unable to read changes from %s: %s",
+                          feed->table, mysql_stmt_error(stmt));
+            break;
+        }
+
+        rows = 0;
+        while ((status = mysql_stmt_fetch(stmt)) == 0)
+        {
+            rows++;
+            from = id;
+            if (!changes_newid(feed, id))
+                continue;
+            if (!bumped)
+            {
+                /* before the first eviction */
+                LOCK(&cache_genlock);
+                cache_gen++;
+                UNLOCK(&cache_genlock);
+                bumped = ISC_TRUE;
+            }
+            if (!isnull[1] && !isnull[2] && !isnull[3])
+                changes_apply(feed, tenant_id, domain_id, name);
+        }
+        if (status == 1 && !retried && connection_lost(mysql_stmt_errno(stmt)))
+        {
+            retried = ISC_TRUE;
+            if (db_reconnect(dbc) == ISC_R_SUCCESS)
+                goto retry;
+            break;
+        }
         mysql_stmt_free_result(stmt);
-        return (ISC_R_NOTFOUND);
+    } while (status == MYSQL_NO_DATA && rows == CHANGES_BATCH);
+
+    pool_return(dbc);
+
+    if (feed->belowall)
+        cache_evict_prefix("", 0);
+    else if (feed->nbelow > 0)
+        cache_evict_below(feed->below, feed->belowlen, feed->nbelow);
+    feed->nbelow = 0;
+    feed->belowall = ISC_FALSE;
+
+    if (feed->ngaps > 0 || feed->overflow)
+    {
+        if (feed->gapsince == 0)
+            feed->gapsince = now;
+        else if (now >= feed->gapsince + CHANGES_GAPWAIT)
+        {
+            feed->ngaps = 0;
+            feed->overflow = ISC_FALSE;
+        }
+    }
+    if (feed->ngaps == 0 && !feed->overflow)
+    {
+        feed->lastid = feed->seenid;
+        feed->gapsince = 0;
+    }
+    else if (!feed->overflow)
+    {
+        /* reread from just below the oldest gap */
+        feed->lastid = feed->gaps[0];
+        for (i = 1; i < (int)feed->ngaps; i++)
+        {
+            if (feed->gaps[i] < feed->lastid)
+                feed->lastid = feed->gaps[i];
+        }
+        feed->lastid--;
+    }
+}
+
+/*
+ * Attach a zone to the feed for its pool and changes table, starting the
+ * feed at the table's current end if it is new.  Done before the zone
+ * reads any records, so nothing edited after that read is missed.
+ */
+static isc_result_t changes_attach(struct dbinfo *dbi)
+{
+    struct changefeed *feed;
+    struct dbconn *dbc;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND results[1];
+    isc_uint64_t lastid = 0;
+    isc_result_t result;
+
+    LOCK(&maint_lock);
+    for (feed = feeds; feed != NULL; feed = feed->next)
+    {
+        if (feed->pool == dbi->pool && strcmp(feed->table, dbi->changes) == 0)
+            break;
+    }
+    if (feed != NULL)
+    {
+        feed->refs++;
+        dbi->feed = feed;
+        UNLOCK(&maint_lock);
+        return (ISC_R_SUCCESS);
+    }
+    UNLOCK(&maint_lock);
+
+    result = pool_lease(dbi->pool, NULL, &dbc);
+    if (result != ISC_R_SUCCESS)
+        return (result);
+    result = ISC_R_FAILURE;
+    stmt = db_prepare(dbc, CHANGES_START_QUERY, dbi->changes, ISC_FALSE, NULL);
+    if (stmt != NULL)
+    {
+        memset(results, 0, sizeof(results));
+        results[0].buffer_type = MYSQL_TYPE_LONGLONG;
+        results[0].buffer      = (char *) &lastid;
+        results[0].is_unsigned = 1;
+        if (mysql_stmt_execute(stmt) == 0 &&
+            mysql_stmt_bind_result(stmt, results) == 0 &&
+            mysql_stmt_fetch(stmt) == 0)
+            result = ISC_R_SUCCESS;
+        else
+            isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                          NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                          "ERROR: unable to read changes from %s: %s",
+                          dbi->changes, mysql_stmt_error(stmt));
+        mysql_stmt_close(stmt);
+    }
+    pool_return(dbc);
+    if (result != ISC_R_SUCCESS)
+        return (result);
+
+    feed = isc_mem_get(ns_g_mctx, sizeof(struct changefeed));
+    if (feed == NULL)
+        return (ISC_R_NOMEMORY);
+    memset(feed, 0, sizeof(struct changefeed));
+    feed->table = isc_mem_strdup(ns_g_mctx, dbi->changes);
+    if (feed->table == NULL)
+    {
+        isc_mem_put(ns_g_mctx, feed, sizeof(struct changefeed));
+        return (ISC_R_NOMEMORY);
+    }
+    feed->pool = dbi->pool;
+    feed->lastid = lastid;
+    feed->seenid = lastid;
+    feed->refs = 1;
+
+    LOCK(&maint_lock);
+    feed->next = feeds;
+    feeds = feed;
+    dbi->feed = feed;
+    UNLOCK(&maint_lock);
+    return (ISC_R_SUCCESS);
+}
+
+/*
+ * Drop a reference to a feed, freeing it with the last.  Called with
+ * maint_lock held.
+ */
+static void changes_release(struct changefeed *feed)
+{
+    struct changefeed **prevp;
+
+    if (--feed->refs > 0)
+        return;
+    for (prevp = &feeds; *prevp != feed; prevp = &(*prevp)->next)
+        ;
+    *prevp = feed->next;
+    isc_mem_free(ns_g_mctx, feed->table);
+    isc_mem_put(ns_g_mctx, feed, sizeof(struct changefeed));
+}
+
+static void changes_detach(struct dbinfo *dbi)
+{
+    struct changefeed *feed = dbi->feed;
+
+    if (feed == NULL)
+        return;
+    dbi->feed = NULL;
+
+    LOCK(&maint_lock);
+    changes_release(feed);
+    UNLOCK(&maint_lock);
+}
+
+static isc_threadresult_t maint_run(isc_threadarg_t arg)
+{
+    isc_interval_t interval;
+    isc_time_t when;
+    isc_stdtime_t now;
+    struct dbinfo *dbi, *duezones, *nextdbi, **zonetail;
+    struct dbpool *pool, *duepools, *nextpool, **pooltail;
+    struct changefeed *feed, *duefeeds, *nextfeed, **feedtail;
+
+    UNUSED(arg);
+
+    mysql_thread_init();
+    isc_interval_set(&interval, MAINT_INTERVAL, 0);
+
+    LOCK(&maint_lock);
+    while (!maint_exiting)
+    {
+        isc_stdtime_get(&now);
+
+        /* the feeds first, since their changes can make snapshots due */
+        feedtail = &duefeeds;
+        for (feed = feeds; feed != NULL; feed = feed->next)
+        {
+            feed->refs++;
+            *feedtail = feed;
+            feedtail = &feed->duenext;
+        }
+        *feedtail = NULL;
+        UNLOCK(&maint_lock);
+        for (feed = duefeeds; feed != NULL; feed = feed->duenext)
+            changes_poll(feed, now);
+        LOCK(&maint_lock);
+        for (feed = duefeeds; feed != NULL; feed = nextfeed)
+        {
+            nextfeed = feed->duenext;
+            changes_release(feed);
+        }
+
+        zonetail = &duezones;
+        for (dbi = zones; dbi != NULL; dbi = dbi->next)
+        {
+            if (dbi->snap != NULL && now >= dbi->snapcheck)
+            {
+                dbi->snapcheck = now + dbi->snaprefresh;
+                dbi->maintrefs++;
+                *zonetail = dbi;
+                zonetail = &dbi->duenext;
+            }
+            if (dbi->statsinterval > 0 && now >= dbi->statsnext)
+            {
+                dbi->statsnext = now + dbi->statsinterval;
+                zone_stats_log(dbi);
+            }
+        }
+        if (maint_statsinterval > 0 && now >= maint_statsnext)
+        {
+            maint_statsnext = now + maint_statsinterval;
+            stats_log("driver", driverstats);
+        }
+        *zonetail = NULL;
+        UNLOCK(&maint_lock);
+
+        for (dbi = duezones; dbi != NULL; dbi = dbi->duenext)
+            snapshot_refresh(dbi);
+        LOCK(&maint_lock);
+        for (dbi = duezones; dbi != NULL; dbi = nextdbi)
+        {
+            nextdbi = dbi->duenext;
+            if (--dbi->maintrefs == 0)
+                BROADCAST(&maint_idle);
+        }
+        UNLOCK(&maint_lock);
+
+        /* as for zones, the pools are picked under poollock, but not pinged */
+        pooltail = &duepools;
+        LOCK(&poollock);
+        for (pool = pools; pool != NULL; pool = pool->next)
+        {
+            pool->refs++;
+            *pooltail = pool;
+            pooltail = &pool->duenext;
+        }
+        *pooltail = NULL;
+        UNLOCK(&poollock);
+        for (pool = duepools; pool != NULL; pool = nextpool)
+        {
+            nextpool = pool->duenext;
+            pool_keepalive(pool, now);
+            pool_probe(pool, now);
+            pool_detach(&pool);
+        }
+
+        LOCK(&maint_lock);
+        if (maint_exiting ||
+            isc_time_nowplusinterval(&when, &interval) != ISC_R_SUCCESS)
+            break;
+        (void)isc_condition_waituntil(&maint_wakeup, &maint_lock, &when);
+    }
+    UNLOCK(&maint_lock);
+
+    mysql_thread_end();
+    return ((isc_threadresult_t) 0);
+}
+
+/*
+ * Start the maintenance thread if it is not already running.  Called
+ * with maint_lock held.
+ */
+static isc_result_t maint_start(void)
+{
+    isc_result_t result;
+
+    if (maint_running)
+        return (ISC_R_SUCCESS);
+    result = isc_thread_create(maint_run, NULL, &maint_thread);
+    if (result == ISC_R_SUCCESS)
+        maint_running = ISC_TRUE;
+    return (result);
+}
+
+static void maint_stop(void)
+{
+    LOCK(&maint_lock);
+    maint_exiting = ISC_TRUE;
+    BROADCAST(&maint_wakeup);
+    UNLOCK(&maint_lock);
+    if (maint_running)
+        (void)isc_thread_join(maint_thread, NULL);
+    maint_running = ISC_FALSE;
+}
+
+/*
+ * Add a zone to the zone list, starting the maintenance thread if the
+ * zone has a snapshot to refresh, stats to log, connections to keep
+ * alive, changes to follow or replicas to bring back up.
+ */
+static isc_result_t maint_attach(struct dbinfo *dbi)
+{
+    isc_stdtime_t now;
+    isc_result_t result = ISC_R_SUCCESS;
+
+    isc_stdtime_get(&now);
+    dbi->snapcheck = now + dbi->snaprefresh;
+    dbi->snapdirty = ISC_FALSE;
+    dbi->statsnext = now + dbi->statsinterval;
+
+    LOCK(&maint_lock);
+    if (dbi->snap != NULL || dbi->statsinterval > 0 || dbi->keepalive > 0 ||
+        dbi->feed != NULL || dbi->nreplicas > 0 || dbi->breaker > 0)
+        result = maint_start();
+    if (result == ISC_R_SUCCESS)
+    {
+        if (dbi->statsinterval > 0 &&
+            (maint_statsinterval == 0 || dbi->statsinterval < maint_statsinterval))
+        {
+            maint_statsinterval = dbi->statsinterval;
+            maint_statsnext = now + maint_statsinterval;
+        }
+        dbi->next = zones;
+        zones = dbi;
+    }
+    UNLOCK(&maint_lock);
+    return (result);
+}
+
+/*
+ * Take a zone off the zone list, waiting for the maintenance thread if it
+ * is refreshing the zone's snapshot.
+ */
+static void maint_detach(struct dbinfo *dbi)
+{
+    struct dbinfo **prevp;
+
+    LOCK(&maint_lock);
+    for (prevp = &zones; *prevp != NULL; prevp = &(*prevp)->next)
+    {
+        if (*prevp == dbi)
+        {
+            *prevp = dbi->next;
+            break;
+        }
+    }
+    while (dbi->maintrefs > 0)
+        WAIT(&maint_idle, &maint_lock);
+    UNLOCK(&maint_lock);
+}
+
+/*
+ * Load the zone's first snapshot.  maint_attach() then hands it to the
+ * maintenance thread.
+ */
+static isc_result_t snapshot_attach(struct dbinfo *dbi)
+{
+    isc_result_t result;
+
+    result = isc_rwlock_init(&dbi->snaplock, 0, 0);
+    if (result != ISC_R_SUCCESS)
+        return (result);
+    result = snapshot_load(dbi, &dbi->snap);
+    if (result != ISC_R_SUCCESS)
+        isc_rwlock_destroy(&dbi->snaplock);
+    return (result);
+}
+
+/*
+ * Called once the zone is off the zone list.
+ */
+static void snapshot_detach(struct dbinfo *dbi)
+{
+    if (dbi->snap == NULL)
+        return;
+
+    snapshot_free(dbi->snap);
+    dbi->snap = NULL;
+    isc_rwlock_destroy(&dbi->snaplock);
+}
+
+struct lookupctx
+{
+    struct dbinfo *dbi;
+    dns_sdblookup_t *lookup;
+    struct rrset *rrs;          /* NULL unless the answer is to be cached */
+    isc_boolean_t apex;
+    isc_boolean_t answered;     /* some record has been handed to BIND */
+};
+
+static isc_result_t lookup_row(void *arg, const char *name, dns_ttl_t ttl,
+                               const char *type, const char *data,
+                               const unsigned char *rdata, unsigned int rdlen)
+{
+    struct lookupctx *ctx = arg;
+
+    UNUSED(name);
+
+#ifdef MYSQLDB_DEBUG
+    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                  NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                  "type: %s ttl: %d data: %s", type, ttl, data);
+#endif
+    ctx->answered = ISC_TRUE;
+    if (ctx->rrs != NULL)
+        rrset_add(ctx->rrs, ttl, type, data, rdata, rdlen);
+    if (ctx->apex && strcasecmp(type, "SOA") == 0)
+        learn_negttl(ctx->dbi, ttl, data);
+    if (put_rr(ctx->dbi, ctx->lookup, type, ttl, data, rdata, rdlen) != ISC_R_SUCCESS)
+    {
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                      "ERROR: unable to set RR result for bind");
+        return (ISC_R_FAILURE);
+    }
+    return (ISC_R_SUCCESS);
+}
+
+/*
+ * The names to fetch with "name" to resolve it in one query, in the order
+ * that decides the answer: the name itself, then for each ancestor from
+ * its parent up to the apex, the wildcard below the ancestor and (except
+ * for the apex, which always exists) the ancestor itself.  So wildcards
+ * are at the odd indexes.  The first of these with records gives the
+ * answer: the name's own, or a wildcard's, which the name then takes; an
+ * ancestor with records is the closest encloser, with no wildcard below
+ * it, and the name does not exist.  These are the names BIND would
+ * otherwise ask for one by one.
+ *
+ * Returns 1, meaning just the name, for the apex, a name outside the
+ * zone, one with a wildcard or escaped character in it, or one too deep
+ * for CLOSEST_NAMES.
+ */
+static unsigned int closest_names(const char *zone, const char *name,
+                                  char wild[][DATA_LENGTH + 3], const char **names)
+{
+    size_t nlen = strlen(name), zlen = strlen(zone);
+    const char *apex, *p;
+    unsigned int count = 1;
+
+    names[0] = name;
+    if (nlen <= zlen + 1 || name[nlen - zlen - 1] != '.' ||
+        strcasecmp(name + nlen - zlen, zone) != 0 ||
+        strchr(name, '*') != NULL || strchr(name, '\\') != NULL)
+        return (1);
+
+    apex = name + nlen - zlen;
+    for (p = strchr(name, '.') + 1; ; p = strchr(p, '.') + 1)
+    {
+        if (count + 2 > CLOSEST_NAMES)
+            return (1);
+        snprintf(wild[count / 2], DATA_LENGTH + 3, "*.%s", p);
+        names[count] = wild[count / 2];
+        count++;
+        if (p == apex)
+            break;
+        names[count++] = p;
+    }
+    return (count);
+}
+
+/*
+ * Sorts the rows of a closest_names() query: those of the first name to
+ * have any answer the lookup, and with the cache on, every name's rows
+ * (or their absence) are cached for the lookups BIND would make next.
+ */
+struct closestctx
+{
+    struct lookupctx *answer;
+    const char **names;
+    unsigned int count;
+    int chosen;                 /* the first name with records, or -1 */
+    int current;                /* the name whose records are in "rrs" */
+    isc_boolean_t seen[CLOSEST_NAMES];
+    isc_boolean_t cached;
+    unsigned int gen;
+    struct rrset rrs;
+};
+
+/*
+ * Cache the records collected for the current name, other than the
+ * looked-up name itself, which lookup_answer() caches.
+ */
+static void closest_flush(struct closestctx *ctx)
+{
+    struct dbinfo *dbi = ctx->answer->dbi;
+    char key[KEY_LENGTH];
+    unsigned int keylen;
+
+    if (ctx->cached && ctx->current > 0 &&
+        cache_key(dbi->tenant_id, dbi->domain_id, ctx->names[ctx->current], key, &keylen))
+        cache_put(key, keylen, &ctx->rrs, ctx->rrs.minttl, dbi->stale, ctx->gen);
+}
+
+static isc_result_t closest_row(void *arg, const char *name, dns_ttl_t ttl,
+                                const char *type, const char *data,
+                                const unsigned char *rdata, unsigned int rdlen)
+{
+    struct closestctx *ctx = arg;
+    int i;
+
+    for (i = 0; ctx->names[i] != name; i++)
+        ;
+    if (ctx->chosen < 0)
+        ctx->chosen = i;
+    if (i != ctx->current)
+    {
+        closest_flush(ctx);
+        ctx->current = i;
+        rrset_init(&ctx->rrs);
+    }
+    ctx->seen[i] = ISC_TRUE;
+    if (ctx->cached && i > 0)
+        rrset_add(&ctx->rrs, ttl, type, data, rdata, rdlen);
+    if (i == ctx->chosen && (i == 0 || i % 2 == 1))
+        return (lookup_row(ctx->answer, name, ttl, type, data, rdata, rdlen));
+    return (ISC_R_SUCCESS);
+}
+
+/*
+ * Fetch a name along with its closest_names() in one query.  A wildcard's
+ * records are handed to BIND as the name's own.
+ */
+static isc_result_t lookup_closest(struct lookupctx *answer, const char **names,
+                                   unsigned int count, isc_boolean_t cached,
+                                   unsigned int gen)
+{
+    struct dbinfo *dbi = answer->dbi;
+    struct closestctx ctx;
+    char key[KEY_LENGTH];
+    unsigned int i, keylen;
+    isc_result_t result;
+
+    memset(ctx.seen, 0, sizeof(ctx.seen));
+    ctx.answer = answer;
+    ctx.names = names;
+    ctx.count = count;
+    ctx.chosen = -1;
+    ctx.current = -1;
+    ctx.cached = cached;
+    ctx.gen = gen;
+
+    result = db_lookup(dbi, ISC_FALSE, names, count, closest_row, &ctx);
+    if (result != ISC_R_SUCCESS && result != ISC_R_NOTFOUND)
+        return (result);
+
+    closest_flush(&ctx);
+    for (i = 1; cached && i < count; i++)
+    {
+        if (!ctx.seen[i] &&
+            cache_key(dbi->tenant_id, dbi->domain_id, names[i], key, &keylen))
+        {
+            rrset_init(&ctx.rrs);
+            cache_put(key, keylen, &ctx.rrs, get_negttl(dbi), dbi->stale, gen);
+        }
+    }
+    if (ctx.chosen == 0 || (ctx.chosen > 0 && ctx.chosen % 2 == 1))
+        return (ISC_R_SUCCESS);
+    return (ISC_R_NOTFOUND);
+}
+
+/*
+ * A lookup is answered from the zone's snapshot if it has one, then from
+ * the answer cache, and only then from the database.  A name below the
+ * apex is fetched along with the wildcards and ancestors that decide it.
+ * A lookup that finds the same name already being fetched waits for that
+ * query and shares its answer; one too large to share is fetched again.
+ * With stale=SECS, a lookup the database fails to answer is answered from
+ * an expired cached answer if there is one, and its waiters with it.
+ */
+static isc_result_t lookup_answer(struct dbinfo *dbi, const char *zone, const char *name,
+                                  dns_sdblookup_t *lookup)
+{
+    struct lookupctx ctx;
+    char key[KEY_LENGTH];
+    char wild[CLOSEST_NAMES / 2][DATA_LENGTH + 3];
+    const char *names[CLOSEST_NAMES];
+    unsigned int count;
+    unsigned int keylen = 0;
+    unsigned int gen = 0;
+    isc_boolean_t keyed, cached, leader = ISC_FALSE;
+    struct flight *flight = NULL;
+    struct rrset local, *rrs = &local;
+    isc_time_t deadline;
+    isc_result_t result, stale;
+
+    if (dbi->snap != NULL)
+    {
+        stats_increment(dbi, STAT_SNAPHIT);
+        return (snapshot_lookup(dbi, name, lookup));
+    }
+
+    keyed = cache_key(dbi->tenant_id, dbi->domain_id, name, key, &keylen);
+    cached = ISC_TF(keyed && dbi->cachesize > 0);
+    if (cached)
+    {
+        result = cache_get(key, keylen, rrs);
+        if (result == ISC_R_SUCCESS || result == ISC_R_NOTFOUND)
+            stats_increment(dbi, STAT_CACHEHIT);
+        if (result == ISC_R_SUCCESS)
+            return (rrset_replay(dbi, rrs->buf, rrs->len, lookup));
+        if (result == ISC_R_NOTFOUND)
+            return (ISC_R_NOTFOUND);
+        gen = cache_generation();
+    }
+
+    if (keyed)
+        flight = flight_join(key, keylen, &leader);
+    if (flight != NULL && !leader)
+    {
+        result = flight_wait(flight, lookup_deadline(dbi, &deadline));
+        if (result == ISC_R_SUCCESS &&
+            (flight->result != ISC_R_SUCCESS || !flight->rrs.overflow))
+        {
+            stats_increment(dbi, STAT_COALESCED);
+            result = flight->result;
+            if (result == ISC_R_SUCCESS)
+                result = rrset_replay(dbi, flight->rrs.buf, flight->rrs.len, lookup);
+            flight_release(flight);
+            return (result);
+        }
+        flight_release(flight);
+        flight = NULL;
+        if (result != ISC_R_SUCCESS)
+            return (result);
+    }
+    if (flight != NULL)
+        rrs = &flight->rrs;
+    rrset_init(rrs);
+
+    ctx.dbi = dbi;
+    ctx.lookup = lookup;
+    ctx.rrs = (cached || flight != NULL) ? rrs : NULL;
+    ctx.answered = ISC_FALSE;
+    ctx.apex = ISC_TF(strcasecmp(name, zone) == 0);
+
+    count = closest_names(zone, name, wild, names);
+    if (count > 1)
+        result = lookup_closest(&ctx, names, count, cached, gen);
+    else
+        result = db_lookup(dbi, ISC_TF(dbi->xfrprimary && ctx.apex), names, 1,
+                           lookup_row, &ctx);
+
+    if (cached && result == ISC_R_SUCCESS)
+        cache_put(key, keylen, rrs, rrs->minttl, dbi->stale, gen);
+    else if (cached && result == ISC_R_NOTFOUND)
+        cache_put(key, keylen, rrs, get_negttl(dbi), dbi->stale, gen);
+    else if (cached && dbi->stale > 0 && !ctx.answered)
+    {
+        stale = cache_stale(key, keylen, rrs, dbi->stalettl);
+        if (stale == ISC_R_SUCCESS || stale == ISC_R_NOTFOUND)
+        {
+            stats_increment(dbi, STAT_STALE);
+            result = stale;
+            if (result == ISC_R_SUCCESS)
+                result = rrset_replay(dbi, rrs->buf, rrs->len, lookup);
+        }
     }
+    if (flight != NULL)
+        flight_end(flight, result);
+    return (result);
+}
+
+/*
+ * This database operates on absolute names.
+ */
+static isc_result_t mysqldb_lookup(const char *zone, const char *name, void *dbdata,
+	                           dns_sdblookup_t *lookup)
+{
+    struct dbinfo *dbi = dbdata;
+    isc_time_t start;
+    isc_result_t result;
+
+    (void)isc_time_now(&start);
+    result = lookup_answer(dbi, zone, name, lookup);
+    stats_increment(dbi, STAT_LOOKUP);
+    if (result == ISC_R_NOTFOUND)
+        stats_increment(dbi, STAT_NOTFOUND);
+    else if (result != ISC_R_SUCCESS)
+        stats_increment(dbi, STAT_FAILURE);
+    if (result == ISC_R_TIMEDOUT)
+        stats_increment(dbi, STAT_TIMEOUT);
+    stats_time(dbi, TIMER_LOOKUP, &start);
+    return (result);
+}
+
+struct allnodesctx
+{
+    struct dbinfo *dbi;
+    dns_sdballnodes_t *allnodes;
+};
+
+static isc_result_t allnodes_row(void *arg, const char *name, dns_ttl_t ttl,
+                                 const char *type, const char *data,
+                                 const unsigned char *rdata, unsigned int rdlen)
+{
+    struct allnodesctx *ctx = arg;
 
-    while (! mysql_stmt_fetch(stmt))
-    {
 #ifdef MYSQLDB_DEBUG
-        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "type: %s ttl: %d data: %s", type, ttl, data);
+    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                  NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                  "name: %s, type: %s ttl: %d data: %s", name, type, ttl, data);
 #endif
-     	result = dns_sdb_putrr(lookup, type, ttl, data);
-	    if (result != ISC_R_SUCCESS) {
-            isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-                  "ERROR: unable to set RR result for bind");
-            mysql_stmt_free_result(stmt);
-	        return (ISC_R_FAILURE);
-     	}
-	}
-    mysql_stmt_free_result(stmt);
-    mysql_stmt_close(stmt);
-	return (ISC_R_SUCCESS);
+    if (put_namedrr(ctx->dbi, ctx->allnodes, name, type, ttl, data, rdata, rdlen) != ISC_R_SUCCESS)
+    {
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                      "ERROR: unable to set RR result for bind");
+        return (ISC_R_FAILURE);
+    }
+    return (ISC_R_SUCCESS);
 }
 
 /*
- * Issue an SQL query to return all nodes in the database and fill the
- * allnodes structure.
+ * Return all nodes in the zone and fill the allnodes structure.
  */
 static isc_result_t mysqldb_allnodes(const char *zone, void *dbdata, dns_sdballnodes_t *allnodes)
 {
-    isc_result_t result;
-    MYSQL_STMT *stmt;
-    MYSQL_BIND params[2], results[4];
     struct dbinfo *dbi = dbdata;
-    char name[DATA_LENGTH];
-    char type[TYPE_LENGTH];
-    char data[DATA_LENGTH];
-    unsigned long param_lengths[2], result_lengths[4];
-    dns_ttl_t ttl;
-    int result_count = 0;
-    char db_lookup_query[90];
-    UNUSED(zone);
-
-    memset(params, 0, sizeof (params)); /* zero the structures */
-    memset(results, 0, sizeof (results)); /* zero the structures */
-
-#ifdef MYSQLDB_DEBUG
-	isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "Arguments: tenant_id: %s domain_id: %s",
-                  dbi->tenant_id,
-                  dbi->domain_id);
-#endif
+    struct allnodesctx ctx;
+    isc_result_t result;
 
-    /* table name is still set by sprintf. Others are using bind variables 
-       to prevent injection issues */
-    sprintf(db_lookup_query, 
-            "SELECT ttl, name, type, data FROM %s WHERE tenant_id = ? AND domain_id = ? ORDER BY name",
-            dbi->table);
+    UNUSED(zone);
 
-    param_lengths[0] = strlen(dbi->tenant_id);
-    param_lengths[1] = strlen(dbi->domain_id);
+    stats_increment(dbi, STAT_ALLNODES);
+    if (dbi->snap != NULL)
+    {
+        stats_increment(dbi, STAT_SNAPHIT);
+        result = snapshot_allnodes(dbi, allnodes);
+    }
+    else
+    {
+        ctx.dbi = dbi;
+        ctx.allnodes = allnodes;
+        result = db_allnodes(dbi, dbi->xfrprimary, allnodes_row, &ctx);
+    }
+    if (result != ISC_R_SUCCESS && result != ISC_R_NOTFOUND)
+        stats_increment(dbi, STAT_FAILURE);
+    return (result);
+}
 
-    /* parameter buffer structs */
-    params[0].buffer_type    = MYSQL_TYPE_STRING;
-    params[0].buffer         = dbi->tenant_id;
-    params[0].buffer_length  = param_lengths[0]; 
-    params[0].is_null        = 0;
-    params[0].length         = &param_lengths[0]; 
+/*
+ * Parse an unsigned decimal option value.
+ */
+static isc_result_t parse_uint(const char *value, unsigned int *valp)
+{
+    char *end;
+    unsigned long val;
 
-    params[1].buffer_type    = MYSQL_TYPE_STRING;
-    params[1].buffer         = dbi->domain_id;
-    params[1].buffer_length  = param_lengths[1]; 
-    params[1].is_null        = 0;
-    params[1].length         = &param_lengths[1]; 
+    val = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || val > 0xffffffffUL)
+        return (ISC_R_RANGE);
+    *valp = (unsigned int) val;
+    return (ISC_R_SUCCESS);
+}
 
-    /* result buffer structs */
-    results[0].buffer_type    = MYSQL_TYPE_LONG;
-    results[0].buffer         = (char *) &ttl; 
-    results[0].is_unsigned    = 1;
-    results[0].is_null        = 0;
-    results[0].length         = &result_lengths[0]; 
+/*
+ * Parse a byte count with an optional k, m or g suffix.  A count too
+ * large for a size_t, before or after the suffix, is out of range.
+ */
+static isc_result_t parse_size(const char *value, size_t *sizep)
+{
+    char *end;
+    unsigned long val;
 
-    results[1].buffer_type    = MYSQL_TYPE_STRING;
-    results[1].buffer         = (char *) name; 
-    results[1].buffer_length  = DATA_LENGTH; 
-    results[1].is_null        = 0;
-    results[1].length         = &result_lengths[1]; 
+    errno = 0;
+    val = strtoul(value, &end, 10);
+    if (*value == '\0' || errno == ERANGE)
+        return (ISC_R_RANGE);
+    switch (tolower((unsigned char) *end))
+    {
+    case 'g':
+        if (val > ULONG_MAX / 1024)
+            return (ISC_R_RANGE);
+        val *= 1024;
+        /* FALLTHROUGH */
+    case 'm':
+        if (val > ULONG_MAX / 1024)
+            return (ISC_R_RANGE);
+        val *= 1024;
+        /* FALLTHROUGH */
+    case 'k':
+        if (val > ULONG_MAX / 1024)
+            return (ISC_R_RANGE);
+        val *= 1024;
+        end++;
+        break;
+    }
+    if (*end != '\0' || val > (size_t)-1)
+        return (ISC_R_RANGE);
+    *sizep = val;
+    return (ISC_R_SUCCESS);
+}
 
-    results[2].buffer_type    = MYSQL_TYPE_STRING;
-    results[2].buffer         = (char *) type; 
-    results[2].buffer_length  = TYPE_LENGTH; 
-    results[2].is_null        = 0;
-    results[2].length         = &result_lengths[2]; 
+/*
+ * Apply a "key=value" driver option from the zone's database line.
+ */
+static isc_result_t parse_option(const char *zone, struct dbinfo *dbi, const char *option)
+{
+    const char *value = strchr(option, '=') + 1;
+    size_t keylen = value - option - 1;
+    isc_result_t result = ISC_R_FAILURE;
 
-    results[3].buffer_type    = MYSQL_TYPE_STRING;
-    results[3].buffer         = (char *) data; 
-    results[3].buffer_length  = DATA_LENGTH; 
-    results[3].is_null        = 0;
-    results[3].length         = &result_lengths[3]; 
+#define OPTION_IS(key) (keylen == sizeof(key) - 1 && strncmp(option, key, keylen) == 0)
 
-    result = maybe_reconnect(dbi);
-    if (result != ISC_R_SUCCESS)
+    if (OPTION_IS("pool"))
     {
-	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "ERROR: (%d):%s - unable to (re)connect to the mysql://%s:<password>@%s/%s",
-                  mysql_stmt_errno(stmt),
-                  mysql_stmt_error(stmt),
-                  dbi->user,
-                  dbi->host,
-                  dbi->database);
-        return (result);
+        result = parse_uint(value, &dbi->poolsize);
+        if (result == ISC_R_SUCCESS && dbi->poolsize == 0)
+            result = ISC_R_RANGE;
     }
-
-    stmt = mysql_stmt_init(&dbi->conn);
-
-    if (!stmt)
+    else if (OPTION_IS("cache"))
+        result = parse_size(value, &dbi->cachesize);
+    else if (OPTION_IS("prefetch"))
+        result = parse_uint(value, &dbi->prefetch);
+    else if (OPTION_IS("pagesize"))
     {
-	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "Failure! Unable to initialize prepared statement handle");
-        return (ISC_R_FAILURE);
+        result = parse_uint(value, &dbi->pagesize);
+        if (result == ISC_R_SUCCESS && dbi->pagesize == 0)
+            result = ISC_R_RANGE;
     }
-    if (mysql_stmt_prepare(stmt, db_lookup_query, strlen(db_lookup_query)) != 0)
+    else if (OPTION_IS("batch"))
     {
-	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "ERROR: Unable to prepare statement: %s",
-                  db_lookup_query);
-        return (ISC_R_FAILURE);
-    } 
-    if (mysql_stmt_bind_param(stmt, params) != 0)
+        result = parse_uint(value, &dbi->batch);
+        if (result == ISC_R_SUCCESS && (dbi->batch == 0 || dbi->batch > BATCH_NAMES))
+            result = ISC_R_RANGE;
+    }
+    else if (OPTION_IS("batchwait"))
     {
-	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-			      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "ERROR: Unable to bind input params");
-        return (ISC_R_FAILURE);
-    } 
-    if (mysql_stmt_execute(stmt) != 0)
+        result = parse_uint(value, &dbi->batchwait);
+        if (result == ISC_R_SUCCESS && dbi->batchwait == 0)
+            result = ISC_R_RANGE;
+    }
+    else if (OPTION_IS("stale"))
     {
-	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "ERROR: Unable to execute statement!");
-        return (ISC_R_FAILURE);
+        result = parse_uint(value, &dbi->stale);
+        if (result == ISC_R_SUCCESS && dbi->stale == 0)
+            result = ISC_R_RANGE;
     }
-
-    if (mysql_stmt_bind_result(stmt, results) != 0)
+    else if (OPTION_IS("stalettl"))
+        result = parse_uint(value, &dbi->stalettl);
+    else if (OPTION_IS("breaker"))
     {
-	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "ERROR: Unable to bind result!");
-        return (ISC_R_FAILURE);
-    } 
-    if (mysql_stmt_store_result(stmt) != 0)
+        result = parse_uint(value, &dbi->breaker);
+        if (result == ISC_R_SUCCESS && dbi->breaker == 0)
+            result = ISC_R_RANGE;
+    }
+    else if (OPTION_IS("snapshot"))
     {
-        return (ISC_R_FAILURE);
+        result = parse_uint(value, &dbi->snaprefresh);
+        if (result == ISC_R_SUCCESS && dbi->snaprefresh == 0)
+            result = ISC_R_RANGE;
     }
-    result_count = mysql_stmt_num_rows(stmt); 
-    if (result_count == 0)
+    else if (OPTION_IS("keepalive"))
     {
-	    isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "no result(s)");
-        mysql_stmt_free_result(stmt);
-        return (ISC_R_NOTFOUND);
+        result = parse_uint(value, &dbi->keepalive);
+        if (result == ISC_R_SUCCESS && dbi->keepalive == 0)
+            result = ISC_R_RANGE;
+    }
+    else if (OPTION_IS("timeout"))
+    {
+        result = parse_uint(value, &dbi->timeout);
+        if (result == ISC_R_SUCCESS && dbi->timeout == 0)
+            result = ISC_R_RANGE;
+    }
+    else if (OPTION_IS("stats"))
+    {
+        result = parse_uint(value, &dbi->statsinterval);
+        if (result == ISC_R_SUCCESS && dbi->statsinterval == 0)
+            result = ISC_R_RANGE;
+    }
+    else if (OPTION_IS("zonetable") && *value != '\0' && dbi->zonetable == NULL)
+    {
+        dbi->zonetable = isc_mem_strdup(ns_g_mctx, value);
+        result = dbi->zonetable == NULL ? ISC_R_NOMEMORY : ISC_R_SUCCESS;
+    }
+    else if (OPTION_IS("changes") && *value != '\0' && dbi->changes == NULL)
+    {
+        dbi->changes = isc_mem_strdup(ns_g_mctx, value);
+        result = dbi->changes == NULL ? ISC_R_NOMEMORY : ISC_R_SUCCESS;
+    }
+    else if (OPTION_IS("replicas") && *value != '\0' && dbi->replicaspec == NULL)
+    {
+        dbi->replicaspec = isc_mem_strdup(ns_g_mctx, value);
+        result = dbi->replicaspec == NULL ? ISC_R_NOMEMORY : ISC_R_SUCCESS;
+    }
+    else if (OPTION_IS("balance"))
+    {
+        if (strcmp(value, "weighted") == 0 || strcmp(value, "latency") == 0)
+        {
+            dbi->leastlatency = ISC_TF(strcmp(value, "latency") == 0);
+            result = ISC_R_SUCCESS;
+        }
     }
+    else if (OPTION_IS("xfrprimary"))
+    {
+        if (strcmp(value, "yes") == 0 || strcmp(value, "no") == 0)
+        {
+            dbi->xfrprimary = ISC_TF(strcmp(value, "yes") == 0);
+            result = ISC_R_SUCCESS;
+        }
+    }
+#undef OPTION_IS
+
+    if (result != ISC_R_SUCCESS)
+        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                      NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                      "ERROR: zone %s: invalid mysqldb option '%s'",
+                      zone, option);
+    return (result);
+}
 
+/*
+ * Attach the pools of the replicas listed by "replicas=host[/weight],...",
+ * with the zone's user, password and database.  A weight is 1 if it is
+ * left out.
+ */
+static isc_result_t replicas_attach(const char *zone, struct dbinfo *dbi)
+{
+    char *host, *weight, *next;
+    unsigned int n;
+    isc_result_t result;
 
-    /* fetch rows from result set, build the record */
-    while (! mysql_stmt_fetch(stmt))
+    dbi->replicas = isc_mem_get(ns_g_mctx, MYSQLDB_MAX_REPLICAS * sizeof(struct replica));
+    if (dbi->replicas == NULL)
+        return (ISC_R_NOMEMORY);
+    memset(dbi->replicas, 0, MYSQLDB_MAX_REPLICAS * sizeof(struct replica));
+
+    for (host = dbi->replicaspec; host != NULL; host = next)
     {
-#ifdef MYSQLDB_DEBUG
-        isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-			      "name: %s, type: %s ttl: %d data: %s", name, type, ttl, data);
-#endif
-	    result = dns_sdb_putnamedrr(allnodes, name, type, ttl, data);
-	    if (result != ISC_R_SUCCESS)
+        if (dbi->nreplicas == MYSQLDB_MAX_REPLICAS)
         {
             isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
-	              NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
-                  "ERROR: unable to set RR result for bind");
-            mysql_stmt_free_result(stmt);
-            return (ISC_R_FAILURE);
-	    }
-    }   
-    mysql_stmt_free_result(stmt);
-    mysql_stmt_close(stmt);
+                          NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                          "ERROR: zone %s: more than %u replicas",
+                          zone, MYSQLDB_MAX_REPLICAS);
+            return (ISC_R_RANGE);
+        }
+        next = strchr(host, ',');
+        if (next != NULL)
+            *next++ = '\0';
+        n = 1;
+        weight = strchr(host, '/');
+        if (weight != NULL)
+        {
+            *weight++ = '\0';
+            if (parse_uint(weight, &n) != ISC_R_SUCCESS || n > MYSQLDB_MAX_WEIGHT)
+                n = 0;
+        }
+        if (*host == '\0' || n == 0)
+        {
+            isc_log_write(ns_g_lctx, NS_LOGCATEGORY_GENERAL,
+                          NS_LOGMODULE_MAIN, ISC_LOG_CRITICAL,
+                          "ERROR: zone %s: invalid replica '%s%s%s'",
+                          zone, host, weight != NULL ? "/" : "",
+                          weight != NULL ? weight : "");
+            return (ISC_R_RANGE);
+        }
+
+        result = pool_attach(dbi, host, &dbi->replicas[dbi->nreplicas].pool);
+        if (result != ISC_R_SUCCESS)
+            return (result);
+        dbi->replicas[dbi->nreplicas++].weight = n;
+    }
     return (ISC_R_SUCCESS);
 }
 
+static void replicas_detach(struct dbinfo *dbi)
+{
+    if (dbi->replicas == NULL)
+        return;
+    while (dbi->nreplicas > 0)
+        pool_detach(&dbi->replicas[--dbi->nreplicas].pool);
+    isc_mem_put(ns_g_mctx, dbi->replicas, MYSQLDB_MAX_REPLICAS * sizeof(struct replica));
+    dbi->replicas = NULL;
+}
+
 /*
  * Create a connection to the database and save any necessary information
  * in dbdata.
@@ -587,23 +5864,74 @@ static isc_result_t mysqldb_allnodes(const char *zone, void *dbdata, dns_sdballn
  * argv[4] (if present) is the name of the password to connect with
  * argv[5] (if present) is the domain_id, column specifying zone name (not record name) in the table 
  * argv[6] (if present) is the tenant_id, column specifying owner of records in the table 
+ *
+ * Arguments after the password that contain '=' are driver options and
+ * may appear anywhere after it.  With the zonetable option, domain_id
+ * and tenant_id may be left out and are looked up by the zone's name.
+ *
+ * The connection is leased from the pool shared by all zones on the same
+ * server, so this only opens a new connection for the first such zone.
  */
 static isc_result_t mysqldb_create(const char *zone, int argc, char **argv,
 	                           void *driverdata, void **dbdata)
 {
     struct dbinfo *dbi;
+    struct dbconn *dbc;
     isc_result_t result;
+    char *args[7];
+    int i, nargs;
 
-    UNUSED(zone);
     UNUSED(driverdata);
 
-    if (argc < 2)
-        return (ISC_R_FAILURE);
+    nargs = 0;
+    memset(args, 0, sizeof(args));
 
     dbi = isc_mem_get(ns_g_mctx, sizeof(struct dbinfo));
     if (dbi == NULL)
         return (ISC_R_NOMEMORY);
+    result = isc_mutex_init(&dbi->lock);
+    if (result != ISC_R_SUCCESS)
+    {
+        isc_mem_put(ns_g_mctx, dbi, sizeof(struct dbinfo));
+        return (result);
+    }
+    dbi->stats = NULL;
+    result = isc_stats_create(ns_g_mctx, &dbi->stats, STATS_COUNTERS);
+    if (result != ISC_R_SUCCESS)
+    {
+        DESTROYLOCK(&dbi->lock);
+        isc_mem_put(ns_g_mctx, dbi, sizeof(struct dbinfo));
+        return (result);
+    }
         
+    dbi->pool      = NULL;
+    dbi->poolsize  = MYSQLDB_POOL_SIZE;
+    dbi->keepalive = 0;
+    dbi->timeout   = 0;
+    dbi->cachesize = 0;
+    dbi->negttl    = 0;
+    dbi->prefetch  = 0;
+    dbi->pagesize  = 0;
+    dbi->batch     = 0;
+    dbi->batchwait = MYSQLDB_BATCH_WAIT;
+    dbi->stale     = 0;
+    dbi->stalettl  = MYSQLDB_STALE_TTL;
+    dbi->breaker   = 0;
+    dbi->snaprefresh = 0;
+    dbi->snap      = NULL;
+    dbi->statsinterval = 0;
+    dbi->next      = NULL;
+    dbi->maintrefs = 0;
+    dbi->catalog   = NULL;
+    dbi->zonetable = NULL;
+    dbi->feed      = NULL;
+    dbi->changes   = NULL;
+    dbi->replicas  = NULL;
+    dbi->nreplicas = 0;
+    dbi->replicaspec = NULL;
+    dbi->leastlatency = ISC_FALSE;
+    dbi->xfrprimary = ISC_FALSE;
+    dbi->zone      = NULL;
     dbi->database  = NULL;
     dbi->table     = NULL;
     dbi->host      = NULL;
@@ -612,6 +5940,24 @@ static isc_result_t mysqldb_create(const char *zone, int argc, char **argv,
     dbi->domain_id = NULL;
     dbi->tenant_id = NULL;
 
+    for (i = 0; i < argc; i++)
+    {
+        if (nargs >= 5 && strchr(argv[i], '=') != NULL)
+        {
+            result = parse_option(zone, dbi, argv[i]);
+            if (result != ISC_R_SUCCESS)
+                goto cleanup;
+        }
+        else if (nargs < 7)
+            args[nargs++] = argv[i];
+    }
+
+    if (nargs < 2)
+    {
+        result = ISC_R_FAILURE;
+        goto cleanup;
+    }
+
 #define STRDUP_OR_FAIL(target, source)			\
     do                                                  \
     {							\
@@ -623,23 +5969,75 @@ static isc_result_t mysqldb_create(const char *zone, int argc, char **argv,
 	}						\
     } while (0);
 
-    STRDUP_OR_FAIL(dbi->database,  argv[0]);
-    STRDUP_OR_FAIL(dbi->table,     argv[1]);
-    if (argc > 2)
-        STRDUP_OR_FAIL(dbi->host, argv[2]);
-    if (argc > 3)
-        STRDUP_OR_FAIL(dbi->user, argv[3]);
-    if (argc > 4)
-        STRDUP_OR_FAIL(dbi->passwd, argv[4]);
-    if (argc > 5)
-        STRDUP_OR_FAIL(dbi->domain_id, argv[5]);
-    if (argc > 6)
-        STRDUP_OR_FAIL(dbi->tenant_id, argv[6]);
-
-    result = db_connect(dbi);
+    STRDUP_OR_FAIL(dbi->zone,      zone);
+    STRDUP_OR_FAIL(dbi->database,  args[0]);
+    STRDUP_OR_FAIL(dbi->table,     args[1]);
+    if (nargs > 2)
+        STRDUP_OR_FAIL(dbi->host, args[2]);
+    if (nargs > 3)
+        STRDUP_OR_FAIL(dbi->user, args[3]);
+    if (nargs > 4)
+        STRDUP_OR_FAIL(dbi->passwd, args[4]);
+    if (nargs > 6)
+    {
+        STRDUP_OR_FAIL(dbi->domain_id, args[5]);
+        STRDUP_OR_FAIL(dbi->tenant_id, args[6]);
+    }
+    else if (nargs > 5)
+        STRDUP_OR_FAIL(dbi->domain_id, args[5]);
+
+    if (dbi->cachesize > 0)
+    {
+        result = cache_setsize(dbi->cachesize);
+        if (result != ISC_R_SUCCESS)
+            goto cleanup;
+    }
+
+    result = pool_attach(dbi, dbi->host, &dbi->pool);
     if (result != ISC_R_SUCCESS)
 	goto cleanup;
 
+    if (dbi->replicaspec != NULL)
+    {
+        result = replicas_attach(zone, dbi);
+        if (result != ISC_R_SUCCESS)
+            goto cleanup;
+    }
+
+    if (dbi->changes != NULL)
+    {
+        result = changes_attach(dbi);
+        if (result != ISC_R_SUCCESS)
+            goto cleanup;
+    }
+
+    if (dbi->zonetable != NULL && nargs < 6)
+    {
+        /* reading the zone table has shown the server to be reachable */
+        result = catalog_attach(dbi);
+        if (result != ISC_R_SUCCESS)
+            goto cleanup;
+    }
+    else
+    {
+        /* make sure the server is reachable before accepting the zone */
+        result = pool_lease(dbi->pool, NULL, &dbc);
+        if (result != ISC_R_SUCCESS)
+            goto cleanup;
+        pool_return(dbc);
+    }
+
+    if (dbi->snaprefresh > 0)
+    {
+        result = snapshot_attach(dbi);
+        if (result != ISC_R_SUCCESS)
+            goto cleanup;
+    }
+
+    result = maint_attach(dbi);
+    if (result != ISC_R_SUCCESS)
+        goto cleanup;
+
     *dbdata = dbi;
     return (ISC_R_SUCCESS);
 
@@ -649,7 +6047,7 @@ cleanup:
 }
 
 /*
- * Close the connection to the database.
+ * Release the zone's hold on its connection pool.
  */
 static void mysqldb_destroy(const char *zone, void *driverdata, void **dbdata)
 {
@@ -658,7 +6056,14 @@ static void mysqldb_destroy(const char *zone, void *driverdata, void **dbdata)
     UNUSED(zone);
     UNUSED(driverdata);
 
-    mysql_close(&dbi->conn);
+    maint_detach(dbi);
+    changes_detach(dbi);
+    snapshot_detach(dbi);
+    catalog_detach(dbi);
+    replicas_detach(dbi);
+    pool_detach(&dbi->pool);
+    if (dbi->zone != NULL)
+        isc_mem_free(ns_g_mctx, dbi->zone);
     if (dbi->database != NULL)
         isc_mem_free(ns_g_mctx, dbi->database);
     if (dbi->table != NULL)
@@ -673,8 +6078,14 @@ static void mysqldb_destroy(const char *zone, void *driverdata, void **dbdata)
         isc_mem_free(ns_g_mctx, dbi->domain_id);
     if (dbi->tenant_id != NULL)
         isc_mem_free(ns_g_mctx, dbi->tenant_id);
-    if (dbi->database != NULL)
-        isc_mem_free(ns_g_mctx, dbi->database);
+    if (dbi->zonetable != NULL)
+        isc_mem_free(ns_g_mctx, dbi->zonetable);
+    if (dbi->changes != NULL)
+        isc_mem_free(ns_g_mctx, dbi->changes);
+    if (dbi->replicaspec != NULL)
+        isc_mem_free(ns_g_mctx, dbi->replicaspec);
+    isc_stats_detach(&dbi->stats);
+    DESTROYLOCK(&dbi->lock);
     isc_mem_put(ns_g_mctx, dbi, sizeof(struct dbinfo));
 }
 
@@ -693,13 +6104,73 @@ static dns_sdbmethods_t mysqldb_methods = {
 
 /*
  * Wrapper around dns_sdb_register().
+ *
+ * Every connection is leased to one thread at a time and all shared
+ * driver state is locked, so the driver registers as thread-safe and
+ * named may run lookups concurrently, up to each pool's size.
  */
 isc_result_t mysqldb_init(void)
 {
     unsigned int flags;
-    flags = 0;
-    return (dns_sdb_register("mysqldb", &mysqldb_methods, NULL, flags,
-            ns_g_mctx, &mysqldb));
+    isc_result_t result;
+
+    if (mysql_library_init(0, NULL, NULL) != 0)
+        return (ISC_R_FAILURE);
+
+    result = isc_mutex_init(&poollock);
+    if (result != ISC_R_SUCCESS)
+    {
+        mysql_library_end();
+        return (result);
+    }
+    result = cache_init();
+    if (result != ISC_R_SUCCESS)
+    {
+        DESTROYLOCK(&poollock);
+        mysql_library_end();
+        return (result);
+    }
+    result = flight_init();
+    if (result != ISC_R_SUCCESS)
+    {
+        cache_destroy();
+        DESTROYLOCK(&poollock);
+        mysql_library_end();
+        return (result);
+    }
+    result = isc_stats_create(ns_g_mctx, &driverstats, STATS_COUNTERS);
+    if (result != ISC_R_SUCCESS)
+    {
+        flight_destroy();
+        cache_destroy();
+        DESTROYLOCK(&poollock);
+        mysql_library_end();
+        return (result);
+    }
+    RUNTIME_CHECK(isc_mutex_init(&snapsort_lock) == ISC_R_SUCCESS);
+    RUNTIME_CHECK(isc_mutex_init(&catalog_lock) == ISC_R_SUCCESS);
+    RUNTIME_CHECK(isc_mutex_init(&maint_lock) == ISC_R_SUCCESS);
+    RUNTIME_CHECK(isc_condition_init(&maint_wakeup) == ISC_R_SUCCESS);
+    RUNTIME_CHECK(isc_condition_init(&maint_idle) == ISC_R_SUCCESS);
+    maint_exiting = ISC_FALSE;
+
+    flags = DNS_SDBFLAG_THREADSAFE;
+    result = dns_sdb_register("mysqldb", &mysqldb_methods, NULL, flags,
+                              ns_g_mctx, &mysqldb);
+    if (result != ISC_R_SUCCESS)
+    {
+        (void)isc_condition_destroy(&maint_idle);
+        (void)isc_condition_destroy(&maint_wakeup);
+        DESTROYLOCK(&maint_lock);
+        DESTROYLOCK(&catalog_lock);
+        DESTROYLOCK(&snapsort_lock);
+        isc_stats_detach(&driverstats);
+        flight_destroy();
+        cache_destroy();
+        DESTROYLOCK(&poollock);
+        mysql_library_end();
+    }
+    return (result);
 }
 
 /*
@@ -708,5 +6179,37 @@ isc_result_t mysqldb_init(void)
 void mysqldb_clear(void)
 {
     if (mysqldb != NULL)
+    {
         dns_sdb_unregister(&mysqldb);
+        maint_stop();
+        (void)isc_condition_destroy(&maint_idle);
+        (void)isc_condition_destroy(&maint_wakeup);
+        DESTROYLOCK(&maint_lock);
+        DESTROYLOCK(&catalog_lock);
+        DESTROYLOCK(&snapsort_lock);
+        isc_stats_detach(&driverstats);
+        flight_destroy();
+        cache_destroy();
+        DESTROYLOCK(&poollock);
+        mysql_library_end();
+    }
+}
+
+/*
+ * Log the driver-wide counters and those of every zone.  May be called
+ * at any time between mysqldb_init() and mysqldb_clear(), for instance
+ * from named's statistics dump.
+ */
+void mysqldb_dumpstats(void)
+{
+    struct dbinfo *dbi;
+
+    if (mysqldb == NULL)
+        return;
+
+    LOCK(&maint_lock);
+    stats_log("driver", driverstats);
+    for (dbi = zones; dbi != NULL; dbi = dbi->next)
+        zone_stats_log(dbi);
+    UNLOCK(&maint_lock);
 }
@@ -27,3 +27,5 @@ isc_result_t mysqldb_init(void);
 
 void mysqldb_clear(void);
 
+void mysqldb_dumpstats(void);
+
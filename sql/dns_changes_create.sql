@@ -0,0 +1,56 @@
+-- Optional: a log of edits to dns_domains, appended to by the triggers
+-- below.  Zones configured with changes=dns_changes poll it and evict
+-- cached answers for the names that changed, so the answer cache and
+-- snapshots follow edits within a second or two.
+--
+-- The driver only reads rows newer than the ones it has seen, so old rows
+-- may be pruned at any time, e.g. from an event:
+--   DELETE FROM dns_changes WHERE changed < NOW() - INTERVAL 1 DAY;
+-- Do not truncate the table: that restarts the ids.
+DROP TABLE IF EXISTS `dns_changes`;
+CREATE TABLE `dns_changes` (
+  `id` bigint unsigned NOT NULL auto_increment,
+  `tenant_id` char(36) DEFAULT NULL,
+  `domain_id` char(36) NOT NULL DEFAULT '',
+  `name` varchar(255) DEFAULT NULL,
+  `changed` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,
+  PRIMARY KEY (id),
+  KEY (changed)
+)
+ENGINE=InnoDB DEFAULT CHARSET utf8;
+
+DROP TRIGGER IF EXISTS `dns_domains_insert`;
+DROP TRIGGER IF EXISTS `dns_domains_update`;
+DROP TRIGGER IF EXISTS `dns_domains_delete`;
+
+DELIMITER //
+
+CREATE TRIGGER `dns_domains_insert` AFTER INSERT ON `dns_domains`
+FOR EACH ROW
+BEGIN
+  INSERT INTO dns_changes (tenant_id, domain_id, name)
+    VALUES (NEW.tenant_id, NEW.domain_id, NEW.name);
+END//
+
+-- a record moved to another name changes both names
+CREATE TRIGGER `dns_domains_update` AFTER UPDATE ON `dns_domains`
+FOR EACH ROW
+BEGIN
+  INSERT INTO dns_changes (tenant_id, domain_id, name)
+    VALUES (OLD.tenant_id, OLD.domain_id, OLD.name);
+  IF NOT (NEW.tenant_id <=> OLD.tenant_id AND
+          NEW.domain_id <=> OLD.domain_id AND
+          NEW.name <=> OLD.name) THEN
+    INSERT INTO dns_changes (tenant_id, domain_id, name)
+      VALUES (NEW.tenant_id, NEW.domain_id, NEW.name);
+  END IF;
+END//
+
+CREATE TRIGGER `dns_domains_delete` AFTER DELETE ON `dns_domains`
+FOR EACH ROW
+BEGIN
+  INSERT INTO dns_changes (tenant_id, domain_id, name)
+    VALUES (OLD.tenant_id, OLD.domain_id, OLD.name);
+END//
+
+DELIMITER ;
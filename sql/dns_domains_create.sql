@@ -1,3 +1,5 @@
+-- dns_domains at schema version 2; see dns_domains_v2.sql for what lname
+-- and its key are for, and for migrating a table created at version 1.
 DROP TABLE IF EXISTS `dns_domains`;
 CREATE TABLE `dns_domains` (
   `id` int unsigned NOT NULL auto_increment,
@@ -12,9 +14,19 @@ CREATE TABLE `dns_domains` (
               'RP', 'SIG', 'SOA', 'SPF', 'SRV', 'SSHFP', 'TA', 'TKEY',
               'TLSA', 'TSIG', 'TXT', 'AXFR', 'IXFR', 'OPT' ) DEFAULT NULL,
   `data` varchar(255) DEFAULT NULL,
+  `lname` varchar(255) CHARACTER SET ascii COLLATE ascii_bin
+    AS (CONVERT(LOWER(name) USING ascii)) STORED,
   PRIMARY KEY (id, tenant_id),
-  KEY (tenant_id, domain_id, name(36))
+  KEY `lname` (tenant_id, domain_id, lname, type, ttl, data)
 )
 ENGINE=InnoDB DEFAULT CHARSET utf8 
 PARTITION BY KEY(tenant_id) PARTITIONS 100;
 
+CREATE TABLE IF NOT EXISTS `dns_schema_version` (
+  `version` int unsigned NOT NULL,
+  `applied` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,
+  PRIMARY KEY (version)
+)
+ENGINE=InnoDB DEFAULT CHARSET utf8;
+
+INSERT IGNORE INTO `dns_schema_version` (version) VALUES (1), (2);
@@ -0,0 +1,10 @@
+-- Optional: index every zone's records in full (name, id) order, so zone
+-- transfers with pagesize=N read each page straight off the index instead
+-- of sorting the zone's rows for every page.  Neither the name key of
+-- schema version 1 (a 36-character prefix) nor the lname key of version 2
+-- (lowercased) gives that order.  With the utf8 character set of
+-- dns_domains_create.sql the key fits InnoDB's default limits; with
+-- utf8mb4 it needs large index prefixes, the default from MySQL 5.7.7 and
+-- MariaDB 10.2.2.
+ALTER TABLE `dns_domains`
+  ADD KEY `tenant_domain_name_id` (`tenant_id`, `domain_id`, `name`, `id`);
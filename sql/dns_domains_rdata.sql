@@ -0,0 +1,6 @@
+-- Optional: store each record's rdata in uncompressed wire format next to
+-- its text.  When the column is present the driver hands it to BIND as is,
+-- instead of BIND parsing `data` on every answer.  Rows where it is NULL
+-- are still answered from `data`.  zonetodb -m fills it in on import.
+ALTER TABLE `dns_domains`
+  ADD COLUMN `rdata` varbinary(1024) DEFAULT NULL;
@@ -0,0 +1,51 @@
+-- Schema version 2 of dns_domains: migrates a table created by an earlier
+-- dns_domains_create.sql, which is version 1.
+--
+-- lname holds each record's name lowercased, in the ascii character set
+-- with binary collation, and the lname key covers every column a lookup
+-- reads.  The driver lowercases the names it looks up and matches them
+-- against lname byte for byte, and InnoDB answers the lookup from the key
+-- alone.  With version 1, name is matched through the 36-character prefix
+-- key, which cannot distinguish longer names, and every row found costs a
+-- second read from the clustered index for ttl, type and data.
+--
+-- lname is a stored generated column, so nothing that writes the table
+-- needs to change; it needs MySQL 5.7 or MariaDB 10.2.  DNS names are
+-- ASCII; names written as UTF-8 must be converted to punycode first.
+-- The driver checks for the column when a connection prepares its
+-- statements, so connections opened after the migration use it, and all
+-- of them do once named is restarted.  The ALTER rebuilds the table.
+--
+-- If the table has the rdata column (dns_domains_rdata.sql), add rdata to
+-- the end of the lname key so rdata lookups are covered as well; a key
+-- that long needs InnoDB's large index prefixes, the default from MySQL
+-- 5.7.7 and MariaDB 10.2.2.
+--
+-- To compare, run before and after migrating:
+--   EXPLAIN SELECT ttl, type, data FROM dns_domains
+--     WHERE tenant_id = 'T' AND domain_id = 'D' AND name = UPPER('www.example1.com');
+--   EXPLAIN SELECT ttl, type, data FROM dns_domains
+--     WHERE tenant_id = 'T' AND domain_id = 'D' AND lname = 'www.example1.com';
+-- The second should show key lname and "Using index" in Extra.  For the
+-- effect on lookup latency, run bench/mysqldb_bench against the table
+-- before and after (see "BENCHMARK" in the README).
+CREATE TABLE IF NOT EXISTS `dns_schema_version` (
+  `version` int unsigned NOT NULL,
+  `applied` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,
+  PRIMARY KEY (version)
+)
+ENGINE=InnoDB DEFAULT CHARSET utf8;
+
+INSERT IGNORE INTO `dns_schema_version` (version) VALUES (1);
+
+ALTER TABLE `dns_domains`
+  ADD COLUMN `lname` varchar(255) CHARACTER SET ascii COLLATE ascii_bin
+    AS (CONVERT(LOWER(name) USING ascii)) STORED,
+  ADD KEY `lname` (tenant_id, domain_id, lname, type, ttl, data);
+
+INSERT INTO `dns_schema_version` (version) VALUES (2);
+
+-- Once every named reading the table runs a driver that uses lname, the
+-- version 1 key on name is no longer used for lookups, or for preloading
+-- zone apexes with zonetable=, and can be dropped:
+--   ALTER TABLE `dns_domains` DROP KEY `tenant_id`;
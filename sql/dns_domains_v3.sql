@@ -0,0 +1,103 @@
+-- Schema version 3 of dns_domains: migrates a table at version 2 (see
+-- dns_domains_v2.sql).  Optional; the driver works with either.
+--
+-- rname holds each record's name lowercased with its labels reversed and
+-- separated by spaces: www.example.com is "com example www".  Compared
+-- byte for byte, rnames sort in DNS canonical order (RFC 4034, section
+-- 6.1): a zone's apex first, then each name followed by the names below
+-- it, and sibling labels in octet order.  A space sorts below every other
+-- character a name can hold in text form, which is why it separates the
+-- labels rather than a dot: with dots, a-b.example.com ("com.example.a-b")
+-- would sort between a.example.com and the names below it, since '-' is
+-- below '.'.  Characters written as \DDD escapes sort by their escapes.
+--
+-- With the rname key, a subtree or the delegations below a name are a
+-- range scan of the key, e.g. everything below sub.example.com:
+--   SELECT name, type, data FROM dns_domains
+--     WHERE tenant_id = 'T' AND domain_id = 'D'
+--       AND rname > 'com example sub ' AND rname < 'com example sub!'
+--     ORDER BY rname;
+-- or the NS records at or above www.sub.example.com, the closest first:
+--   SELECT name, data FROM dns_domains
+--     WHERE tenant_id = 'T' AND domain_id = 'D' AND type = 'NS'
+--       AND rname IN ('com example sub www', 'com example sub', 'com example')
+--     ORDER BY rname DESC;
+-- The driver reads zone transfers in rname order when the column exists,
+-- straight off the key and so without sorting the zone.
+--
+-- The column is kept by the triggers below, using dns_rname(), since a
+-- generated column cannot call a stored function.  zonetodb fills it in
+-- itself, so bulk imports do not pay for the function; the triggers only
+-- fill in an rname not given.
+CREATE TABLE IF NOT EXISTS `dns_schema_version` (
+  `version` int unsigned NOT NULL,
+  `applied` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,
+  PRIMARY KEY (version)
+)
+ENGINE=InnoDB DEFAULT CHARSET utf8;
+
+ALTER TABLE `dns_domains`
+  ADD COLUMN `rname` varchar(255) CHARACTER SET ascii COLLATE ascii_bin DEFAULT NULL,
+  ADD KEY `rname` (tenant_id, domain_id, rname);
+
+DROP FUNCTION IF EXISTS `dns_rname`;
+DROP TRIGGER IF EXISTS `dns_domains_rname_insert`;
+DROP TRIGGER IF EXISTS `dns_domains_rname_update`;
+
+DELIMITER //
+
+CREATE FUNCTION `dns_rname`(n varchar(255)) RETURNS varchar(255) CHARACTER SET ascii
+  DETERMINISTIC NO SQL
+BEGIN
+  DECLARE r varchar(255) DEFAULT '';
+  DECLARE label varchar(255) DEFAULT '';
+  DECLARE c char(1);
+  DECLARE i int DEFAULT 1;
+
+  IF n IS NULL THEN
+    RETURN NULL;
+  END IF;
+  SET n = LOWER(n);
+  WHILE i <= CHAR_LENGTH(n) DO
+    SET c = SUBSTRING(n, i, 1);
+    IF c = '\\' THEN
+      -- an escaped character, a dot included, is part of the label
+      SET label = CONCAT(label, SUBSTRING(n, i, 2));
+      SET i = i + 2;
+    ELSEIF c = '.' THEN
+      SET r = IF(r = '', label, CONCAT(label, ' ', r));
+      SET label = '';
+      SET i = i + 1;
+    ELSE
+      SET label = CONCAT(label, c);
+      SET i = i + 1;
+    END IF;
+  END WHILE;
+  IF label <> '' THEN
+    SET r = IF(r = '', label, CONCAT(label, ' ', r));
+  END IF;
+  RETURN r;
+END//
+
+CREATE TRIGGER `dns_domains_rname_insert` BEFORE INSERT ON `dns_domains`
+FOR EACH ROW
+BEGIN
+  IF NEW.rname IS NULL THEN
+    SET NEW.rname = dns_rname(NEW.name);
+  END IF;
+END//
+
+-- a record renamed without a new rname gets one
+CREATE TRIGGER `dns_domains_rname_update` BEFORE UPDATE ON `dns_domains`
+FOR EACH ROW
+BEGIN
+  IF NOT (NEW.name <=> OLD.name) AND NEW.rname <=> OLD.rname THEN
+    SET NEW.rname = dns_rname(NEW.name);
+  END IF;
+END//
+
+DELIMITER ;
+
+UPDATE `dns_domains` SET rname = dns_rname(name);
+
+INSERT INTO `dns_schema_version` (version) VALUES (3);
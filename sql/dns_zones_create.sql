@@ -0,0 +1,12 @@
+-- Optional: one row per zone, mapping its name to the tenant_id and
+-- domain_id of its records in dns_domains.  Zones configured with
+-- zonetable=dns_zones are looked up here instead of naming the ids on
+-- their database line.  The driver reads the whole table at startup.
+DROP TABLE IF EXISTS `dns_zones`;
+CREATE TABLE `dns_zones` (
+  `name` varchar(255) NOT NULL,
+  `tenant_id` char(36) NOT NULL,
+  `domain_id` char(36) NOT NULL,
+  PRIMARY KEY (name)
+)
+ENGINE=InnoDB DEFAULT CHARSET utf8;
@@ -20,13 +20,19 @@
  *
  * $Id: zonetodb.c,v 1.1.1.1 2004/03/10 04:15:40 alteridem Exp $ 
  */
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <isc/buffer.h>
 #include <isc/mem.h>
+#include <isc/mutex.h>
 #include <isc/print.h>
 #include <isc/result.h>
+#include <isc/thread.h>
+#include <isc/time.h>
+#include <isc/util.h>
 
 #include <dns/db.h>
 #include <dns/dbiterator.h>
@@ -56,15 +62,111 @@
  *
  * gcc -g `isc-config.sh --cflags isc dns` -I'/usr/include/mysql' -c zonetodb.c
  * gcc -g -o zonetodb zonetodb.o `isc-config.sh --libs isc dns` -L'/usr/lib/mysql' -lmysqlclient -lz -lcrypt -lnsl -lm -lc -lnss_files -lnss_dns -lresolv -lc -lnss_files -lnss_dns -lresolv
+ *
+ * Records are written as multi-row INSERTs of up to -b rows each, and
+ * committed every -t rows, rather than one autocommitted INSERT per
+ * record.  The import rate is reported at the end.
+ *
+ * With -m, zonetodb instead imports every zone listed in a manifest file
+ * into an existing table using the driver's schema (see
+ * sql/dns_domains_create.sql).  Each manifest line holds
+ *
+ *     origin file tenant_id domain_id
+ *
+ * separated by whitespace; blank lines and text after a '#' are ignored.
+ * The zones are shared out to -j worker threads, each with its own
+ * database connection.  A zone's existing rows are deleted and its new
+ * rows inserted in one transaction, so a zone that fails to load or
+ * insert is rolled back whole and the remaining zones still go ahead.
+ * If the table has the optional rdata column (sql/dns_domains_rdata.sql)
+ * it is filled with each record's wire-format rdata, and if it has the
+ * rname column of schema version 3 (sql/dns_domains_v3.sql) with each
+ * record's name reversed, rather than leaving that to the table's trigger.
+ */
+
+#define DEFAULT_BATCH 1000
+#define DEFAULT_TXN 50000
+#define DEFAULT_THREADS 4
+#define MAX_THREADS 64
+
+/*
+ * Multi-row INSERTs are also flushed once they reach this many bytes, to
+ * stay well below the server's max_allowed_packet.
+ */
+#define MAX_STATEMENT (1024 * 1024)
+
+/*
+ * The size of the rdata column; longer rdata is left NULL and the driver
+ * falls back to the text.
  */
+#define MAX_RDATA 1024
 
-MYSQL conn;
+/*
+ * The state of one import: its connection and the INSERT being built.
+ * When tenant_id is set rows are written to the driver's schema,
+ * otherwise to the (name, ttl, rdtype, rdata) table created by a single
+ * zone import.
+ */
+struct importer
+{
+    MYSQL conn;
+    const char *table;
+    const char *tenant_id;      /* quoted */
+    const char *domain_id;      /* quoted */
+    isc_boolean_t rdata;        /* the table has the rdata column */
+    isc_boolean_t rname;        /* the table has the rname column */
+    unsigned int batch;         /* rows per INSERT */
+    unsigned int txn;           /* rows per transaction */
+    isc_boolean_t verbose;
+    char *stmt;
+    size_t len;
+    size_t size;
+    unsigned int pending;       /* rows in stmt */
+    unsigned int uncommitted;   /* rows sent since the last COMMIT */
+    unsigned long total;
+};
+
+/*
+ * One manifest line.  tenant_id and domain_id are stored quoted.
+ */
+struct zoneentry
+{
+    char *origin;
+    char *file;
+    char *tenant_id;
+    char *domain_id;
+};
+
+/*
+ * A manifest import, shared by the worker threads.  "lock" protects
+ * next, done, failed and records.
+ */
+struct manifest
+{
+    isc_mutex_t lock;
+    struct zoneentry *zones;
+    unsigned int count;
+    unsigned int next;          /* next zone to hand out */
+    unsigned int done;
+    unsigned int failed;
+    unsigned long records;
+    isc_time_t start;
+    isc_mem_t *mctx;
+    const char *host;
+    const char *user;
+    const char *password;
+    const char *database;
+    const char *table;
+    unsigned int batch;
+    isc_boolean_t verbose;
+};
+
+struct importer imp;
 char *dbname, *dbtable;
-char str[10240];
 
 void closeandexit(int status)
 {
-    mysql_close(&conn);
+    mysql_close(&imp.conn);
     exit(status);
 }
 
@@ -94,176 +196,733 @@ static void quotestring(const char *source, char *dest)
     *dest++ = 0;
 }
 
-void addrdata(dns_name_t *name, dns_ttl_t ttl, dns_rdata_t *rdata)
+/*
+ * Write a name in text form, without its final dot, as the rname column
+ * holds it: lowercased, with its labels in reverse order separated by
+ * spaces, so that names sort in DNS canonical order.  Escaped characters
+ * are kept with their escapes.  This must agree with the dns_rname()
+ * function of sql/dns_domains_v3.sql.  "dest" must be an array of at
+ * least size strlen(source) + 1.
+ */
+static void reversename(const char *source, char *dest)
+{
+    const char *start[DNS_NAME_MAXLABELS];
+    size_t length[DNS_NAME_MAXLABELS];
+    unsigned int count = 0, i;
+    const char *p = source;
+
+    while (*p != 0 && count < DNS_NAME_MAXLABELS)
+    {
+        start[count] = p;
+        while (*p != 0 && *p != '.')
+            p += (p[0] == '\\' && p[1] != 0) ? 2 : 1;
+        length[count] = p - start[count];
+        count++;
+        if (*p == '.')
+            p++;
+    }
+    for (i = count; i > 0; i--)
+    {
+        for (p = start[i - 1]; p < start[i - 1] + length[i - 1]; p++)
+            *dest++ = (*p >= 'A' && *p <= 'Z') ? *p - 'A' + 'a' : *p;
+        if (i > 1)
+            *dest++ = ' ';
+    }
+    *dest = 0;
+}
+
+/*
+ * Write rdata as a hexadecimal literal, or NULL if it is too long for the
+ * column.  "dest" must be an array of at least size 2*MAX_RDATA + 4.
+ */
+static void hexrdata(dns_rdata_t *rdata, char *dest)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    isc_region_t r;
+    unsigned int i;
+
+    dns_rdata_toregion(rdata, &r);
+    if (r.length > MAX_RDATA)
+    {
+        strcpy(dest, "NULL");
+        return;
+    }
+    *dest++ = 'X';
+    *dest++ = '\'';
+    for (i = 0; i < r.length; i++)
+    {
+        *dest++ = hex[r.base[i] >> 4];
+        *dest++ = hex[r.base[i] & 0x0f];
+    }
+    *dest++ = '\'';
+    *dest = 0;
+}
+
+static double elapsed(const isc_time_t *start)
+{
+    isc_time_t now;
+
+    RUNTIME_CHECK(isc_time_now(&now) == ISC_R_SUCCESS);
+    return (isc_time_microdiff(&now, start) / 1000000.0);
+}
+
+/*
+ * Append text to the INSERT being built, growing the buffer as needed.
+ */
+static isc_result_t append(struct importer *im, const char *text)
+{
+    size_t len = strlen(text);
+    size_t size;
+    char *stmt;
+
+    if (im->len + len + 1 > im->size)
+    {
+        size = (im->size == 0) ? 65536 : im->size;
+        while (size < im->len + len + 1)
+            size *= 2;
+        stmt = realloc(im->stmt, size);
+        if (stmt == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            return (ISC_R_NOMEMORY);
+        }
+        im->stmt = stmt;
+        im->size = size;
+    }
+    memcpy(im->stmt + im->len, text, len + 1);
+    im->len += len;
+    return (ISC_R_SUCCESS);
+}
+
+static isc_result_t query(struct importer *im, const char *sql, const char *what)
+{
+    if (im->verbose)
+        printf("%s\n", sql);
+    if (mysql_real_query(&im->conn, sql, strlen(sql)) != 0)
+    {
+        fprintf(stderr, "%s command failed: %s\n", what, mysql_error(&im->conn));
+        return (ISC_R_FAILURE);
+    }
+    return (ISC_R_SUCCESS);
+}
+
+/*
+ * Send the pending rows, committing if the transaction is large enough
+ * or "commit" is set.
+ */
+static isc_result_t flush(struct importer *im, isc_boolean_t commit)
+{
+    isc_result_t result;
+
+    if (im->pending > 0)
+    {
+        result = query(im, im->stmt, "INSERT INTO");
+        if (result != ISC_R_SUCCESS)
+            return (result);
+        im->uncommitted += im->pending;
+        im->total += im->pending;
+        im->pending = 0;
+        im->len = 0;
+    }
+    if (im->uncommitted > 0 && (commit || im->uncommitted >= im->txn))
+    {
+        result = query(im, "COMMIT", "COMMIT");
+        if (result != ISC_R_SUCCESS)
+            return (result);
+        im->uncommitted = 0;
+    }
+    return (ISC_R_SUCCESS);
+}
+
+static isc_result_t
+addrdata(struct importer *im, dns_name_t *name, dns_ttl_t ttl, dns_rdata_t *rdata)
 {
     unsigned char namearray[DNS_NAME_MAXTEXT + 1];
     unsigned char canonnamearray[2 * DNS_NAME_MAXTEXT + 1];
+    char revarray[DNS_NAME_MAXTEXT + 1];
+    char canonrevarray[2 * DNS_NAME_MAXTEXT + 4];
     unsigned char typearray[20];
     unsigned char canontypearray[40];
     unsigned char dataarray[2048];
     unsigned char canondataarray[4096];
+    char hexarray[2 * MAX_RDATA + 4];
+    char str[10240];
     isc_buffer_t b;
     isc_result_t result;
 
     isc_buffer_init(&b, namearray, sizeof(namearray) - 1);
     result = dns_name_totext(name, ISC_TRUE, &b);
-    check_result(result, "dns_name_totext");
+    if (result != ISC_R_SUCCESS)
+        goto failure;
     namearray[isc_buffer_usedlength(&b)] = 0;
     quotestring(namearray, canonnamearray);
+    if (im->rname)
+    {
+        reversename((char *) namearray, revarray);
+        canonrevarray[0] = '\'';
+        quotestring(revarray, canonrevarray + 1);
+        strcat(canonrevarray, "'");
+    }
 
     isc_buffer_init(&b, typearray, sizeof(typearray) - 1);
     result = dns_rdatatype_totext(rdata->type, &b);
-    check_result(result, "dns_rdatatype_totext");
+    if (result != ISC_R_SUCCESS)
+        goto failure;
     typearray[isc_buffer_usedlength(&b)] = 0;
     quotestring(typearray, canontypearray);
 
     isc_buffer_init(&b, dataarray, sizeof(dataarray) - 1);
     result = dns_rdata_totext(rdata, NULL, &b);
-    check_result(result, "dns_rdata_totext");
+    if (result != ISC_R_SUCCESS)
+        goto failure;
     dataarray[isc_buffer_usedlength(&b)] = 0;
     quotestring(dataarray, canondataarray);
 
-    snprintf(str, sizeof(str),
-            "INSERT INTO %s (name, ttl, rdtype, rdata)"
-            " VALUES ('%s', %d, '%s', '%s')",
-            dbtable, canonnamearray, ttl, canontypearray, canondataarray);
-    printf("%s\n", str);
-    if( mysql_query(&conn, str) != 0 )
+    if (im->rdata)
+        hexrdata(rdata, hexarray);
+
+    if (im->pending == 0)
     {
-        fprintf(stderr, "INSERT INTO command failed: %s\n", mysql_error(&conn));
-        closeandexit(1);
+        if (im->tenant_id != NULL)
+            snprintf(str, sizeof(str),
+                    "INSERT INTO %s (tenant_id, domain_id, name, ttl, type, data%s%s) VALUES ",
+                    im->table, im->rdata ? ", rdata" : "", im->rname ? ", rname" : "");
+        else
+            snprintf(str, sizeof(str),
+                    "INSERT INTO %s (name, ttl, rdtype, rdata) VALUES ",
+                    im->table);
+        result = append(im, str);
+        if (result != ISC_R_SUCCESS)
+            return (result);
     }
+    if (im->tenant_id != NULL)
+        snprintf(str, sizeof(str), "%s('%s', '%s', '%s', %d, '%s', '%s'%s%s%s%s)",
+                (im->pending > 0) ? ", " : "",
+                im->tenant_id, im->domain_id,
+                canonnamearray, ttl, canontypearray, canondataarray,
+                im->rdata ? ", " : "", im->rdata ? hexarray : "",
+                im->rname ? ", " : "", im->rname ? canonrevarray : "");
+    else
+        snprintf(str, sizeof(str), "%s('%s', %d, '%s', '%s')",
+                (im->pending > 0) ? ", " : "",
+                canonnamearray, ttl, canontypearray, canondataarray);
+    result = append(im, str);
+    if (result != ISC_R_SUCCESS)
+        return (result);
+    im->pending++;
+
+    if (im->pending >= im->batch || im->len >= MAX_STATEMENT)
+        return (flush(im, ISC_FALSE));
+    return (ISC_R_SUCCESS);
+
+ failure:
+    fprintf(stderr, "unable to convert record: %s\n", isc_result_totext(result));
+    return (result);
 }
 
-int main(int argc, char **argv)
+#define CHECK(op, message) \
+    do { \
+        result = (op); \
+        if (result != ISC_R_SUCCESS) \
+        { \
+            fprintf(stderr, "%s: %s: %s\n", porigin, message, \
+                    isc_result_totext(result)); \
+            goto cleanup; \
+        } \
+    } while (0)
+
+/*
+ * Load one zone file and insert its records.  In the driver's schema the
+ * zone's existing rows are deleted first.  Everything not yet committed
+ * is rolled back on failure.
+ */
+static isc_result_t
+import_zone(struct importer *im, isc_mem_t *mctx, char *porigin, char *zonefile)
 {
-    char *porigin, *zonefile, *user, *password;
     dns_fixedname_t forigin, fname;
     dns_name_t *origin, *name;
     dns_db_t *db = NULL;
-    dns_dbiterator_t *dbiter;
-    dns_dbnode_t *node;
-    dns_rdatasetiter_t *rdsiter;
+    dns_dbiterator_t *dbiter = NULL;
+    dns_dbnode_t *node = NULL;
+    dns_rdatasetiter_t *rdsiter = NULL;
     dns_rdataset_t rdataset;
     dns_rdata_t rdata = DNS_RDATA_INIT;
-    isc_mem_t *mctx = NULL;
+    unsigned long total = im->total;
+    char str[1024];
     isc_buffer_t b;
     isc_result_t result;
 
-    if (argc != 7)
-    {
-        printf("usage: %s origin file dbname dbtable user password\n", argv[0]);
-        printf("Note that dbname must be an existing database.\n");
-        exit(1);
-    }
-
-    porigin  = argv[1];
-    zonefile = argv[2];
-    dbname   = argv[3];
-    dbtable  = argv[4];
-    user     = argv[5];
-    password = argv[6];
-
-    dns_result_register();
-                
-    mctx   = NULL;
-    result = isc_mem_create(0, 0, &mctx);
-    check_result(result, "isc_mem_create");
+    dns_rdataset_init(&rdataset);
 
     isc_buffer_init(&b, porigin, strlen(porigin));
     isc_buffer_add(&b, strlen(porigin));
     dns_fixedname_init(&forigin);
     origin = dns_fixedname_name(&forigin);
-    result = dns_name_fromtext(origin, &b, dns_rootname, ISC_FALSE, NULL);
-    check_result(result, "dns_name_fromtext");
-        
-    db = NULL;
-    result = dns_db_create(mctx, "rbt", origin, dns_dbtype_zone,
-                             dns_rdataclass_in, 0, NULL, &db);
-    check_result(result, "dns_db_create");
+    CHECK(dns_name_fromtext(origin, &b, dns_rootname, ISC_FALSE, NULL),
+          "dns_name_fromtext");
+
+    CHECK(dns_db_create(mctx, "rbt", origin, dns_dbtype_zone,
+                        dns_rdataclass_in, 0, NULL, &db),
+          "dns_db_create");
 
     result = dns_db_load(db, zonefile);
     if (result == DNS_R_SEENINCLUDE)
     	result = ISC_R_SUCCESS;
-    check_result(result, "dns_db_load");
+    CHECK(result, "dns_db_load");
 
-    printf("Connecting to '%s'\n", dbname);  
-
-    if(!mysql_init(&conn) ||
-       !mysql_real_connect(&conn, "localhost", user, password, dbname, 0, NULL, 0))
-    {
-    	fprintf(stderr, "Connection to database '%s' failed: %s\n",
-    		dbname, mysql_error(&conn));
-    	closeandexit(1);
-    }
-
-    snprintf(str, sizeof(str), "DROP TABLE %s", dbtable);
-    printf("%s\n", str);
-    if( mysql_query(&conn, str) != 0 )
-    {
-        fprintf(stderr, "DROP TABLE command failed: %s\n", mysql_error(&conn));
-    }
-    
-    snprintf(str, sizeof(str),
-	 "CREATE TABLE %s "
-	 "(name VARCHAR(255), ttl INT, rdtype VARCHAR(255), rdata VARCHAR(255)",
-	 dbtable);
-    printf("%s\n", str);
-    if( mysql_query(&conn, str) != 0 )
+    if (im->tenant_id != NULL)
     {
-        fprintf(stderr, "CREATE TABLE command failed: %s\n", mysql_error(&conn));
-        closeandexit(1);
+        snprintf(str, sizeof(str),
+                 "DELETE FROM %s WHERE tenant_id = '%s' AND domain_id = '%s'",
+                 im->table, im->tenant_id, im->domain_id);
+        CHECK(query(im, str, "DELETE FROM"), "DELETE FROM");
     }
 
-    dbiter = NULL;
-    result = dns_db_createiterator(db, ISC_FALSE, &dbiter);
-    check_result(result, "dns_db_createiterator()");
-
-    result = dns_dbiterator_first(dbiter);
-    check_result(result, "dns_dbiterator_first");
+    CHECK(dns_db_createiterator(db, ISC_FALSE, &dbiter),
+          "dns_db_createiterator()");
 
     dns_fixedname_init(&fname);
     name = dns_fixedname_name(&fname);
-    dns_rdataset_init(&rdataset);
-    dns_rdata_init(&rdata);
 
+    result = dns_dbiterator_first(dbiter);
     while (result == ISC_R_SUCCESS)
     {
-        node = NULL;
-        result = dns_dbiterator_current(dbiter, &node, name);
-        if (result == ISC_R_NOMORE)
-            break;
-        check_result(result, "dns_dbiterator_current");
-
-        rdsiter = NULL;
-        result = dns_db_allrdatasets(db, node, NULL, 0, &rdsiter);
-        check_result(result, "dns_db_allrdatasets");
+        CHECK(dns_dbiterator_current(dbiter, &node, name),
+              "dns_dbiterator_current");
+        CHECK(dns_db_allrdatasets(db, node, NULL, 0, &rdsiter),
+              "dns_db_allrdatasets");
 
         result = dns_rdatasetiter_first(rdsiter);
-
         while (result == ISC_R_SUCCESS)
         {
             dns_rdatasetiter_current(rdsiter, &rdataset);
             result = dns_rdataset_first(&rdataset);
-            check_result(result, "dns_rdataset_first");
             while (result == ISC_R_SUCCESS)
             {
                 dns_rdataset_current(&rdataset, &rdata);
-                addrdata(name, rdataset.ttl, &rdata);
+                result = addrdata(im, name, rdataset.ttl, &rdata);
                 dns_rdata_reset(&rdata);
+                if (result != ISC_R_SUCCESS)
+                    goto cleanup;
                 result = dns_rdataset_next(&rdataset);
             }
             dns_rdataset_disassociate(&rdataset);
+            if (result != ISC_R_NOMORE)
+                CHECK(result, "dns_rdataset_next");
             result = dns_rdatasetiter_next(rdsiter);
         }
         dns_rdatasetiter_destroy(&rdsiter);
         dns_db_detachnode(db, &node);
+        if (result != ISC_R_NOMORE)
+            CHECK(result, "dns_rdatasetiter_next");
         result = dns_dbiterator_next(dbiter);
     }
-        
-    dns_dbiterator_destroy(&dbiter);
-    dns_db_detach(&db);
+    if (result != ISC_R_NOMORE)
+        CHECK(result, "dns_dbiterator_next");
+
+    CHECK(flush(im, ISC_TRUE), "import");
+
+ cleanup:
+    if (dns_rdataset_isassociated(&rdataset))
+        dns_rdataset_disassociate(&rdataset);
+    if (rdsiter != NULL)
+        dns_rdatasetiter_destroy(&rdsiter);
+    if (node != NULL)
+        dns_db_detachnode(db, &node);
+    if (dbiter != NULL)
+        dns_dbiterator_destroy(&dbiter);
+    if (db != NULL)
+        dns_db_detach(&db);
+
+    if (result != ISC_R_SUCCESS)
+    {
+        im->total = total;
+        im->pending = 0;
+        im->len = 0;
+        im->uncommitted = 0;
+        mysql_rollback(&im->conn);
+    }
+    return (result);
+}
+
+static isc_result_t
+importer_connect(struct importer *im, const char *host, const char *user,
+                 const char *password, const char *database)
+{
+    if(!mysql_init(&im->conn) ||
+       !mysql_real_connect(&im->conn, host, user, password, database, 0, NULL, 0))
+    {
+    	fprintf(stderr, "Connection to database '%s' failed: %s\n",
+    		database, mysql_error(&im->conn));
+        mysql_close(&im->conn);
+    	return (ISC_R_FAILURE);
+    }
+    if (mysql_autocommit(&im->conn, 0) != 0)
+    {
+        fprintf(stderr, "unable to disable autocommit: %s\n", mysql_error(&im->conn));
+        mysql_close(&im->conn);
+        return (ISC_R_FAILURE);
+    }
+    return (ISC_R_SUCCESS);
+}
+
+/*
+ * Check whether the table has a column.
+ */
+static isc_boolean_t has_column(struct importer *im, const char *column)
+{
+    MYSQL_RES *res;
+    char sql[512];
+
+    snprintf(sql, sizeof(sql), "SELECT %s FROM %s LIMIT 0", column, im->table);
+    if (mysql_query(&im->conn, sql) != 0)
+        return (ISC_FALSE);
+    res = mysql_store_result(&im->conn);
+    if (res != NULL)
+        mysql_free_result(res);
+    return (ISC_TRUE);
+}
+
+/*
+ * Take zones from the manifest until none are left.  A worker whose
+ * connection cannot be (re)established stops and leaves the rest of the
+ * manifest to the others.
+ */
+static isc_threadresult_t
+worker_run(isc_threadarg_t arg)
+{
+    struct manifest *m = (struct manifest *) arg;
+    struct importer im;
+    struct zoneentry *z;
+    unsigned long before;
+    isc_result_t result;
+    double seconds;
+
+    memset(&im, 0, sizeof(im));
+    im.table = m->table;
+    im.batch = m->batch;
+    im.txn = UINT_MAX;
+    im.verbose = m->verbose;
+
+    mysql_thread_init();
+    if (importer_connect(&im, m->host, m->user, m->password,
+                         m->database) != ISC_R_SUCCESS)
+    {
+        mysql_thread_end();
+        return ((isc_threadresult_t) 0);
+    }
+    im.rdata = has_column(&im, "rdata");
+    im.rname = has_column(&im, "rname");
+
+    for (;;)
+    {
+        LOCK(&m->lock);
+        z = (m->next < m->count) ? &m->zones[m->next++] : NULL;
+        UNLOCK(&m->lock);
+        if (z == NULL)
+            break;
+
+        im.tenant_id = z->tenant_id;
+        im.domain_id = z->domain_id;
+        before = im.total;
+        result = import_zone(&im, m->mctx, z->origin, z->file);
+
+        LOCK(&m->lock);
+        m->done++;
+        if (result == ISC_R_SUCCESS)
+            m->records += im.total - before;
+        else
+            m->failed++;
+        seconds = elapsed(&m->start);
+        printf("[%u/%u] %s: %s, %lu records (%.0f records/second)\n",
+               m->done, m->count, z->origin,
+               (result == ISC_R_SUCCESS) ? "imported" : "FAILED",
+               im.total - before,
+               (seconds > 0) ? m->records / seconds : 0.0);
+        UNLOCK(&m->lock);
+
+        if (result != ISC_R_SUCCESS && mysql_ping(&im.conn) != 0)
+        {
+            mysql_close(&im.conn);
+            if (importer_connect(&im, m->host, m->user, m->password,
+                                 m->database) != ISC_R_SUCCESS)
+            {
+                free(im.stmt);
+                mysql_thread_end();
+                return ((isc_threadresult_t) 0);
+            }
+        }
+    }
+
+    mysql_close(&im.conn);
+    free(im.stmt);
+    mysql_thread_end();
+    return ((isc_threadresult_t) 0);
+}
+
+static char *quotedup(const char *source)
+{
+    char *dest = malloc(2 * strlen(source) + 1);
+
+    if (dest != NULL)
+        quotestring(source, dest);
+    return (dest);
+}
+
+/*
+ * Read the manifest into m->zones.
+ */
+static isc_result_t read_manifest(const char *filename, struct manifest *m)
+{
+    struct zoneentry *zones = NULL, *z;
+    unsigned int nalloc = 0, lineno = 0;
+    char line[4096];
+    char *field[5], *p;
+    int i;
+    FILE *fp;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        perror(filename);
+        return (ISC_R_FAILURE);
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+        field[0] = strtok(line, " \t\r\n");
+        if (field[0] == NULL)
+            continue;
+        for (i = 1; i < 5; i++)
+            field[i] = strtok(NULL, " \t\r\n");
+        if (field[3] == NULL || field[4] != NULL)
+        {
+            fprintf(stderr, "%s:%u: expected origin file tenant_id domain_id\n",
+                    filename, lineno);
+            fclose(fp);
+            return (ISC_R_FAILURE);
+        }
+
+        if (m->count == nalloc)
+        {
+            nalloc = (nalloc == 0) ? 256 : nalloc * 2;
+            zones = realloc(m->zones, nalloc * sizeof(*zones));
+            if (zones == NULL)
+                goto nomemory;
+            m->zones = zones;
+        }
+        z = &m->zones[m->count];
+        z->origin = strdup(field[0]);
+        z->file = strdup(field[1]);
+        z->tenant_id = quotedup(field[2]);
+        z->domain_id = quotedup(field[3]);
+        if (z->origin == NULL || z->file == NULL ||
+            z->tenant_id == NULL || z->domain_id == NULL)
+            goto nomemory;
+        m->count++;
+    }
+    fclose(fp);
+    return (ISC_R_SUCCESS);
+
+ nomemory:
+    fprintf(stderr, "out of memory\n");
+    fclose(fp);
+    return (ISC_R_NOMEMORY);
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-h host] [-b rows] [-t rows] [-v] origin file dbname dbtable user password\n", prog);
+    printf("       %s -m manifest [-j threads] [-h host] [-b rows] [-v] dbname dbtable user password\n", prog);
+    printf("Note that dbname must be an existing database.\n");
+    printf("  -h host      database host (default localhost)\n");
+    printf("  -b rows      rows per multi-row INSERT (default %d)\n", DEFAULT_BATCH);
+    printf("  -t rows      rows per transaction (default %d)\n", DEFAULT_TXN);
+    printf("  -m manifest  import the zones listed in manifest\n");
+    printf("  -j threads   concurrent imports with -m (default %d)\n", DEFAULT_THREADS);
+    printf("  -v           print every statement sent\n");
+    exit(1);
+}
+
+static unsigned int count_arg(const char *prog, const char *arg)
+{
+    char *end;
+    unsigned long val = strtoul(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || val == 0 || val > 0xffffffffUL)
+        usage(prog);
+    return ((unsigned int) val);
+}
+
+static int
+import_manifest(struct manifest *m, unsigned int threads)
+{
+    isc_thread_t tids[MAX_THREADS];
+    unsigned int i, started = 0;
+    double seconds;
+
+    if (threads > m->count)
+        threads = m->count;
+    RUNTIME_CHECK(isc_mutex_init(&m->lock) == ISC_R_SUCCESS);
+    RUNTIME_CHECK(isc_time_now(&m->start) == ISC_R_SUCCESS);
+
+    printf("Importing %u zones into '%s' with %u threads\n",
+           m->count, m->database, threads);
+    for (i = 0; i < threads; i++)
+    {
+        if (isc_thread_create(worker_run, m, &tids[started]) != ISC_R_SUCCESS)
+        {
+            fprintf(stderr, "unable to start import thread\n");
+            break;
+        }
+        started++;
+    }
+    for (i = 0; i < started; i++)
+        isc_thread_join(tids[i], NULL);
+    DESTROYLOCK(&m->lock);
+
+    seconds = elapsed(&m->start);
+    printf("Imported %lu records from %u of %u zones in %.2f seconds "
+           "(%.0f records/second, %.1f zones/second)\n",
+           m->records, m->done - m->failed, m->count, seconds,
+           (seconds > 0) ? m->records / seconds : 0.0,
+           (seconds > 0) ? (m->done - m->failed) / seconds : 0.0);
+    if (m->failed > 0)
+        printf("%u zones failed\n", m->failed);
+    if (m->done < m->count)
+        printf("%u zones were not attempted\n", m->count - m->done);
+
+    return ((m->failed == 0 && m->done == m->count) ? 0 : 1);
+}
+
+int main(int argc, char **argv)
+{
+    char *porigin, *zonefile, *user, *password;
+    char *host = "localhost";
+    char *manifest = NULL;
+    unsigned int threads = DEFAULT_THREADS;
+    struct manifest m;
+    char str[1024];
+    isc_time_t start;
+    double seconds;
+    int ch, status;
+    isc_mem_t *mctx = NULL;
+    isc_result_t result;
+
+    imp.batch = DEFAULT_BATCH;
+    imp.txn = DEFAULT_TXN;
+    while ((ch = getopt(argc, argv, "h:b:t:m:j:v")) != -1)
+    {
+        switch (ch)
+        {
+        case 'h':
+            host = optarg;
+            break;
+        case 'b':
+            imp.batch = count_arg(argv[0], optarg);
+            break;
+        case 't':
+            imp.txn = count_arg(argv[0], optarg);
+            break;
+        case 'm':
+            manifest = optarg;
+            break;
+        case 'j':
+            threads = count_arg(argv[0], optarg);
+            if (threads > MAX_THREADS)
+                usage(argv[0]);
+            break;
+        case 'v':
+            imp.verbose = ISC_TRUE;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    argc -= optind;
+    argv += optind - 1;
+
+    if (argc != ((manifest != NULL) ? 4 : 6))
+        usage(argv[0]);
+
+    dns_result_register();
+                
+    result = isc_mem_create(0, 0, &mctx);
+    check_result(result, "isc_mem_create");
+
+    if (mysql_library_init(0, NULL, NULL) != 0)
+    {
+        fprintf(stderr, "unable to initialize the MySQL client library\n");
+        exit(1);
+    }
+
+    if (manifest != NULL)
+    {
+        memset(&m, 0, sizeof(m));
+        m.database = argv[1];
+        m.table    = argv[2];
+        m.user     = argv[3];
+        m.password = argv[4];
+        m.host     = host;
+        m.batch    = imp.batch;
+        m.verbose  = imp.verbose;
+        m.mctx     = mctx;
+        if (read_manifest(manifest, &m) != ISC_R_SUCCESS)
+            exit(1);
+        if (m.count == 0)
+        {
+            fprintf(stderr, "%s: no zones listed\n", manifest);
+            exit(1);
+        }
+        status = import_manifest(&m, threads);
+        isc_mem_destroy(&mctx);
+        mysql_library_end();
+        return (status);
+    }
+
+    porigin  = argv[1];
+    zonefile = argv[2];
+    dbname   = argv[3];
+    dbtable  = argv[4];
+    user     = argv[5];
+    password = argv[6];
+    imp.table = dbtable;
+
+    printf("Connecting to '%s'\n", dbname);  
+
+    if (importer_connect(&imp, host, user, password, dbname) != ISC_R_SUCCESS)
+        exit(1);
+
+    snprintf(str, sizeof(str), "DROP TABLE %s", dbtable);
+    printf("%s\n", str);
+    if( mysql_query(&imp.conn, str) != 0 )
+    {
+        fprintf(stderr, "DROP TABLE command failed: %s\n", mysql_error(&imp.conn));
+    }
+    
+    snprintf(str, sizeof(str),
+	 "CREATE TABLE %s "
+	 "(name VARCHAR(255), ttl INT, rdtype VARCHAR(255), rdata VARCHAR(255))",
+	 dbtable);
+    printf("%s\n", str);
+    if( mysql_query(&imp.conn, str) != 0 )
+    {
+        fprintf(stderr, "CREATE TABLE command failed: %s\n", mysql_error(&imp.conn));
+        closeandexit(1);
+    }
+
+    RUNTIME_CHECK(isc_time_now(&start) == ISC_R_SUCCESS);
+    if (import_zone(&imp, mctx, porigin, zonefile) != ISC_R_SUCCESS)
+        closeandexit(1);
+    seconds = elapsed(&start);
+    printf("Imported %lu records in %.2f seconds (%.0f records/second)\n",
+           imp.total, seconds, (seconds > 0) ? imp.total / seconds : 0.0);
+
     isc_mem_destroy(&mctx);
-    closeandexit(0);
-    exit(0);
+    mysql_close(&imp.conn);
+    mysql_library_end();
+    return (0);
 }